@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+
+#include "arrivals.h"
+
+// an exponentially distributed value with the given mean
+static double exponential(Random& rng, double mean)
+{
+	return -mean * std::log1p(-rng.uniform());
+}
+
+double PoissonArrivals::gap(Random& rng) const
+{
+	return exponential(rng, 1.0);
+}
+
+//
+// each burst ends after any packet with probability 1 / burst, so
+// its length is geometrically distributed with a mean of `burst`,
+// and over a whole cycle the time on (burst / peak) plus the mean
+// idle time is equal to `burst` mean gaps
+//
+double OnOffArrivals::gap(Random& rng) const
+{
+	double res = exponential(rng, 1.0 / peak);
+	if (rng.uniform() * burst < 1.0) {
+		res += exponential(rng, burst * (1.0 - 1.0 / peak));
+	}
+	return res;
+}
+
+EmpiricalArrivals::EmpiricalArrivals(const std::string& filename)
+{
+	std::ifstream file(filename);
+	if (!file) {
+		throw std::runtime_error("can't open arrivals file: " + filename);
+	}
+
+	std::string line;
+	while (std::getline(file, line)) {
+		if (line.empty() || line[0] == '#') {
+			continue;
+		}
+		char *end;
+		double v = strtod(line.c_str(), &end);
+		if (end == line.c_str() || v < 0 || !std::isfinite(v)) {
+			throw std::runtime_error("invalid inter-arrival time: " + line);
+		}
+		gaps.push_back(v);
+	}
+
+	double total = std::accumulate(gaps.cbegin(), gaps.cend(), 0.0);
+	if (total <= 0) {
+		throw std::runtime_error("no inter-arrival times in " + filename);
+	}
+
+	double mean = total / gaps.size();
+	for (auto& v: gaps) {
+		v /= mean;
+	}
+}
+
+double EmpiricalArrivals::gap(Random& rng) const
+{
+	return gaps[rng.below(gaps.size())];
+}
+
+//---------------------------------------------------------------------
+
+ArrivalSchedule::ArrivalSchedule(const ArrivalProcess& process, uint64_t seed)
+	: gaps(default_size), rng(seed)
+{
+	for (auto& v: gaps) {
+		v = process.gap(rng);
+	}
+}
+
+//
+// takes the gaps between every `stride`'th capture time from `first`,
+// i.e. those of the queries that one of `stride` threads will send
+//
+ArrivalSchedule::ArrivalSchedule(const std::vector<uint64_t>& times,
+				 size_t first, size_t stride, double speed)
+	: is_timed(true)
+{
+	size_t n = times.size();
+	if (n < 2 || times.back() == 0) {
+		throw std::runtime_error("capture is too short to replay its timing");
+	}
+
+	// a thread with no queries of its own just repeats the first
+	first = std::min(first, n - 1);
+
+	double period = double(times.back()) * n / (n - 1);
+	offset = times[first] / speed;
+
+	size_t i = first;
+	for (; i + stride < n; i += stride) {
+		gaps.push_back((times[i + stride] - times[i]) / speed);
+	}
+	gaps.push_back((period - times[i] + times[first]) / speed);
+}
+
+//---------------------------------------------------------------------
+
+//
+// creates an arrival process from its command line specification,
+// or returns null for evenly spaced packets
+//
+//   uniform
+//   poisson
+//   onoff:<burst>[,<peak>]
+//   empirical:<filename>
+//
+std::unique_ptr<ArrivalProcess> ArrivalProcess::create(const std::string& spec)
+{
+	auto colon = spec.find(':');
+	auto name = spec.substr(0, colon);
+	auto args = (colon == std::string::npos) ? std::string() : spec.substr(colon + 1);
+
+	std::unique_ptr<ArrivalProcess> res;
+
+	if (name == "uniform" && args.empty()) {
+		// nothing to do
+	} else if (name == "poisson" && args.empty()) {
+		res.reset(new PoissonArrivals());
+	} else if (name == "onoff" && !args.empty()) {
+		std::vector<double> p;
+		std::istringstream is(args);
+		std::string item;
+		while (std::getline(is, item, ',')) {
+			char *end;
+			p.push_back(strtod(item.c_str(), &end));
+			if (item.empty() || *end) {
+				p.clear();
+				break;
+			}
+		}
+		if (p.empty() || p.size() > 2) {
+			throw std::runtime_error("invalid on/off arrivals: " + args);
+		}
+		double burst = p[0];
+		double peak = (p.size() > 1) ? p[1] : 10.0;
+		if (burst < 1 || peak <= 1) {
+			throw std::runtime_error("on/off burst must be at least 1 and peak more than 1");
+		}
+		res.reset(new OnOffArrivals(burst, peak));
+	} else if (name == "empirical" && !args.empty()) {
+		res.reset(new EmpiricalArrivals(args));
+	} else {
+		throw std::runtime_error("invalid arrival process: " + spec);
+	}
+
+	return res;
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "random.h"
+
+//
+// a stochastic process that generates the gaps between packets
+//
+// gaps are in units of the mean gap (i.e. their mean is 1) so that
+// they are independent of the sending rate, and the pacer scales them
+// by the current target rate when each one is used.
+//
+class ArrivalProcess {
+
+public:
+	virtual				~ArrivalProcess() = default;
+
+public:
+	virtual double			gap(Random& rng) const = 0;
+
+public:
+	static std::unique_ptr<ArrivalProcess> create(const std::string& spec);
+};
+
+// exponentially distributed gaps, i.e. a Poisson process
+class PoissonArrivals : public ArrivalProcess {
+
+public:
+	double				gap(Random& rng) const override;
+};
+
+//
+// bursts of Poisson arrivals at `peak` times the mean rate, with
+// on average `burst` packets in each, separated by exponentially
+// distributed idle periods long enough to restore the mean rate
+//
+class OnOffArrivals : public ArrivalProcess {
+
+private:
+	double				burst;
+	double				peak;
+
+public:
+					OnOffArrivals(double burst, double peak)
+						: burst(burst), peak(peak) {};
+
+public:
+	double				gap(Random& rng) const override;
+};
+
+//
+// gaps drawn at random from a list of observed gaps (e.g. from a
+// packet capture) in any unit, which are normalised to a mean of 1
+//
+class EmpiricalArrivals : public ArrivalProcess {
+
+private:
+	std::vector<double>		gaps;
+
+public:
+					EmpiricalArrivals(const std::string& filename);
+
+public:
+	double				gap(Random& rng) const override;
+};
+
+//
+// a per-thread table of gaps precomputed from an arrival process, so
+// that generating them costs nothing on the send path
+//
+// the table is used in a cycle, restarting from a random position
+// each time round so that the sequence doesn't repeat exactly.
+//
+// alternatively the table may hold the actual gaps in ns between one
+// thread's share of the queries in a packet capture, which are then
+// replayed in order, starting from the time of its first query.  the
+// capture then repeats after the mean gap between its queries.
+//
+class ArrivalSchedule {
+
+private:
+	static const size_t		default_size = 1 << 17;
+
+	std::vector<double>		gaps;
+	Random				rng;
+	size_t				pos = 0;
+	bool				is_timed = false;
+	double				offset = 0;
+
+public:
+					ArrivalSchedule(const ArrivalProcess& process, uint64_t seed);
+					ArrivalSchedule(const std::vector<uint64_t>& times,
+							size_t first, size_t stride, double speed);
+
+public:
+	// whether the gaps are in ns rather than units of the mean gap
+	bool				timed() const { return is_timed; };
+
+	// how long after the start the first packet is due, in ns
+	double				start() const { return offset; };
+
+	double				next() {
+		if (pos == gaps.size()) {
+			pos = is_timed ? 0 : rng.below(gaps.size());
+		}
+		return gaps[pos++];
+	};
+};
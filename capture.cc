@@ -0,0 +1,332 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "util.h"
+
+// pcap file header, for nanosecond timestamps
+typedef struct {
+	uint32_t			magic;
+	uint16_t			version_major;
+	uint16_t			version_minor;
+	int32_t				thiszone;
+	uint32_t			sigfigs;
+	uint32_t			snaplen;
+	uint32_t			linktype;
+} pcap_header_t;
+
+// pcap record header
+typedef struct {
+	uint32_t			sec;
+	uint32_t			nsec;
+	uint32_t			caplen;
+	uint32_t			len;
+} pcap_record_t;
+
+static const uint32_t pcap_magic_ns = 0xa1b23c4d;
+static const uint32_t linktype_raw = 101;
+
+// writes the whole of a buffer at the given offset
+static bool pwrite_all(int fd, const uint8_t* data, size_t size, uint64_t offset)
+{
+	while (size > 0) {
+		auto res = ::pwrite(fd, data, size, offset);
+		if (res < 0 && errno == EINTR) {
+			continue;
+		}
+		if (res <= 0) {
+			return false;
+		}
+		data += res;
+		size -= res;
+		offset += res;
+	}
+	return true;
+}
+
+CaptureFile::CaptureFile(const std::string& filename, size_t snaplen)
+	: snaplen(snaplen)
+{
+	fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		throw_errno("opening capture output file");
+	}
+
+	pcap_header_t hdr = { pcap_magic_ns, 2, 4, 0, 0, uint32_t(snaplen), linktype_raw };
+	if (!pwrite_all(fd, reinterpret_cast<uint8_t*>(&hdr), sizeof(hdr), 0)) {
+		::close(fd);
+		throw_errno("writing capture output file");
+	}
+	offset = sizeof(hdr);
+}
+
+CaptureFile::~CaptureFile()
+{
+	if (writer.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		cv.notify_one();
+		writer.join();
+	}
+
+	::close(fd);
+}
+
+//
+// queues a block for the writer thread, starting it if necessary
+//
+void CaptureFile::write(const uint8_t* data, size_t size, uint64_t offset, std::atomic<int>* state)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!writer.joinable()) {
+			writer = std::thread(&CaptureFile::run, this);
+		}
+		jobs.push_back(job_t { data, size, offset, state });
+	}
+	cv.notify_one();
+}
+
+// the writer thread, which finishes any queued blocks before stopping
+void CaptureFile::run()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+
+	while (true) {
+		cv.wait(lock, [this] { return stopping || !jobs.empty(); });
+		if (jobs.empty()) {
+			break;
+		}
+
+		auto job = jobs.front();
+		jobs.pop_front();
+
+		lock.unlock();
+		bool ok = pwrite_all(fd, job.data, job.size, job.offset);
+		job.state->store(ok ? block_written : block_failed, std::memory_order_release);
+		lock.lock();
+	}
+}
+
+//---------------------------------------------------------------------
+
+CaptureBuffer::CaptureBuffer(CaptureFile& file, size_t every, bool random, uint64_t seed)
+	: file(file), every(std::max(size_t(1), every)), random(random), rng(seed)
+{
+	for (auto& block: blocks) {
+		block.data.reset(new uint8_t[block_size]);
+		block.state = CaptureFile::block_free;
+	}
+
+	// fall back to the writer thread if io_uring isn't available
+	try {
+		ring.open(block_count);
+		uring = true;
+	} catch (std::runtime_error&) {
+		uring = false;
+	}
+}
+
+//
+// collects the results of completed io_uring writes
+//
+void CaptureBuffer::reap()
+{
+	if (ring.fd < 0) {
+		return;
+	}
+
+	while (auto cqe = ring.peek()) {
+		auto& block = blocks[cqe->user_data];
+		bool ok = (cqe->res >= 0) && (size_t(cqe->res) == block.size);
+		block.state.store(ok ? CaptureFile::block_written : CaptureFile::block_failed);
+		ring.seen();
+		--in_flight;
+	}
+}
+
+//
+// waits for every write queued on the ring to complete
+//
+void CaptureBuffer::drain()
+{
+	while (in_flight) {
+		if (ring.submit(1) < 0 && errno != EINTR) {
+			throw_errno("io_uring_enter");
+		}
+		reap();
+	}
+}
+
+//
+// counts the packets in any blocks that have finished being written,
+// and frees those blocks
+//
+void CaptureBuffer::account()
+{
+	reap();
+
+	for (auto& block: blocks) {
+		int state = block.state.load(std::memory_order_acquire);
+		if (state == CaptureFile::block_written) {
+			captured.add(block.packets);
+		} else if (state == CaptureFile::block_failed) {
+			dropped.add(block.packets);
+		} else {
+			continue;
+		}
+		block.state = CaptureFile::block_free;
+	}
+}
+
+//
+// finds a free block to fill, or returns null if there are none
+//
+CaptureBuffer::block_t* CaptureBuffer::next_block()
+{
+	account();
+
+	for (auto& block: blocks) {
+		if (block.state == CaptureFile::block_free) {
+			block.state = CaptureFile::block_filling;
+			block.size = 0;
+			block.packets = 0;
+			return &block;
+		}
+	}
+
+	return nullptr;
+}
+
+//
+// starts writing the current block
+//
+void CaptureBuffer::submit()
+{
+	auto& block = *current;
+	current = nullptr;
+
+	if (block.packets == 0) {
+		block.state = CaptureFile::block_free;
+		return;
+	}
+
+	uint64_t offset = file.reserve(block.size);
+	block.state = CaptureFile::block_writing;
+
+	if (uring) {
+		auto sqe = ring.get_sqe();
+		if (sqe) {
+			sqe->opcode = IORING_OP_WRITE;
+			sqe->flags = IOSQE_ASYNC;	// never write inline
+			sqe->fd = file.get_fd();
+			sqe->addr = reinterpret_cast<uint64_t>(block.data.get());
+			sqe->len = block.size;
+			sqe->off = offset;
+			sqe->user_data = &block - blocks;
+
+			int res;
+			do {
+				res = ring.submit();
+			} while (res < 0 && errno == EINTR);
+			if (res >= 0) {
+				++in_flight;
+				return;
+			}
+
+			// the kernel refused it, so it must not be left
+			// in the ring to be submitted again later
+			ring.retract();
+		}
+
+		// the block's space in the file is already reserved, so
+		// it can be handed to the writer thread straight away.  any
+		// writes still on the ring are reaped later by account()
+		uring = false;
+	}
+
+	file.write(block.data.get(), block.size, offset, &block.state);
+}
+
+//
+// copies a packet into the current block, if it's to be sampled
+//
+void CaptureBuffer::add(const uint8_t* pkt, size_t len, uint64_t timestamp)
+{
+	if (random ? (rng.below(every) != 0) : (++seen % every != 0)) {
+		return;
+	}
+
+	size_t caplen = std::min(len, file.get_snaplen());
+	size_t size = sizeof(pcap_record_t) + caplen;
+
+	if (current && current->size + size > block_size) {
+		submit();
+	}
+	if (!current) {
+		current = next_block();
+	}
+	if (!current || size > block_size) {
+		dropped.add();
+		return;
+	}
+
+	pcap_record_t rec = {
+		uint32_t(timestamp / 1000000000), uint32_t(timestamp % 1000000000),
+		uint32_t(caplen), uint32_t(len)
+	};
+
+	auto p = current->data.get() + current->size;
+	memcpy(p, &rec, sizeof(rec));
+	memcpy(p + sizeof(rec), pkt, caplen);
+	current->size += size;
+	current->packets += 1;
+}
+
+//
+// writes any partially filled block, and then waits for every
+// write to complete so that the counters are final
+//
+void CaptureBuffer::flush()
+{
+	if (current) {
+		submit();
+	}
+
+	while (true) {
+		account();
+
+		bool busy = false;
+		for (auto& block: blocks) {
+			if (block.state.load(std::memory_order_acquire) == CaptureFile::block_writing) {
+				busy = true;
+			}
+		}
+		if (!busy) {
+			break;
+		}
+
+		if (in_flight) {
+			drain();
+		} else {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+}
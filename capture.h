@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "random.h"
+#include "stats.h"
+#include "uring.h"
+
+//
+// a pcap file (of raw IP packets, with ns timestamps) that is written
+// in blocks by any number of threads
+//
+// each block is written at its own offset, reserved when the block
+// is complete, so the blocks from different threads are interleaved
+// in the order they were completed.  blocks that can't be written
+// with io_uring are passed to a writer thread instead, which is only
+// started if it's needed.
+//
+class CaptureFile {
+
+public:
+	// the state of a block being written
+	enum {
+		block_free,
+		block_filling,
+		block_writing,
+		block_written,
+		block_failed
+	};
+
+private:
+	typedef struct {
+		const uint8_t*		data;
+		size_t			size;
+		uint64_t		offset;
+		std::atomic<int>*	state;
+	} job_t;
+
+	int				fd;
+	size_t				snaplen;
+	std::atomic<uint64_t>		offset;
+
+	std::thread			writer;
+	std::mutex			mutex;
+	std::condition_variable		cv;
+	std::deque<job_t>		jobs;
+	bool				stopping = false;
+
+private:
+	void				run();
+
+public:
+					CaptureFile(const std::string& filename, size_t snaplen);
+					~CaptureFile();
+
+public:
+	int				get_fd() const { return fd; };
+	size_t				get_snaplen() const { return snaplen; };
+
+	uint64_t			reserve(size_t size) { return offset.fetch_add(size); };
+	void				write(const uint8_t* data, size_t size, uint64_t offset, std::atomic<int>* state);
+};
+
+//
+// one receiving thread's capture buffers
+//
+// packets are copied into the current block until it's full, and it's
+// then written asynchronously, via the thread's own io_uring instance
+// if possible, while the next free block is filled.  if every block is
+// still being written then packets are dropped rather than waiting.
+//
+// responses are captured either every Nth one, or at random with a
+// probability of 1 in N.
+//
+class CaptureBuffer {
+
+private:
+	static const size_t		block_size = 4 << 20;
+	static const size_t		block_count = 4;
+
+	typedef struct {
+		std::unique_ptr<uint8_t[]>	data;
+		size_t			size = 0;
+		size_t			packets = 0;
+		std::atomic<int>	state;
+	} block_t;
+
+	CaptureFile&			file;
+	IoUring				ring;
+	bool				uring = false;
+	size_t				in_flight = 0;	// writes queued on the ring
+
+	size_t				every;
+	bool				random;
+	Random				rng;
+	uint64_t			seen = 0;
+
+	block_t				blocks[block_count];
+	block_t*			current = nullptr;
+
+private:
+	void				reap();
+	void				drain();
+	void				account();
+	block_t*			next_block();
+	void				submit();
+
+public:
+	Counter				captured;	// packets written
+	Counter				dropped;	// packets not written
+
+public:
+					CaptureBuffer(CaptureFile& file, size_t every, bool random, uint64_t seed);
+
+public:
+	void				add(const uint8_t* pkt, size_t len, uint64_t timestamp);
+	void				flush();
+};
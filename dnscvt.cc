@@ -11,9 +11,22 @@
 
 #include <cstdlib>
 #include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <functional>
 #include <iostream>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
 #include "queryfile.h"
+#include "util.h"
 
 // via https://stackoverflow.com/a/2072890/6782
 inline bool ends_with(std::string const & value, std::string const & ending)
@@ -22,32 +35,355 @@ inline bool ends_with(std::string const & value, std::string const & ending)
     return std::equal(ending.rbegin(), ending.rend(), value.rbegin());
 }
 
+//
+// the text is read in line-aligned blocks of (at least) this size,
+// each of which passes through one slot of a fixed size ring, so
+// memory use is bounded regardless of the size of the input
+//
+static const size_t block_size = 4 << 20;
+
+typedef struct {
+	enum { empty, loaded, parsed }	state = empty;
+	std::vector<char>		text;
+	QueryFile::Chunk		chunk;
+} slot_t;
+
+typedef struct {
+	std::vector<slot_t>		slots;
+
+	// EDNS parameters to apply, if any
+	bool				edns = false;
+	uint16_t			edns_buflen = 0;
+	uint16_t			edns_flags = 0;
+
+	// sequence numbers of the next blocks to be loaded and parsed,
+	// and the total number of blocks once the input is exhausted
+	size_t				loaded = 0;
+	size_t				parsing = 0;
+	size_t				total = SIZE_MAX;
+
+	size_t				count = 0;
+
+	bool				abort = false;
+	std::exception_ptr		error;
+
+	std::mutex			mutex;
+	std::condition_variable		cv;
+} pipeline_t;
+
+static slot_t& slot(pipeline_t& pl, size_t seq)
+{
+	return pl.slots[seq % pl.slots.size()];
+}
+
+//
+// records the first failure and stops every stage of the pipeline
+//
+static void fail(pipeline_t& pl, std::exception_ptr e)
+{
+	std::lock_guard<std::mutex> lock(pl.mutex);
+	if (!pl.error) {
+		pl.error = e;
+	}
+	pl.abort = true;
+	pl.cv.notify_all();
+}
+
+//
+// reads the input into empty slots, cutting each block after
+// its last complete line and carrying the remainder forward
+//
+static void reader(pipeline_t& pl, int fd)
+{
+	std::vector<char> carry;
+	size_t seq = 0;
+	bool eof = false;
+
+	while (!eof) {
+		{
+			std::unique_lock<std::mutex> lock(pl.mutex);
+			pl.cv.wait(lock, [&]() {
+				return pl.abort || slot(pl, seq).state == slot_t::empty;
+			});
+			if (pl.abort) return;
+		}
+
+		auto& text = slot(pl, seq).text;
+		text.assign(carry.cbegin(), carry.cend());
+		size_t used = text.size();
+		const char* eol = nullptr;
+
+		while (!eof) {
+			if (used == text.size()) {
+				text.resize(used + block_size);
+			}
+
+			auto n = ::read(fd, text.data() + used, text.size() - used);
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				throw_errno("reading query file");
+			} else if (n == 0) {
+				eof = true;
+			} else {
+				used += n;
+			}
+
+			if (used >= block_size) {
+				eol = reinterpret_cast<const char*>(memrchr(text.data(), '\n', used));
+				if (eol) break;
+			}
+		}
+
+		size_t cut = eof ? used : (eol - text.data()) + 1;
+		carry.assign(text.cbegin() + cut, text.cbegin() + used);
+		text.resize(cut);
+
+		std::lock_guard<std::mutex> lock(pl.mutex);
+		if (!text.empty()) {
+			slot(pl, seq++).state = slot_t::loaded;
+			pl.loaded = seq;
+		}
+		if (eof) {
+			pl.total = seq;
+		}
+		pl.cv.notify_all();
+	}
+}
+
+//
+// encodes loaded blocks in whatever order the workers reach them
+//
+static void worker(pipeline_t& pl)
+{
+	for (;;) {
+		size_t seq;
+		{
+			std::unique_lock<std::mutex> lock(pl.mutex);
+			pl.cv.wait(lock, [&]() {
+				return pl.abort || pl.parsing < pl.loaded || pl.parsing == pl.total;
+			});
+			if (pl.abort || pl.parsing == pl.total) return;
+			seq = pl.parsing++;
+		}
+
+		auto& s = slot(pl, seq);
+		s.chunk = QueryFile::Chunk();
+		QueryFile::parse_txt(s.text.data(), s.text.data() + s.text.size(), s.chunk, seq * 40503);
+		if (pl.edns && s.chunk.error.empty()) {
+			QueryFile::edns(s.chunk, pl.edns_buflen, pl.edns_flags);
+		}
+
+		std::lock_guard<std::mutex> lock(pl.mutex);
+		s.state = slot_t::parsed;
+		pl.cv.notify_all();
+	}
+}
+
+//
+// writes parsed blocks strictly in input order, keeping track of
+// line numbers so that errors can be reported against the input
+//
+static void writer(pipeline_t& pl, QueryWriter& out)
+{
+	size_t line_no = 0;
+
+	for (size_t seq = 0; ; ++seq) {
+		{
+			std::unique_lock<std::mutex> lock(pl.mutex);
+			pl.cv.wait(lock, [&]() {
+				return pl.abort || seq == pl.total ||
+				       (seq < pl.loaded && slot(pl, seq).state == slot_t::parsed);
+			});
+			if (pl.abort || seq == pl.total) return;
+		}
+
+		auto& s = slot(pl, seq);
+		if (!s.chunk.error.empty()) {
+			std::string error = "reading query file at line "
+					+ std::to_string(line_no + s.chunk.error_line)
+					+ ": " + s.chunk.error;
+			throw std::runtime_error(error);
+		}
+		if (!s.chunk.spans.empty()) {
+			throw std::runtime_error("name templates can't be stored in raw files");
+		}
+
+		out.write(s.chunk);
+		line_no += s.chunk.lines;
+		pl.count += s.chunk.index.size();
+		s.chunk = QueryFile::Chunk();
+
+		std::lock_guard<std::mutex> lock(pl.mutex);
+		s.state = slot_t::empty;
+		pl.cv.notify_all();
+	}
+}
+
+//
+// runs the reader on the calling thread, with a pool of workers
+// and a single writer, and returns the number of queries written
+//
+static size_t convert(pipeline_t& pl, int in, QueryWriter& out, size_t threads)
+{
+	pl.slots.resize(threads + 2);
+
+	auto guard = [&](std::function<void()> fn) {
+		return [&pl, fn]() {
+			try {
+				fn();
+			} catch (...) {
+				fail(pl, std::current_exception());
+			}
+		};
+	};
+
+	std::vector<std::thread> pool;
+	for (size_t i = 0; i < threads; ++i) {
+		pool.emplace_back(guard([&]() { worker(pl); }));
+	}
+	pool.emplace_back(guard([&]() { writer(pl, out); }));
+
+	guard([&]() { reader(pl, in); })();
+
+	for (auto& t: pool) {
+		t.join();
+	}
+
+	if (pl.error) {
+		std::rethrow_exception(pl.error);
+	}
+
+	out.close();
+
+	return pl.count;
+}
+
+void __attribute__((__noreturn__)) usage(int result = EXIT_FAILURE)
+{
+	using namespace std;
+
+	cerr << "usage: dnscvt [-f <format>] [-o <outfile>] [-U <bufsize>] [-X] [-T <threads>] <txtfile>" << endl;
+	cerr << "       dnscvt -c <rawfile>" << endl;
+	cerr << "  -f output format: raw or indexed (default: raw)" << endl;
+	cerr << "  -o output file, or - for stdout (default: <txtfile>.raw)" << endl;
+	cerr << "  -U add EDNS OPT RR with the specified UDP buffer size" << endl;
+	cerr << "  -X add EDNS OPT RR with the DO bit set" << endl;
+	cerr << "  -T the number of encoding threads (default: all cores)" << endl;
+	cerr << "  -c check the integrity of a raw file" << endl;
+	cerr << "  use - as the <txtfile> to read from stdin" << endl;
+
+	exit(result);
+}
+
 int main(int argc, char *argv[])
 {
-	if (argc != 2) {
-		std::cerr << "usage: dnscvt <txtfile>" << std::endl;
-		return EXIT_FAILURE;
+	std::string format("raw");
+	std::string output;
+	bool check = false;
+	bool edns = false;
+	bool do_bit = false;
+	int bufsize = 0;
+	int threads = std::max(1U, std::thread::hardware_concurrency());
+
+	int opt;
+	while ((opt = getopt(argc, argv, "f:o:U:XT:ch")) != -1) {
+		switch (opt) {
+			case 'f': format = optarg; break;
+			case 'o': output = optarg; break;
+			case 'U': bufsize = atoi(optarg); edns = true; break;
+			case 'X': do_bit = true; break;
+			case 'T': threads = atoi(optarg); break;
+			case 'c': check = true; break;
+			case 'h': usage(EXIT_SUCCESS);
+			default: usage();
+		}
+	}
+
+	if ((optind != argc - 1) || (format != "raw" && format != "indexed") ||
+	    (edns && (bufsize <= 0 || bufsize > 65535)) || (threads <= 0))
+	{
+		usage();
 	}
 
+	std::string input(argv[optind]);
+	int in = -1, out = -1;
+
 	try {
-		QueryFile	qf;
+		// verify an existing raw file
+		if (check) {
+			QueryFile qf;
+			qf.read_raw(input);
+			if (!qf.verify()) {
+				std::cerr << input << ": corrupt" << std::endl;
+				return EXIT_FAILURE;
+			}
+			std::cout << input << ": " << qf.size() << " queries OK" << std::endl;
+			return EXIT_SUCCESS;
+		}
+
+		if (input == "-") {
+			in = STDIN_FILENO;
+			if (output.empty()) {
+				output = "-";
+			}
+		} else {
+			in = ::open(input.c_str(), O_RDONLY);
+			if (in < 0) {
+				throw_errno("opening query file");
+			}
+			::posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+		}
+
+		// default to the input name less .txt, plus .raw
+		if (output.empty()) {
+			output = input;
+			if (ends_with(output, ".txt")) {
+				output.erase(output.length() - 4);
+			}
+			output += ".raw";
+		}
 
-		// remove .txt extension if found
-		std::string input(argv[1]);
-		std::string output = input;
+		if (output == "-") {
+			out = STDOUT_FILENO;
+		} else {
+			out = ::open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+			if (out < 0) {
+				throw_errno("opening output file");
+			}
+		}
 
-		if (ends_with(output, ".txt")) {
-			output.erase(output.length() - 4);
+		pipeline_t pl;
+		if (edns || do_bit) {
+			pl.edns = true;
+			pl.edns_buflen = std::max(bufsize, 512);
+			pl.edns_flags = do_bit << 15;
 		}
 
-		// append .raw
-		output += ".raw";
+		bool indexed = (format == "indexed");
+		QueryWriter writer(out, indexed,
+				   pl.edns ? QueryFile::flag_edns : 0,
+				   pl.edns_buflen, pl.edns_flags);
 
-		// start the conversion
-		qf.read_txt(input);
-		qf.write_raw(output);
+		convert(pl, in, writer, threads);
 
-	} catch (std::runtime_error& e) {
+	} catch (std::exception& e) {
 		std::cerr << "error: " << e.what() << std::endl;
+
+		// don't leave a truncated output file behind
+		if (out >= 0 && out != STDOUT_FILENO) {
+			::unlink(output.c_str());
+		}
+		return EXIT_FAILURE;
 	}
+
+	if (in > STDIN_FILENO) {
+		::close(in);
+	}
+
+	if (out > STDOUT_FILENO && ::close(out) < 0) {
+		std::cerr << "error: closing output file: " << strerror(errno) << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
 }
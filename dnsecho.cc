@@ -13,6 +13,7 @@
 #include <stdexcept>
 #include <cerrno>
 #include <cstring>
+#include <vector>
 #include <thread>
 
 #include <unistd.h>
@@ -22,6 +23,7 @@
 #include <sys/mman.h>
 #include <net/if.h>
 #include <netinet/ip.h>
+#include <netinet/ip6.h>
 #include <netinet/udp.h>
 
 #include <linux/version.h>
@@ -29,22 +31,78 @@
 #include <linux/if_packet.h>
 
 #include "packet.h"
+#include "xdp.h"
 #include "util.h"
 
 // per thread state
 typedef struct {
 	PacketSocket			packet;
+	XdpSocket			xdp;
 	uint64_t			poll_count = 0;
 	uint64_t			rx_count = 0;
+	std::vector<mmsghdr>		msgs;
+	std::vector<iovec>		iovecs;
+	PacketSocket::rx_frame_t*	frames;
+	size_t				frame_num;
 } thread_data_t;
 
 // top level state
 typedef struct {
 	uint16_t			dest_port;
+	int				rx_version;
+	bool				xdp;
+	XdpProgram			prog;
 } global_data_t;
 
 global_data_t gd;
 
+//
+// flips the source and destination addresses and ports of a raw
+// IPv4 or IPv6 packet buffer (of the given Ethernet protocol, in
+// network order), returning false if it's not one for us
+//
+// the checksums don't depend on the order of the addresses or ports
+// so they remain valid
+//
+static bool reflect(uint8_t *buffer, size_t buflen, uint16_t proto)
+{
+	size_t hlen;
+	uint8_t next;
+
+	if (proto == htons(ETH_P_IP) && buflen >= sizeof(iphdr)) {
+		auto& ip = *reinterpret_cast<iphdr *>(buffer);
+		hlen = 4 * ip.ihl;
+		next = ip.protocol;
+	} else if (proto == htons(ETH_P_IPV6) && buflen >= sizeof(ip6_hdr)) {
+		auto& ip6 = *reinterpret_cast<ip6_hdr *>(buffer);
+		hlen = sizeof(ip6_hdr);
+		next = ip6.ip6_nxt;
+	} else {
+		return false;
+	}
+
+	// ignore packets that aren't actually for us
+	if (next != IPPROTO_UDP || buflen < hlen + sizeof(udphdr)) {
+		return false;
+	}
+	auto& udp = *reinterpret_cast<udphdr *>(buffer + hlen);
+	if (udp.dest != htons(gd.dest_port)) {
+		return false;
+	}
+
+	// reverse the packet source and address
+	if (proto == htons(ETH_P_IP)) {
+		auto& ip = *reinterpret_cast<iphdr *>(buffer);
+		std::swap(ip.saddr, ip.daddr);
+	} else {
+		auto& ip6 = *reinterpret_cast<ip6_hdr *>(buffer);
+		std::swap(ip6.ip6_src, ip6.ip6_dst);
+	}
+	std::swap(udp.source, udp.dest);
+
+	return true;
+}
+
 //
 // receives a raw packet buffer, flips the source and destination
 // addresses and ports, and sends if back out of the socket
@@ -54,18 +112,11 @@ ssize_t do_echo(uint8_t *buffer, size_t buflen,
 		void *userdata)
 {
 	auto& td = *reinterpret_cast<thread_data_t*>(userdata);
-	auto& ip = *reinterpret_cast<iphdr *>(buffer);
-	auto& udp = *reinterpret_cast<udphdr *>(buffer + 4 * ip.ihl);
 
-	// ignore packets that aren't actually for us
-	if (udp.dest != htons(gd.dest_port)) {
+	if (!reflect(buffer, buflen, addr->sll_protocol)) {
 		return 0;
 	}
 
-	// reverse the packet source and address
-	std::swap(ip.saddr, ip.daddr);
-	std::swap(udp.source, udp.dest);
-
 	// throw it back again
 	auto res = sendto(td.packet.fd, buffer, buflen, MSG_DONTWAIT,
 			reinterpret_cast<const sockaddr *>(addr), sizeof(*addr));
@@ -76,18 +127,134 @@ ssize_t do_echo(uint8_t *buffer, size_t buflen,
 	return res;
 }
 
+//
+// reflects every packet in a TPACKET_V3 block in place and
+// sends them all back out again with a single sendmmsg call
+//
+void do_echo_block(PacketSocket::rx_frame_t* frames, size_t n, void *userdata)
+{
+	auto& td = *reinterpret_cast<thread_data_t*>(userdata);
+
+	if (td.msgs.size() < n) {
+		td.msgs.resize(n);
+		td.iovecs.resize(n);
+	}
+
+	size_t count = 0;
+	for (size_t i = 0; i < n; ++i) {
+		auto& frame = frames[i];
+		if (!reflect(frame.buf, frame.buflen, frame.addr->sll_protocol)) {
+			continue;
+		}
+
+		auto& iov = td.iovecs[count];
+		iov = { frame.buf, frame.buflen };
+
+		auto& hdr = td.msgs[count].msg_hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.msg_iov = &iov;
+		hdr.msg_iovlen = 1;
+		hdr.msg_name = const_cast<sockaddr_ll *>(frame.addr);
+		hdr.msg_namelen = sizeof(*frame.addr);
+
+		++count;
+	}
+
+	// throw them all back again
+	size_t offset = 0;
+	while (offset < count) {
+		auto res = sendmmsg(td.packet.fd, &td.msgs[offset], count - offset, MSG_DONTWAIT);
+		if (res < 0) {
+			if (errno != EAGAIN) {
+				throw_errno("sendmmsg");
+			}
+			break;
+		}
+		offset += res;
+	}
+}
+
+//
+// copies the next reflected frame (including its Ethernet header,
+// with the MAC addresses swapped) into an AF_XDP transmit frame
+//
+static size_t copy_eth_frame(uint8_t* buf, size_t buflen, void *userdata)
+{
+	auto& td = *reinterpret_cast<thread_data_t*>(userdata);
+
+	// skip frames that weren't for us
+	PacketSocket::rx_frame_t* frame;
+	do {
+		frame = &td.frames[td.frame_num++];
+	} while (frame->buf == nullptr);
+
+	auto len = std::min(frame->buflen + ETH_HLEN, buflen);
+	memcpy(buf, frame->buf - ETH_HLEN, len);
+
+	auto& eth = *reinterpret_cast<ethhdr *>(buf);
+	uint8_t tmp[ETH_ALEN];
+	memcpy(tmp, eth.h_dest, ETH_ALEN);
+	memcpy(eth.h_dest, eth.h_source, ETH_ALEN);
+	memcpy(eth.h_source, tmp, ETH_ALEN);
+
+	return len;
+}
+
+//
+// reflects every packet in an AF_XDP receive batch and copies
+// them onto the socket's TX ring
+//
+void do_echo_xdp(PacketSocket::rx_frame_t* frames, size_t n, void *userdata)
+{
+	auto& td = *reinterpret_cast<thread_data_t*>(userdata);
+
+	// mark those frames that aren't to be sent back
+	size_t count = 0;
+	for (size_t i = 0; i < n; ++i) {
+		auto& frame = frames[i];
+		auto& eth = *reinterpret_cast<const ethhdr *>(frame.buf - ETH_HLEN);
+		if (!reflect(frame.buf, frame.buflen, eth.h_proto)) {
+			frame.buf = nullptr;
+		} else {
+			++count;
+		}
+	}
+
+	td.frames = frames;
+	td.frame_num = 0;
+
+	// as with sendmmsg, whatever there's no room for is dropped
+	// rather than holding up the receive side
+	td.xdp.tx_send(copy_eth_frame, count, 10, &td);
+}
+
 //
 // main thread worker function
 //
 void echo_rx_ring(thread_data_t& td)
 {
 	try {
-		// enable PACKET_RX_RING mode 
-		td.packet.rx_ring_enable(9, 4096);	// frame size = 512
+		if (gd.xdp) {
+			// continually take batches of packets from the AF_XDP socket
+			while (true) {
+				td.xdp.rx_next_batch(do_echo_xdp, -1, &td);
+			}
+		} else if (gd.rx_version == 3) {
+			// enable TPACKET_V3 PACKET_RX_RING mode
+			td.packet.rx_ring_v3_enable(18, 32, 1);	// 32 x 256kB blocks, 1ms retire
+
+			// continually take blocks of packets from the ring
+			while (true) {
+				td.packet.rx_ring_next_block(do_echo_block, -1, &td);
+			}
+		} else {
+			// enable PACKET_RX_RING mode
+			td.packet.rx_ring_enable(9, 4096);	// frame size = 512
 
-		// continually take packets from the ring
-		while (true) {
-			td.packet.rx_ring_next(do_echo, -1, &td);
+			// continually take packets from the ring
+			while (true) {
+				td.packet.rx_ring_next(do_echo, -1, &td);
+			}
 		}
 	} catch (std::logic_error& e) {
 		std::cerr << "error: " << e.what() << std::endl;
@@ -98,10 +265,13 @@ void __attribute__((__noreturn__)) usage(int result = EXIT_FAILURE)
 {
 	using namespace std;
 
-	cout << "dnsecho [-p <port>] -i <ifname> [-T <threads>]" << endl;
+	cout << "dnsecho [-p <port>] -i <ifname> [-T <threads>] [-V <rx_version>]" << endl;
+	cout << "        [-B <backend>]" << endl;
 	cout << "  -i the interface on which to listen" << endl;
 	cout << "  -p the port on which to listen (default: 8053)" << endl;
 	cout << "  -T the number of threads to run (default: ncpus)" << endl;
+	cout << "  -V receive ring TPACKET version: 1 or 3 (default: 3)" << endl;
+	cout << "  -B packet I/O backend: packet or xdp (default: packet)" << endl;
 
 	exit(result);
 }
@@ -112,26 +282,44 @@ int main(int argc, char *argv[])
 	const char *ifname = nullptr;
 	uint16_t port = 8053;
 	uint16_t threads = std::thread::hardware_concurrency();
+	int version = 3;
+	std::string backend("packet");
 
 	// standard getopt handling
 	int opt;
-	while ((opt = getopt(argc, argv, "i:p:T:h")) != -1) {
+	while ((opt = getopt(argc, argv, "i:p:T:V:B:h")) != -1) {
 		switch (opt) {
 			case 'i': ifname = optarg; break;
 			case 'p': port = atoi(optarg); break;
 			case 'T': threads = atoi(optarg); break;
+			case 'V': version = atoi(optarg); break;
+			case 'B': backend = optarg; break;
 			case 'h': usage(EXIT_SUCCESS);
 			default: usage();
 		}
 	}
 
 	// check that parameter requirements are met
-	if ((optind < argc) || !ifname || threads < 1 || port == 0) {
+	if ((optind < argc) || !ifname || threads < 1 || port == 0 ||
+	    (version != 1 && version != 3) ||
+	    (backend != "packet" && backend != "xdp"))
+	{
 		usage();
 	}
 
 	try {
 		gd.dest_port = port;
+		gd.rx_version = version;
+		gd.xdp = (backend == "xdp");
+
+		unsigned int ifindex = if_nametoindex(ifname);
+		if (ifindex == 0) {
+			throw_errno("if_nametoindex");
+		}
+
+		if (gd.xdp) {
+			gd.prog.attach(ifindex, threads, port, false);
+		}
 
 		// create the specified number of threads
 		std::thread echo_thread[threads];
@@ -141,8 +329,17 @@ int main(int argc, char *argv[])
 
 			// create a socket per thread
 			auto& td = thread_data[i];
-			td.packet.open();
-			td.packet.bind(ifname);
+			if (gd.xdp) {
+				td.xdp.open(gd.prog, ifindex, i, 11, 4096);
+			} else {
+				// receive both IPv4 and IPv6, but not the
+				// packets that are sent back out
+				td.packet.open(ETH_P_ALL);
+				if (td.packet.setopt(PACKET_IGNORE_OUTGOING, 1) < 0) {
+					throw_errno("setsockopt PACKET_IGNORE_OUTGOING");
+				}
+				td.packet.bind(ifindex);
+			}
 
 			echo_thread[i] = std::thread(echo_rx_ring, std::ref(td));
 
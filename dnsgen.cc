@@ -13,6 +13,7 @@
 #include <iomanip>
 #include <stdexcept>
 #include <cerrno>
+#include <cmath>
 #include <cstring>
 #include <ctime>
 #include <queue>
@@ -26,77 +27,179 @@
 #include <arpa/inet.h>
 #include <net/if.h>
 #include <netinet/ip.h>
+#include <netinet/ip6.h>
 #include <netinet/udp.h>
 #include <netinet/ether.h>
 #include <linux/if_ether.h>
 
 #include "queryfile.h"
+#include "arrivals.h"
+#include "capture.h"
+#include "frames.h"
+#include "latency.h"
+#include "pacer.h"
+#include "ratectl.h"
+#include "response.h"
+#include "selection.h"
+#include "sources.h"
+#include "stats.h"
+#include "tcp.h"
+#include "udp.h"
 #include "packet.h"
+#include "xdp.h"
 #include "buffer.h"
 #include "timer.h"
 #include "util.h"
 
 static std::exception_ptr globex = nullptr;
 
+// packet transmission backends
+typedef enum {
+	backend_mmsg,			// sendmmsg(2) with per-packet iovecs
+	backend_ring,			// PACKET_TX_RING memory-mapped ring
+	backend_xdp,			// AF_XDP socket per queue (TX and RX)
+	backend_tcp,			// pipelined DNS over TCP connections
+	backend_udp			// UDP sockets driven by io_uring
+} backend_t;
+
+// sources of packet timestamps
+typedef enum {
+	stamps_user,			// clock_gettime(2) around each batch
+	stamps_software,		// kernel software timestamps
+	stamps_hardware			// NIC timestamps, if available
+} stamps_t;
+
+// the most workloads that can be mixed
+static const size_t max_workloads = 16;
+
+// one of a mix of workloads, each with its own query file
+typedef struct {
+	std::string			label;
+	double				ratio;		// of the queries sent
+	std::string			file;
+	bool				text;		// read as with -d, else -D
+	uint16_t			bufsize;	// EDNS, if not zero
+	bool				do_bit;
+} workload_t;
+
+// the run of a thread's flows used in turn by one workload, and the
+// DNS ID that goes with them
+typedef struct {
+	size_t				first;
+	size_t				end;
+	size_t				next;
+	uint16_t			query_id;
+} rotation_t;
+
+// a query of a mix queued to be sent, counted by its workload once
+// it's known to have been sent
+typedef struct {
+	uint8_t				workload;
+	uint16_t			bytes;
+} queued_t;
+
 // thread state data
 typedef struct {
 	PacketSocket			packet;
+	PacketSocket			tx_packet;
+	XdpSocket			xdp;
+	UdpSockets			udp;
 	uint16_t			index;
-	uint16_t			port_base;
-	uint16_t			port_count;
-	uint16_t			port_offset;
+	std::vector<SourceSpace::flow_t> flows;		// in rotation order
+	std::vector<rotation_t>		rotations;	// one per workload
+	size_t				flow;		// the next to use
+	uint8_t				workload;	// of the query being sent
+	bool				mix;		// counting by workload
+	std::vector<queued_t>		queued;		// in the batch being sent
+	std::vector<sockaddr_storage>	endpoints;	// bound by kernel sockets
+	const SourceSpace*		sources;
+	std::vector<uint64_t>		source_tx;	// per source address, only read
+	std::vector<uint64_t>		source_rx;	// once the threads have finished
 	uint16_t			ip_id;
 	uint16_t			query_id;
 	uint16_t			dest_port;
-	uint64_t			tx_count;
-	uint64_t			rx_count;
-	uint64_t			rx_rcode[16];
+	tx_stats_t			tx_stats;
+	rx_stats_t			rx_stats;
+	tx_stats_t			workload_tx[max_workloads];
+	rx_stats_t			workload_rx[max_workloads];
 	size_t				query_num;
+	size_t				frame_num;	// of the frame last sent
+	uint64_t			tx_time;
+	uint64_t			rx_time;
+	uint64_t			rx_last;
+	bool				kernel_stamps;
+	bool				await_stamps;	// send times from the NIC's clock
+	uint64_t			tx_key;		// of the last transmit timestamp
+	bool				original_source;
+	Correlator*			correlator;
+	const FrameSet*			frames;
+	validate_t			validate;
+	std::unique_ptr<response_stats_t> responses;
+	HistogramRecorder		latency;
+	HistogramRecorder		interarrival;
+	Pacer				pacer;
+	std::unique_ptr<ArrivalSchedule> schedule;
+	std::unique_ptr<QuerySchedule>	selection;
+	Random				rng;		// for template names
+	std::unique_ptr<CaptureBuffer>	pcap;
+	std::unique_ptr<TcpClient>	tcp;
 } thread_data_t;
 
 // global application data
 typedef struct {
 	int				thread_count;
 	size_t				batch_size;
+	backend_t			backend;
+	int				rx_version;
+	stamps_t			timestamps;
 	uint16_t			ifindex;
 	uint16_t			dest_port;
+	bool				ipv6;
 	in_addr_t			src_ip;
 	in_addr_t			dest_ip;
+	in6_addr			src_ip6;
+	in6_addr			dest_ip6;
+	sockaddr_storage		server;		// for kernel sockets
+	socklen_t			server_len;
+	SourceSpace			sources;
+	bool				zerocopy;
+	ether_addr			src_mac;
 	ether_addr			dest_mac;
-	QueryFile			query;
+	XdpProgram			xdp;
+	FrameSet			frames;
+	std::unique_ptr<QueryFile>	queries;	// the frames' payloads
 	size_t				query_count;
-	std::atomic<uint32_t>		rx_count;
-	std::atomic<uint32_t>		tx_count;
+	validate_t			validate;
+	bool				response_detail;	// in every interval
+	QueryFile::Capture		capture;
+	bool				replay;
+	double				speed;
+	std::unique_ptr<Correlator>	correlator;
+	thread_data_t*			thread_data;
 	std::atomic<uint32_t>		rate;
 	std::atomic<bool>		stop;
 	bool				start;
-	bool				rampmode;
+	std::unique_ptr<RateController>	controller;
 	unsigned int			runtime;
 	unsigned int			increment;
+	uint64_t			max_lag;
+	std::unique_ptr<ArrivalProcess>	arrivals;
+	std::unique_ptr<QuerySelection>	selection;
+	std::vector<workload_t>		workloads;
+	std::vector<uint8_t>		workload_of;	// each query's, if mixed
+	std::unique_ptr<CaptureFile>	pcap;
+	size_t				pcap_every;
+	bool				pcap_random;
 	std::mutex			mutex;
 	std::condition_variable		cv;
 } global_data_t;
 
-// coalesced IP(v4) and UDP header
-typedef struct __attribute__((packed)) {
-	struct iphdr			ip;
-	struct udphdr			udp;
-} header_t;
-
-// standard IP checksum routine
-static uint16_t checksum(const iphdr& hdr)
+// the current time in ns, as a single integer
+static uint64_t now_ns()
 {
-	uint32_t sum = 0;
-
-	auto p = reinterpret_cast<const uint16_t *>(&hdr);
-	for (int i = 0, n = hdr.ihl * 2; i < n; ++i) {	//	.ihl = length / 4
-		sum += ntohs(*p++);
-	}
-
-	sum = (sum >> 16) + (sum & 0xffff);
-	sum += (sum >> 16);
-
-	return static_cast<uint16_t>(~sum);
+	timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return to_ns(ts);
 }
 
 // set the given thread's name
@@ -114,37 +217,184 @@ void thread_setcpu(std::thread& t, unsigned int n)
 	pthread_setaffinity_np(t.native_handle(), sizeof(cpu), &cpu);
 }
 
+// state passed to the PACKET_TX_RING and AF_XDP frame builders
+typedef struct {
+	global_data_t&			gd;
+	thread_data_t&			td;
+} tx_context_t;
+
+// move on to the thread's next query
+static void next_query_num(global_data_t& gd, thread_data_t& td)
+{
+	if (td.selection) {
+		td.query_num = td.selection->next();
+		return;
+	}
+
+	td.query_num += gd.thread_count;
+	if (td.query_num >= gd.query_count) {
+		if (gd.replay) {
+			td.query_num = td.index;	// replay the same queries each time
+		}
+		td.query_num %= gd.query_count;
+	}
+}
+
+// get next n'th pre-built frame
+static FrameSet::Frame next_frame(global_data_t& gd, thread_data_t& td)
+{
+	auto frame = gd.frames[td.query_num];
+	td.frame_num = td.query_num;
+	td.tx_stats.bytes.add(frame.size - FrameSet::l2_size);
+
+	// in a mix each workload sends from its own flows
+	if (td.mix) {
+		td.workload = gd.workload_of[td.query_num];
+		auto& rotation = td.rotations[td.workload];
+		td.flow = rotation.next;
+		td.query_id = rotation.query_id;
+		td.queued.push_back({ td.workload, uint16_t(frame.size - FrameSet::l2_size) });
+	}
+
+	next_query_num(gd, td);
+
+	return frame;
+}
+
+// counts the first `sent` of a mix's queued queries by workload
+static void count_queued(thread_data_t& td, size_t sent)
+{
+	sent = std::min(sent, td.queued.size());
+	for (size_t i = 0; i < sent; ++i) {
+		auto& query = td.queued[i];
+		td.workload_tx[query.workload].packets.add();
+		td.workload_tx[query.workload].bytes.add(query.bytes);
+	}
+}
+
+// move on to the workload's next source address and port, and its
+// next DNS ID each time they've all been used
+static void next_flow(thread_data_t& td)
+{
+	auto& rotation = td.rotations[td.workload];
+	if (++rotation.next == rotation.end) {
+		rotation.next = rotation.first;
+		++rotation.query_id;
+	}
+	td.flow = rotation.next;
+	td.query_id = rotation.query_id;
+}
+
+// fill in the per-packet fields of a copied frame's IP and UDP header
+static void patch_header(uint8_t* l3, thread_data_t& td)
+{
+	auto& flow = td.flows[td.flow];
+	bool ipv6 = td.frames->is_ipv6();
+	if (ipv6) {
+		FrameSet::patch(*reinterpret_cast<header6_t*>(l3), flow.addr, flow.port);
+	} else {
+		auto& pkt = *reinterpret_cast<header_t*>(l3);
+		if (td.original_source) {
+			FrameSet::patch(pkt, td.ip_id++, ntohs(pkt.udp.source));
+		} else {
+			FrameSet::patch(pkt, td.ip_id++, flow.addr, flow.port);
+		}
+	}
+	if (!td.source_tx.empty()) {
+		++td.source_tx[flow.address];
+	}
+
+	// when correlating, tag the query with this thread's current DNS
+	// ID and record when it was sent.  UDP checksums aren't used over
+	// IPv4, so the new ID only needs fixing up over IPv6.
+	if (td.correlator) {
+		auto id = l3 + td.frames->header_size();
+		uint16_t old, val = htons(td.query_id);
+		memcpy(&old, id, sizeof(old));
+		memcpy(id, &val, sizeof(val));
+		if (ipv6) {
+			auto& pkt = *reinterpret_cast<header6_t*>(l3);
+			pkt.udp.check = udp6_csum_update(pkt.udp.check, old, val);
+		}
+		td.correlator->sent(td.index, flow.offset, td.query_id, td.tx_time, td.frame_num, td.await_stamps);
+	}
+
+	next_flow(td);
+}
+
+//
+// fills in the random bytes of a copied template query, whose IP
+// header is at `l3`, which over IPv6 also changes its UDP checksum
+//
+static void fill_template(uint8_t* l3, const FrameSet::Frame& frame, thread_data_t& td)
+{
+	bool ipv6 = td.frames->is_ipv6();
+	auto sum = FrameSet::randomise(l3 + td.frames->header_size(), frame, td.rng, ipv6);
+	if (ipv6) {
+		auto& pkt = *reinterpret_cast<header6_t*>(l3);
+		pkt.udp.check = udp6_csum_add(pkt.udp.check, sum);
+	}
+}
+
+// applies a kernel transmit timestamp to the query it belongs to
+static void tx_stamped(uint32_t key, uint64_t timestamp, void *userdata)
+{
+	auto& td = *reinterpret_cast<thread_data_t*>(userdata);
+
+	// each key is the number of packets previously sent on the socket,
+	// from which the strict rotation of flows and IDs can be recovered.
+	// it's only 32 bits, so it's extended from the last one seen (they
+	// arrive in order, or nearly so) in case the flows don't divide 2^32
+	td.tx_key += int32_t(key - uint32_t(td.tx_key));
+	auto& flow = td.flows[td.tx_key % td.flows.size()];
+	uint16_t id = td.tx_key / td.flows.size();
+	td.correlator->restamp(td.index, flow.offset, id, timestamp);
+}
+
 //
 // Uses sendmmsg to construct multiple output packets
 // and deliver them to the kernel in one go
 //
-ssize_t send_many(global_data_t& gd, thread_data_t& td, sockaddr_ll& addr)
+ssize_t send_many(global_data_t& gd, thread_data_t& td, sockaddr_ll& addr, size_t n)
 {
-	const auto n = gd.batch_size;		// how many
+	// when correlating, the header copy also covers the DNS ID, and
+	// for a template it runs up to the template's last random byte
+	const size_t hsize = gd.frames.header_size();
+	const size_t hlen = hsize + (td.correlator ? sizeof(uint16_t) : 0);
+	const size_t hmax = hsize + (gd.frames.templated() ? FrameSet::max_prefix : sizeof(uint16_t));
+
 	mmsghdr msgs[n];
-	header_t header[n];
+	uint8_t header[n][hmax];
 	iovec iovecs[n * 2];			// two iovecs per message
 
+	td.tx_time = now_ns();
+
 	for (size_t i = 0; i < n; ++i) {
 
-		// get next n'th query from the data file
-		auto& query = gd.query[td.query_num];
-		td.query_num += gd.thread_count;
-		if (td.query_num > gd.query_count) {
-			td.query_num -= gd.query_count;
+		auto frame = next_frame(gd, td);
+		auto pkt = header[i];
+		size_t len = hlen;
+		if (frame.span_count) {
+			len = hsize + FrameSet::prefix(frame);
 		}
 
-		auto& pkt = header[i];
+		// copy and patch the frame's header
+		memcpy(pkt, frame.data + FrameSet::l2_size, hsize);
+		memcpy(pkt + hsize, frame.payload, len - hsize);
+		patch_header(pkt, td);
+		if (frame.span_count) {
+			fill_template(pkt, frame, td);
+		}
 
 		// populate the iovecs
 		int vn = i * 2;
 		iovecs[vn] = {		// header
-			reinterpret_cast<char *>(&pkt),
-			sizeof(pkt)
+			pkt,
+			len
 		};
 		iovecs[vn + 1] = {	// payload
-			const_cast<char *>(reinterpret_cast<const char *>(query.data())),
-			query.size()
+			const_cast<uint8_t *>(frame.payload + len - hsize),
+			frame.payload_size - (len - hsize)
 		};
 
 		// fill out msghdr
@@ -154,46 +404,217 @@ ssize_t send_many(global_data_t& gd, thread_data_t& td, sockaddr_ll& addr)
 		hdr.msg_iovlen = 2;
 		hdr.msg_name = reinterpret_cast<void *>(&addr);
 		hdr.msg_namelen = sizeof(addr);
-
-		// calculate header and message lengths
-		uint16_t payload_size = query.size();
-		uint16_t udp_size = payload_size + sizeof(udphdr);
-		uint16_t tot_size = udp_size + sizeof(iphdr);
-
-		// fill out IP header
-		memset(&pkt, 0, sizeof(pkt));
-		pkt.ip.ihl = 5;		// sizeof(iphdr) / 4
-		pkt.ip.version = 4;
-		pkt.ip.ttl = 8;
-		pkt.ip.protocol = IPPROTO_UDP;
-		pkt.ip.id = htons(td.ip_id++);
-		pkt.ip.saddr = gd.src_ip;
-		pkt.ip.daddr = gd.dest_ip;
-		pkt.ip.tot_len = htons(tot_size);
-		pkt.ip.check = htons(checksum(pkt.ip));
-
-		// fill out UDP header
-		pkt.udp.source = htons(td.port_base + td.port_offset);
-		pkt.udp.dest = td.dest_port;
-		pkt.udp.len = htons(udp_size);
-
-		// update port number
-		td.port_offset = (td.port_offset + 1) % td.port_count;
 	}
 
 	size_t offset = 0;
 
 	while (offset < n) {
 		auto res = sendmmsg(td.packet.fd, &msgs[offset], n - offset, 0);
-		if ((res < 0) && (errno != EAGAIN)) {
+		if (res < 0) {
+			if (errno == EAGAIN) continue;
 			throw_errno("sendmmsg");
 		}
 		offset += res;
 	}
 
+	if (td.kernel_stamps && td.correlator) {
+		td.packet.tx_timestamps(tx_stamped, &td);
+	}
+
+	return offset;
+}
+
+// copies the next frame (from `skip` bytes in) into a ring frame
+// and then patches its header in place
+static size_t copy_frame(uint8_t* buf, size_t buflen, void *userdata, size_t skip)
+{
+	auto& ctx = *reinterpret_cast<tx_context_t*>(userdata);
+	auto frame = next_frame(ctx.gd, ctx.td);
+
+	size_t len = frame.size - skip;
+	if (len > buflen) {
+		throw std::runtime_error("query too large for TX ring frame");
+	}
+
+	size_t head = len - frame.payload_size;
+	memcpy(buf, frame.data + skip, head);
+	memcpy(buf + head, frame.payload, frame.payload_size);
+	patch_header(buf + FrameSet::l2_size - skip, ctx.td);
+	if (frame.span_count) {
+		fill_template(buf + FrameSet::l2_size - skip, frame, ctx.td);
+	}
+
+	return len;
+}
+
+// writes the next complete packet directly into a TX ring frame
+static size_t build_frame(uint8_t* buf, size_t buflen, void *userdata)
+{
+	return copy_frame(buf, buflen, userdata, FrameSet::l2_size);
+}
+
+//
+// Writes a batch of packets straight into the PACKET_TX_RING
+// and kicks the kernel once to send them all
+//
+ssize_t send_ring(global_data_t& gd, thread_data_t& td, sockaddr_ll& addr, size_t n)
+{
+	tx_context_t ctx = { gd, td };
+	size_t offset = 0;
+
+	while (offset < n && !gd.stop) {
+		td.tx_time = now_ns();
+		offset += td.tx_packet.tx_ring_send(build_frame, n - offset, &addr, 10, &ctx);
+		if (td.kernel_stamps && td.correlator) {
+			td.tx_packet.tx_timestamps(tx_stamped, &td);
+		}
+	}
+
 	return offset;
 }
 
+// writes the next complete Ethernet frame into an AF_XDP UMEM frame
+static size_t build_eth_frame(uint8_t* buf, size_t buflen, void *userdata)
+{
+	return copy_frame(buf, buflen, userdata, 0);
+}
+
+//
+// Writes a batch of Ethernet frames into the AF_XDP socket's UMEM
+// and places them on its TX ring
+//
+ssize_t send_xdp(global_data_t& gd, thread_data_t& td, size_t n)
+{
+	tx_context_t ctx = { gd, td };
+	size_t offset = 0;
+
+	while (offset < n && !gd.stop) {
+		td.tx_time = now_ns();
+		offset += td.xdp.tx_send(build_eth_frame, n - offset, 10, &ctx);
+	}
+
+	return offset;
+}
+
+// the most that UDP GSO can send at once (less the IPv4 and UDP headers)
+static const size_t max_gso_size = 65507;
+
+//
+// fills in the next datagram to send from a UDP socket, i.e. the next
+// query, or without correlation any run of queries of the same size
+// that follow it, to be split into separate datagrams by UDP GSO
+//
+// a query whose DNS ID is rewritten, or a template, is sent on its
+// own, from a copy of the start of its message up to the last byte
+// that changes
+//
+static size_t build_datagram(UdpSockets::datagram_t& dgram, size_t max, void *userdata)
+{
+	auto& ctx = *reinterpret_cast<tx_context_t*>(userdata);
+	auto& td = ctx.td;
+
+	auto frame = next_frame(ctx.gd, td);
+	auto payload = frame.payload;
+	size_t len = frame.payload_size;
+	size_t count = 1;
+
+	// each of the thread's flows has its own socket
+	auto& flow = td.flows[td.flow];
+	dgram.socket = td.flow;
+
+	size_t prefix = td.correlator ? sizeof(uint16_t) : 0;
+	if (frame.span_count) {
+		prefix = FrameSet::prefix(frame);
+	}
+
+	if (prefix) {
+		memcpy(dgram.header, payload, prefix);
+		if (td.correlator) {
+			// tag the query with this thread's current DNS ID
+			uint16_t id = htons(td.query_id);
+			memcpy(dgram.header, &id, sizeof(id));
+			td.correlator->sent(td.index, flow.offset, td.query_id, td.tx_time, td.frame_num);
+		}
+		if (frame.span_count) {
+			FrameSet::randomise(dgram.header, frame, td.rng);
+		}
+		dgram.iov[0] = { dgram.header, prefix };
+		dgram.iov[1] = { const_cast<uint8_t*>(payload + prefix), len - prefix };
+		dgram.iovlen = 2;
+	} else {
+		dgram.iov[0] = { const_cast<uint8_t*>(payload), len };
+		while (count < max && (count + 1) * len <= max_gso_size) {
+			auto next = ctx.gd.frames[td.query_num];
+			if (next.size != frame.size || next.span_count ||
+			    (td.mix && ctx.gd.workload_of[td.query_num] != td.workload))
+			{
+				break;
+			}
+			next = next_frame(ctx.gd, td);
+			dgram.iov[count++] = { const_cast<uint8_t*>(next.payload), len };
+		}
+		dgram.iovlen = count;
+		dgram.segment = (count > 1) ? len : 0;
+	}
+	if (!td.source_tx.empty()) {
+		td.source_tx[flow.address] += count;
+	}
+
+	next_flow(td);
+
+	return count;
+}
+
+//
+// Queues a batch of queries on the thread's UDP sockets' io_uring
+// and submits them all with one system call
+//
+ssize_t send_udp(global_data_t& gd, thread_data_t& td, size_t n)
+{
+	tx_context_t ctx = { gd, td };
+	td.tx_time = now_ns();
+	return td.udp.tx_send(build_datagram, n, &ctx);
+}
+
+// gets the next query to be sent over TCP, length prefix and all
+static QueryFile::Record next_query(void *userdata)
+{
+	auto& ctx = *reinterpret_cast<tx_context_t*>(userdata);
+	auto query = (*ctx.gd.queries)[ctx.td.query_num];
+	ctx.td.tx_stats.bytes.add(query.size() + sizeof(uint16_t));
+	next_query_num(ctx.gd, ctx.td);
+
+	return query;
+}
+
+// counts each response read from a TCP connection
+static void receive_stream(const uint8_t* msg, size_t len, void *userdata);
+
+//
+// Sends whatever queries are due over the thread's TCP connections,
+// and between times handles their responses
+//
+static void send_tcp(global_data_t& gd, thread_data_t& td)
+{
+	tx_context_t ctx = { gd, td };
+
+	while (!gd.stop) {
+		td.pacer.set_rate(double(gd.rate) / gd.thread_count);
+		size_t n = td.pacer.available();
+
+		size_t sent = n ? td.tcp->send(n, next_query, &ctx) : 0;
+		if (sent) {
+			td.pacer.sent(sent);
+			td.tx_stats.packets.add(sent);
+		}
+
+		// don't wait for events while there are queries to send
+		td.tcp->poll(sent ? 0 : 1, receive_stream, &td);
+	}
+
+	td.tcp->close_all();
+}
+
 // blocks thread waiting for global condition variable
 void wait_for_start(global_data_t& gd)
 {
@@ -209,35 +630,69 @@ void sender_loop(global_data_t& gd, thread_data_t& td)
 	static sockaddr_ll addr = { 0 };
 	addr.sll_family = AF_PACKET;
 	addr.sll_ifindex = gd.ifindex;
-	addr.sll_protocol = htons(ETH_P_IP);
+	addr.sll_protocol = htons(gd.ipv6 ? ETH_P_IPV6 : ETH_P_IP);
 	addr.sll_halen = IFHWADDRLEN;
 	memcpy(addr.sll_addr, &gd.dest_mac, 6);
 
+	// set up the memory-mapped ring on its own transmit-only socket
+	if (gd.backend == backend_ring) {
+		td.tx_packet.open(0);
+		td.tx_packet.bind(gd.ifindex);
+		td.tx_packet.tx_ring_enable(11, 4096);	// frame size = 1 << 11 = 2048
+		if (td.kernel_stamps && td.correlator) {
+			td.await_stamps = td.tx_packet.timestamp_enable(gd.ifindex, gd.timestamps == stamps_hardware, true);
+		}
+	}
+
+	// precompute the gaps between packets, if they're not uniform
+	if (gd.replay) {
+		td.schedule.reset(new ArrivalSchedule(gd.capture.time, td.index, gd.thread_count, gd.speed));
+	} else if (gd.arrivals) {
+		td.schedule.reset(new ArrivalSchedule(*gd.arrivals, td.index));
+	}
+
+	// likewise the order of the queries, if it's not sequential
+	if (gd.selection) {
+		td.selection.reset(new QuerySchedule(*gd.selection, td.index, gd.thread_count));
+		td.query_num = td.selection->next();
+	}
+
 	// wait for start condition
 	wait_for_start(gd);
 
-	// set up timing
-	timespec now;
-	timespec error = { 0, 0 };
-	clock_gettime(CLOCK_MONOTONIC, &now);
+	td.pacer.configure(gd.batch_size, 20000, gd.max_lag, td.schedule.get());
+
+	if (gd.backend == backend_tcp) {
+		send_tcp(gd, td);
+		return;
+	}
 
 	while (!gd.stop) {
 
-		auto res = send_many(gd, td, addr);
+		// wait for the next sub-batch to become due
+		td.pacer.set_rate(double(gd.rate) / gd.thread_count);
+		size_t n = td.pacer.wait(gd.stop);
+		if (n == 0 || gd.stop) {
+			continue;
+		}
+
+		ssize_t res;
+		td.queued.clear();
+		switch (gd.backend) {
+			case backend_ring: res = send_ring(gd, td, addr, n); break;
+			case backend_xdp: res = send_xdp(gd, td, n); break;
+			case backend_udp: res = send_udp(gd, td, n); break;
+			default: res = send_many(gd, td, addr, n); break;
+		}
 		if (res	< 0) {
 			if (errno == EAGAIN) continue;
 			throw_errno("sendmsg");
 		} else {
-			gd.tx_count += res;
-			td.tx_count += res;
-
-			// calculate inter-batch delay
-			uint64_t delta = 1e9 * gd.batch_size * gd.thread_count / gd.rate;
-
-			timespec next = now + delta - error;
-			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr);
-			clock_gettime(CLOCK_MONOTONIC, &now);
-			error = now - next;	// compensate for timing errors
+			td.pacer.sent(res);
+			td.tx_stats.packets.add(res);
+			if (td.mix) {
+				count_queued(td, res);
+			}
 		}
 	}
 }
@@ -252,28 +707,158 @@ void sender(global_data_t& gd, thread_data_t& td)
 	}
 }
 
-// just counts packets per-thread
+//
+// whether a response has the same question as the given query, apart
+// from any random bytes of a template, which can't be checked
+//
+static bool same_question(const FrameSet& frames, size_t n, const uint8_t* msg, const dns_response_t& response)
+{
+	auto query = frames[n];
+	size_t pos = 12, end = 12 + response.question_size;
+	if (response.qdcount == 0 || query.payload_size < end) {
+		return false;
+	}
+
+	for (size_t i = 0; i < query.span_count; ++i) {
+		auto& span = query.spans[i];
+		if (span.offset + span.length > end ||
+		    memcmp(query.payload + pos, msg + pos, span.offset - pos) != 0)
+		{
+			return false;
+		}
+		pos = span.offset + span.length;
+	}
+
+	return memcmp(query.payload + pos, msg + pos, end - pos) == 0;
+}
+
+// counts a response's RCODE, and examines the rest of it if validating
+static bool count_response(thread_data_t& td, const uint8_t* msg, size_t len, dns_response_t& response)
+{
+	auto rcode = msg[3] & 0x0f;
+	td.rx_stats.rcode[rcode].add();
+
+	if (td.validate == validate_none) {
+		return false;
+	}
+
+	bool valid = parse_response(msg, len, td.validate, response);
+	td.responses->record(valid, response, len, td.validate);
+
+	return valid;
+}
+
+// looks for the matching query, and checks the response's question
+static void match_response(thread_data_t& td, size_t thread, uint16_t offset, const uint8_t* msg,
+			   bool valid, const dns_response_t& response)
+{
+	uint64_t rtt;
+	uint32_t query;
+	uint16_t id = (msg[0] << 8) | msg[1];
+	if (td.correlator->match(thread, offset, id, td.rx_time, rtt, &query)) {
+		td.latency.record(rtt);
+		if (td.validate >= validate_question && valid && !same_question(*td.frames, query, msg, response)) {
+			td.responses->mismatched.add();
+		}
+	}
+}
+
+// counts a response to a query from one of a mix's workloads
+static void count_workload(thread_data_t& td, size_t workload, const uint8_t* msg, size_t bytes)
+{
+	auto& rx = td.workload_rx[workload];
+	rx.packets.add();
+	rx.bytes.add(bytes);
+	rx.rcode[msg[3] & 0x0f].add();
+}
+
+// counts every response in a batch read from the UDP sockets
+static void receive_datagrams(UdpSockets::rx_datagram_t* dgrams, size_t n, void *userdata)
+{
+	auto &td = *reinterpret_cast<thread_data_t*>(userdata);
+	if (td.correlator) {
+		td.rx_time = now_ns();
+	}
+
+	// the byte counts include the headers, as for the packet backends
+	const size_t hlen = td.frames->header_size();
+
+	for (size_t i = 0; i < n; ++i) {
+		auto& dgram = dgrams[i];
+		auto& flow = td.flows[dgram.socket];
+		td.rx_stats.packets.add();
+		td.rx_stats.bytes.add(dgram.len + hlen);
+		if (!td.source_rx.empty()) {
+			++td.source_rx[flow.address];
+		}
+		if (dgram.len < 4) {
+			continue;
+		}
+
+		dns_response_t response;
+		bool valid = count_response(td, dgram.buf, dgram.len, response);
+		if (td.mix) {
+			count_workload(td, flow.workload, dgram.buf, dgram.len + hlen);
+		}
+		if (td.correlator) {
+			match_response(td, td.index, flow.offset, dgram.buf, valid, response);
+		}
+	}
+}
+
+static void receive_stream(const uint8_t* msg, size_t len, void *userdata)
+{
+	auto &td = *reinterpret_cast<thread_data_t*>(userdata);
+	td.rx_stats.packets.add();
+	td.rx_stats.bytes.add(len + sizeof(uint16_t));
+
+	dns_response_t response;
+	if (len >= 4) {
+		count_response(td, msg, len, response);
+	}
+}
+
+// counts packets per-thread, and measures their latency if correlating
 ssize_t receive_one(uint8_t *buffer, size_t buflen, const sockaddr_ll *addr, void *userdata)
 {
 	ReadBuffer in(buffer, buflen);
 
 	// count packets
 	auto &td = *reinterpret_cast<thread_data_t*>(userdata);
-	++td.rx_count;
+	td.rx_stats.packets.add();
+	td.rx_stats.bytes.add(buflen);
 
-	// read IP header and skip options
-	if (in.available() < sizeof(iphdr)) {
+	// read IP header and skip options (or for IPv6, stop at any
+	// extension header), checking that it's UDP
+	const void* daddr;
+	if (in.available() < 1) {
 		return 0;
 	}
-	auto& ip = in.read<iphdr>();
-	auto ihl = ip.ihl * 4;
-	if (ihl != sizeof(iphdr)) {
-		(void) in.read<uint8_t>(ihl - sizeof(iphdr));
-	}
-
-	// not UDP?
-	if (ip.protocol != IPPROTO_UDP) {
-		return 0;
+	if ((in[0] >> 4) == 6) {
+		if (in.available() < sizeof(ip6_hdr)) {
+			return 0;
+		}
+		auto& ip6 = in.read<ip6_hdr>();
+		if (ip6.ip6_nxt != IPPROTO_UDP) {
+			return 0;
+		}
+		daddr = &ip6.ip6_dst;
+	} else {
+		if (in.available() < sizeof(iphdr)) {
+			return 0;
+		}
+		auto& ip = in.read<iphdr>();
+		daddr = &ip.daddr;
+		size_t ihl = ip.ihl * 4;
+		if (ihl < sizeof(iphdr) || in.available() < ihl - sizeof(iphdr)) {
+			return 0;
+		}
+		if (ihl != sizeof(iphdr)) {
+			(void) in.read<uint8_t>(ihl - sizeof(iphdr));
+		}
+		if (ip.protocol != IPPROTO_UDP) {
+			return 0;
+		}
 	}
 
 	// read UDP header
@@ -285,76 +870,312 @@ ssize_t receive_one(uint8_t *buffer, size_t buflen, const sockaddr_ll *addr, voi
 		return 0;
 	}
 
-	// extract DNS header and count rcode
+	// extract DNS header and count rcode, and examine the rest of the
+	// response, which is bounded by the UDP length since short Ethernet
+	// frames may be padded
 	if (in.available() < 4) {
 		return 0;
 	}
+	size_t len = in.available();
+	size_t udp_len = ntohs(udp.len);
+	if (udp_len >= sizeof(udp) + 4 && udp_len - sizeof(udp) < len) {
+		len = udp_len - sizeof(udp);
+	}
 	auto* dns = in.read<uint16_t>(2);
-	auto rcode = ntohs(dns[1]) & 0x0f;
-	++td.rx_rcode[rcode];
+	auto msg = reinterpret_cast<const uint8_t*>(dns);
+	dns_response_t response;
+	bool valid = count_response(td, msg, len, response);
+
+	// save a copy of the response
+	if (td.pcap) {
+		td.pcap->add(buffer, buflen, td.rx_time);
+	}
+
+	// measure the gaps between kernel receive timestamps
+	if (td.kernel_stamps) {
+		if (td.rx_last && td.rx_time > td.rx_last) {
+			td.interarrival.record(td.rx_time - td.rx_last);
+		}
+		td.rx_last = td.rx_time;
+	}
+
+	// find which of the senders' flows it was sent to
+	size_t thread;
+	uint16_t offset;
+	if ((td.correlator || td.mix || !td.source_rx.empty()) && td.sources->find(daddr, ntohs(udp.dest), thread, offset)) {
+		if (td.mix) {
+			count_workload(td, td.sources->workload_of(offset), msg, buflen);
+		}
+		if (!td.source_rx.empty()) {
+			++td.source_rx[td.sources->address_of(offset)];
+		}
+		if (td.correlator) {
+			match_response(td, thread, offset, msg, valid, response);
+		}
+	}
 
 	return 0;
 }
 
+// handles a single packet from a TPACKET_V1 ring
+ssize_t receive_frame(uint8_t *buffer, size_t buflen, const sockaddr_ll *addr, void *userdata)
+{
+	auto &td = *reinterpret_cast<thread_data_t*>(userdata);
+	if (td.kernel_stamps) {
+		td.rx_time = td.packet.rx_timestamp();
+	} else if (td.correlator || td.pcap) {
+		td.rx_time = now_ns();
+	}
+
+	return receive_one(buffer, buflen, addr, userdata);
+}
+
+// counts every packet in a TPACKET_V3 block or AF_XDP batch
+void receive_block(PacketSocket::rx_frame_t* frames, size_t n, void *userdata)
+{
+	auto &td = *reinterpret_cast<thread_data_t*>(userdata);
+	if ((td.correlator || td.pcap) && !td.kernel_stamps) {
+		td.rx_time = now_ns();
+	}
+
+	for (size_t i = 0; i < n; ++i) {
+		auto& frame = frames[i];
+		if (td.kernel_stamps) {
+			td.rx_time = frame.timestamp;
+		}
+		receive_one(frame.buf, frame.buflen, frame.addr, userdata);
+	}
+}
+
+// reads the socket's drop count roughly every 0.1s
+static void count_drops(global_data_t& gd, thread_data_t& td, timespec& next)
+{
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	if (now.tv_sec < next.tv_sec || (now.tv_sec == next.tv_sec && now.tv_nsec < next.tv_nsec)) {
+		return;
+	}
+	next = now + 100000000UL;
+
+	uint64_t drops;
+	switch (gd.backend) {
+		case backend_xdp: drops = td.xdp.drops(); break;
+		case backend_udp: drops = td.udp.drops(); break;
+		default: drops = td.packet.drops(); break;
+	}
+	td.rx_stats.drops.add(drops);
+}
+
 // receiving thread entry point
 void receiver(global_data_t& gd, thread_data_t& td)
 {
+	timespec next = { 0, 0 };
+
 	try {
-		// enable PACKET_RX_RING
-		td.packet.rx_ring_enable(11, 4096);	// frame size = 1 << 11 = 2048
+		// the capture buffers are allocated by the thread using them
+		if (gd.pcap) {
+			td.pcap.reset(new CaptureBuffer(*gd.pcap, gd.pcap_every, gd.pcap_random, td.index));
+		}
+
+		if (gd.backend == backend_udp) {
+			// 4096 x 4KB buffers shared by all the sockets
+			td.udp.rx_enable(12, 4096);
+
+			while (!gd.stop) {
+				td.udp.rx_next_batch(receive_datagrams, 10, &td);
+				count_drops(gd, td, next);
+			}
+		} else if (gd.backend == backend_xdp) {
+			// the AF_XDP socket is already bound to this thread's queue
+			while (!gd.stop) {
+				td.xdp.rx_next_batch(receive_block, 10, &td);
+				count_drops(gd, td, next);
+			}
+		} else if (gd.rx_version == 3) {
+			// enable a TPACKET_V3 PACKET_RX_RING
+			td.packet.rx_ring_v3_enable(20, 16, 10);	// 16 x 1MB blocks, 10ms retire
+
+			// take whole blocks off the ring until told not to
+			while (!gd.stop) {
+				td.packet.rx_ring_next_block(receive_block, 10, &td);
+				count_drops(gd, td, next);
+			}
+		} else {
+			// enable PACKET_RX_RING
+			td.packet.rx_ring_enable(11, 4096);	// frame size = 1 << 11 = 2048
 
-		// take packets off the ring until told not to,
-		// counting total packets received as it goes
-		while (!gd.stop) {
-			if (td.packet.rx_ring_next(receive_one, 10, &td)) {
-				++gd.rx_count;
+			// take packets off the ring until told not to
+			while (!gd.stop) {
+				td.packet.rx_ring_next(receive_frame, 10, &td);
+				count_drops(gd, td, next);
 			}
 		}
+
+		// and pick up any final drops
+		next = { 0, 0 };
+		count_drops(gd, td, next);
+
+		// and finish writing any captured responses
+		if (td.pcap) {
+			td.pcap->flush();
+		}
 	} catch (...) {
 		globex = std::current_exception();
 	}
 }
 
+// sums the current statistics of every thread
+static stats_snapshot_t stats_snapshot(global_data_t& gd)
+{
+	stats_snapshot_t res;
+	for (int i = 0; i < gd.thread_count; ++i) {
+		res.add(gd.thread_data[i].tx_stats);
+		res.add(gd.thread_data[i].rx_stats);
+	}
+	return res;
+}
+
+// sums the current statistics of one workload of a mix
+static stats_snapshot_t workload_snapshot(global_data_t& gd, size_t workload)
+{
+	stats_snapshot_t res;
+	for (int i = 0; i < gd.thread_count; ++i) {
+		res.add(gd.thread_data[i].workload_tx[workload]);
+		res.add(gd.thread_data[i].workload_rx[workload]);
+	}
+	return res;
+}
+
+// prints the percentage of a workload's queries that went unanswered
+static void print_loss(std::ostream& os, const stats_snapshot_t& stats)
+{
+	using namespace std;
+	ios init(nullptr);
+	init.copyfmt(os);
+
+	uint64_t lost = stats.tx_packets > stats.rx_packets ? stats.tx_packets - stats.rx_packets : 0;
+	os << fixed << setprecision(2) << (stats.tx_packets ? 100.0 * lost / stats.tx_packets : 0.0);
+
+	os.copyfmt(init);
+}
+
+// prints the count of each RCODE seen, as <rcode>=<count>
+static void print_rcodes(std::ostream& os, const stats_snapshot_t& stats)
+{
+	for (int r = 0; r < 16; ++r) {
+		if (stats.rx_rcode[r]) {
+			os << ' ' << r << '=' << stats.rx_rcode[r];
+		}
+	}
+}
+
+// the percentiles reported for round trip times
+static const struct {
+	const char*			name;
+	double				value;
+} percentiles[] = {
+	{ "p50", 50 }, { "p90", 90 }, { "p99", 99 }, { "p99.9", 99.9 }
+};
+
+// collects the values recorded so far in one of every thread's histograms
+static void snapshot(global_data_t& gd, HistogramRecorder thread_data_t::*which, Histogram& h)
+{
+	h.clear();
+	for (int i = 0; i < gd.thread_count; ++i) {
+		(gd.thread_data[i].*which).snapshot(h);
+	}
+}
+
+// collects every thread's pacing errors so far
+static void pacing_snapshot(global_data_t& gd, Histogram& h)
+{
+	h.clear();
+	for (int i = 0; i < gd.thread_count; ++i) {
+		gd.thread_data[i].pacer.error.snapshot(h);
+	}
+}
+
+// prints histogram percentiles and maximum in microseconds
+static void print_histogram(std::ostream& os, const Histogram& h, bool labels)
+{
+	using namespace std;
+	ios init(nullptr);
+	init.copyfmt(os);
+	os << fixed << setprecision(1);
+
+	for (auto p: percentiles) {
+		if (labels) os << ' ' << p.name << " =";
+		os << ' ' << h.percentile(p.value) / 1e3;
+	}
+	if (labels) os << " max =";
+	os << ' ' << h.max() / 1e3;
+
+	os.copyfmt(init);
+}
+
 //
 // background thread that tunes the sending rate every 0.1s
 //
-// in default mode, it continually takes the rolling average
-// of the last `qsize` received counts, and records the maximum
-// such value.
+// it continually takes the rolling average of the last `qsize`
+// received counts, and records the maximum such value, which is
+// reported as the peak rate.
 //
-// the target sending rate is then set to the mid-point of the
-// current sending rate and the max value, plus the specified
-// increment.
-//
-// in this way the target rate should seek towards the value
-// at which the target rate and the received rate differ only
-// by the specified increment, i.e. where the packet loss
-// is stable at that value.
+// the target sending rate for the next interval is then set by
+// the selected RateController, based on that and the numbers of
+// queries sent and responses received in the last interval.
 //
 void rate_adapter(global_data_t& gd)
 {
 	const uint64_t interval = 1e8;
+	const uint64_t tick = 1e6;
 	const int qsize = 20;
 	uint32_t rx_max = 0;
 	uint32_t rpt_max = 0;
-	std::deque<uint32_t> rates;
+	std::deque<uint64_t> rates;
+	stats_snapshot_t last;
+	Histogram latency, previous;
+	Histogram pacing, paced;
+	uint64_t examined = 0, truncated = 0;
+	uint64_t opened = 0;
+	std::vector<stats_snapshot_t> workloads(gd.workloads.size());
+	response_snapshot_t breakdown;
 
 	wait_for_start(gd);
 
-	timespec next;
-	clock_gettime(CLOCK_MONOTONIC, &next);
+	timespec start, next;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	next = start;
 
 	do {
-		// wait for the next clock interval
+		// wait for the next clock interval, meanwhile following
+		// the rate schedule (if any) every millisecond
+		if (gd.controller->scheduled()) {
+			for (uint64_t t = tick; t < interval && !gd.stop; t += tick) {
+				timespec when = next + t;
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, nullptr);
+				gd.rate = gd.controller->rate_at(to_ns(when - start) / 1e9);
+			}
+		}
 		next = next + interval;
 		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr);
 
+		// find the changes since the last pass, without
+		// resetting the counters being updated by other threads
+		auto stats = stats_snapshot(gd);
+		auto delta = stats - last;
+		last = stats;
+
+		uint64_t responses = 0;
+		for (int r = 0; r < 16; ++r) {
+			responses += delta.rx_rcode[r];
+		}
+
 		// accumulate and average the last 'n' readings
-		rates.push_back(gd.rx_count);
+		rates.push_back(delta.rx_packets);
 		if (rates.size() > qsize) {
 			rates.pop_front();
 		}
-		auto rx_average = std::accumulate(rates.cbegin(), rates.cend(), 0U) / rates.size();
+		auto rx_average = std::accumulate(rates.cbegin(), rates.cend(), uint64_t(0)) / rates.size();
 
 		// convert into per second rate and record max achieved
 		uint32_t rx_rate = 1e9 * rx_average / interval;
@@ -368,39 +1189,140 @@ void rate_adapter(global_data_t& gd)
 		// show stats
 		const char SP = ' ';
 		using namespace std;
-		cout << next << SP << gd.rate << SP << rx_rate << SP << gd.tx_count << SP << gd.rx_count;
+		cout << next << SP << gd.rate << SP << rx_rate << SP << delta.tx_packets << SP << delta.rx_packets;
+
+		// and how far the inter-packet gaps were from the target
+		pacing_snapshot(gd, pacing);
+		Histogram gaps(pacing);
+		gaps.subtract(paced);
+		std::swap(pacing, paced);
+		{
+			ios init(nullptr);
+			init.copyfmt(cout);
+			cout << fixed << setprecision(1);
+			cout << SP << gaps.percentile(50) / 1e3 << SP << gaps.percentile(99) / 1e3;
+			cout.copyfmt(init);
+		}
+
+		// and the rate at which new TCP connections were established
+		if (gd.backend == backend_tcp) {
+			uint64_t o = 0;
+			for (int i = 0; i < gd.thread_count; ++i) {
+				o += gd.thread_data[i].tcp->opened.get();
+			}
+			cout << SP << uint64_t(1e9 * (o - opened) / interval);
+			opened = o;
+		}
+
+		// and the proportion of truncated responses
+		if (gd.validate != validate_none) {
+			uint64_t e = 0, t = 0;
+			for (int i = 0; i < gd.thread_count; ++i) {
+				e += gd.thread_data[i].responses->examined.get();
+				t += gd.thread_data[i].responses->truncated.get();
+			}
+			ios init(nullptr);
+			init.copyfmt(cout);
+			cout << fixed << setprecision(2) << SP << (e > examined ? 100.0 * (t - truncated) / (e - examined) : 0.0);
+			cout.copyfmt(init);
+			examined = e;
+			truncated = t;
+		}
+
+		// and the latency of the responses received in this interval
+		if (gd.correlator) {
+			snapshot(gd, &thread_data_t::latency, latency);
+			Histogram recent(latency);
+			recent.subtract(previous);
+			std::swap(latency, previous);
+			print_histogram(cout, recent, false);
+		}
 		cout << endl;
 
-		// adjust the rate for the next pass
-		if (gd.rampmode) {
-			gd.rate += gd.increment;
-		} else {
-			gd.rate = 0.5 * (rx_rate + rx_max) + gd.increment;
+		// followed by a line for each workload of a mix
+		for (size_t w = 0; w < workloads.size(); ++w) {
+			auto stats = workload_snapshot(gd, w);
+			auto delta = stats - workloads[w];
+			workloads[w] = stats;
+			cout << "  " << gd.workloads[w].label << SP << uint64_t(1e9 * delta.rx_packets / interval)
+			     << SP << delta.tx_packets << SP << delta.rx_packets << SP;
+			print_loss(cout, delta);
+			print_rcodes(cout, delta);
+			cout << endl;
 		}
 
-		// reset the counters for the next pass
-		gd.rx_count = 0;
-		gd.tx_count = 0;
+		// and the breakdown of the responses examined
+		if (gd.response_detail) {
+			response_snapshot_t totals;
+			for (int i = 0; i < gd.thread_count; ++i) {
+				totals.add(*gd.thread_data[i].responses);
+			}
+			cout << "  responses ";
+			(totals - breakdown).summary(cout, gd.validate);
+			cout << endl;
+			breakdown = totals;
+		}
+
+		// adjust the rate for the next pass
+		rate_sample_t sample;
+		sample.elapsed = to_ns(next - start) / 1e9;
+		sample.interval = interval / 1e9;
+		sample.rate = gd.rate;
+		sample.tx = delta.tx_packets;
+		sample.rx = responses;
+		sample.rx_rate = rx_rate;
+		sample.rx_max = rx_max;
+
+		gd.rate = gd.controller->next(sample);
+		if (gd.controller->done()) {
+			gd.stop = true;
+		}
 
 	} while (!gd.stop);
 
 	std::cout << "Peak RX rate = " << rpt_max << std::endl;
+	gd.controller->report(std::cout);
+
+	uint64_t skipped = 0;
+	for (int i = 0; i < gd.thread_count; ++i) {
+		skipped += gd.thread_data[i].pacer.skipped.get();
+	}
+	pacing_snapshot(gd, pacing);
+	std::cout << "Pacing error (us):";
+	print_histogram(std::cout, pacing, true);
+	std::cout << " (" << skipped << " packets skipped)" << std::endl;
+
+	if (gd.correlator) {
+		snapshot(gd, &thread_data_t::latency, latency);
+		std::cout << "Latency (us):";
+		print_histogram(std::cout, latency, true);
+		std::cout << " (" << latency.count() << " responses matched)" << std::endl;
+	}
+
+	if (gd.timestamps != stamps_user) {
+		Histogram gaps;
+		snapshot(gd, &thread_data_t::interarrival, gaps);
+		std::cout << "Inter-arrival (us):";
+		print_histogram(std::cout, gaps, true);
+		std::cout << std::endl;
+	}
 }
 
 // thread to signal start and stop to all other threads
 void life_timer(global_data_t& gd)
 {
-	{
-		std::lock_guard<std::mutex> lock(gd.mutex);
-		gd.start = true;
-	}
-
 	timespec start;
 	clock_gettime(CLOCK_MONOTONIC, &start);
 	start.tv_sec += 1;
 	start.tv_nsec = 0;
 	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &start, nullptr);
 
+	// set the flag only now, so that a thread that's still setting
+	// up can't see it and start early
+	{
+		std::lock_guard<std::mutex> lock(gd.mutex);
+		gd.start = true;
+	}
 	gd.cv.notify_all();
 
 	timespec wakeup = { gd.runtime, 0 };
@@ -408,29 +1330,123 @@ void life_timer(global_data_t& gd)
 	gd.stop = true;
 }
 
+//
+// parses one workload of a mix from its command line specification,
+// in which the file's type is `d` for text or `D` for raw, as with the
+// -d and -D options
+//
+//   <label>:<ratio>:<d|D>:<file>[:U<bufsize>][:X]
+//
+static workload_t parse_workload(const std::string& spec)
+{
+	std::vector<std::string> fields;
+	for (size_t pos = 0; ; ) {
+		auto colon = spec.find(':', pos);
+		fields.push_back(spec.substr(pos, colon - pos));
+		if (colon == std::string::npos) {
+			break;
+		}
+		pos = colon + 1;
+	}
+
+	workload_t res = { "", 0, "", false, 0, false };
+	char *end;
+
+	if (fields.size() < 4 || fields[0].empty() || fields[3].empty()) {
+		throw std::runtime_error("invalid workload: " + spec);
+	}
+	res.label = fields[0];
+	res.ratio = strtod(fields[1].c_str(), &end);
+	if (*end || !(res.ratio > 0) || !std::isfinite(res.ratio)) {
+		throw std::runtime_error("workload ratio must be more than 0: " + spec);
+	}
+	if (fields[2] != "d" && fields[2] != "D") {
+		throw std::runtime_error("workload file type must be d or D: " + spec);
+	}
+	res.text = (fields[2] == "d");
+	res.file = fields[3];
+
+	for (size_t i = 4; i < fields.size(); ++i) {
+		auto& option = fields[i];
+		if (option == "X") {
+			res.do_bit = true;
+		} else if (option.size() > 1 && option[0] == 'U') {
+			auto bufsize = strtoul(option.c_str() + 1, &end, 10);
+			if (*end || bufsize < 1 || bufsize > 65535) {
+				throw std::runtime_error("invalid workload EDNS buffer size: " + spec);
+			}
+			res.bufsize = bufsize;
+		} else {
+			throw std::runtime_error("invalid workload: " + spec);
+		}
+	}
+
+	return res;
+}
+
 void __attribute__((__noreturn__)) usage(int result = EXIT_FAILURE)
 {
 	using namespace std;
 
-	cout << "dnsgen -i <ifname> -a <local_addr>" << endl;
+	cout << "dnsgen -i <ifname> -a <local_addr>[/<prefix>|-<last_addr>]" << endl;
 	cout << "       -s <server_addr> -m <server_mac_addr> [-p <port>]" << endl;
-	cout << "       -D|-d <datafile> [-T <threads>] [-l <timelimit>]" << endl;
+	cout << "       -D|-d <datafile> | -c <capture> [-x <speed>] [-O]" << endl;
+	cout << "       | -W <label>:<ratio>:<d|D>:<file>[:U<bufsize>][:X] ..." << endl;
+	cout << "      [-T <threads>] [-l <timelimit>]" << endl;
 	cout << "      [-b <batchsize>] [-r <rate_start>] [-R <rate_increment>" << endl;
-	cout << "  -i the network interface to use" << endl;
-	cout << "  -a the local address from which to send queries" << endl;
-	cout << "  -s the server to query" << endl;
+	cout << "      [-B <backend>] [-V <rx_version>] [-L] [-t <timestamps>]" << endl;
+	cout << "      [-M | -C <controller>] [-A <arrivals>] [-P <max_lag>]" << endl;
+	cout << "      [-w <outfile> [-n [random:]<N>] [-k <snaplen>]] [-v <validation> [-E]]" << endl;
+	cout << "      [-N <connections>] [-q <depth>] [-Q <queries>] [-Z]" << endl;
+	cout << "      [-u <first_port>-<last_port>] [-K <rss_key>] [-H] [-o <selection>]" << endl;
+	cout << "  -i the network interface to use (not needed with -B tcp or udp)" << endl;
+	cout << "  -a the local address, or range of addresses, from which to send queries" << endl;
+	cout << "     (optional with -B tcp or udp)" << endl;
+	cout << "  -s the server to query (IPv4 or IPv6, as -a)" << endl;
 	cout << "  -p the port on which to query the server (default: 8053)" << endl;
-	cout << "  -m the MAC address of the server to query" << endl;
+	cout << "  -m the MAC address of the server to query (not needed with -B tcp or udp)" << endl;
 	cout << "  -D raw input data file" << endl;
 	cout << "  -d text input data file" << endl;
+	cout << "  -c pcap or pcapng capture to replay with its original timing" << endl;
+	cout << "  -W a workload to mix with the others, in proportion to its ratio (repeatable)" << endl;
+	cout << "  -x replay speed multiplier (default: 1)" << endl;
+	cout << "  -O replay with the captured source addresses and ports" << endl;
 	cout << "  -T the number of threads to run (default: ncpus)" << endl;
 	cout << "  -l run for at most this many seconds (default: 30)" << endl;
 	cout << "  -b packet batch size (default: 32)" << endl;
+	cout << "  -B packet I/O backend: mmsg, ring, xdp, tcp or udp (default: mmsg)" << endl;
+	cout << "  -V receive ring TPACKET version: 1 or 3 (default: 3)" << endl;
 	cout << "  -r initial packet rate (10000)" << endl;
 	cout << "  -R packet rate increment (10000)" << endl;
-	cout << "  -M disable rate adaption" << endl;
+	cout << "  -M disable rate adaption (same as -C ramp)" << endl;
+	cout << "  -C rate controller (default: midpoint), one of:" << endl;
+	cout << "       midpoint, ramp," << endl;
+	cout << "       pid:<loss>[,<kp>[,<ki>[,<kd>]]]" << endl;
+	cout << "       search:<loss>[,<dwell_secs>[,<precision>]]," << endl;
+	cout << "       profile:<profile_file>" << endl;
+	cout << "  -A packet arrival process (default: uniform), one of:" << endl;
+	cout << "       uniform, poisson, onoff:<burst>[,<peak>]," << endl;
+	cout << "       empirical:<gaps_file>" << endl;
+	cout << "  -o query selection (default: sequential), one of:" << endl;
+	cout << "       sequential, uniform, zipf:<exponent>, weighted, shuffle[:<seed>]" << endl;
+	cout << "       (default with -W: uniform)" << endl;
+	cout << "  -L match responses to queries and report their latency" << endl;
+	cout << "  -t use kernel packet timestamps: sw or hw (default: none)" << endl;
+	cout << "  -P most microseconds behind to catch up when pacing (default: 1000)" << endl;
 	cout << "  -U EDNS UDP buffer size" << endl;
 	cout << "  -X enable DNSSEC" << endl;
+	cout << "  -w capture the responses received to this pcap file" << endl;
+	cout << "  -n capture every Nth response, or 1 in N at random (default: 1)" << endl;
+	cout << "  -k capture at most this many bytes of each response (default: 65535)" << endl;
+	cout << "  -v response validation: none, header, question or full (default: none)" << endl;
+	cout << "  -E show the validated responses' breakdown for every interval" << endl;
+	cout << "  -N TCP connections or UDP sockets per thread (default: 10 or 64)" << endl;
+	cout << "  -q most queries outstanding on each TCP connection (default: 10)" << endl;
+	cout << "  -Q queries sent on each TCP connection before replacing it (default: 0, never)" << endl;
+	cout << "  -Z send from the UDP sockets with zero-copy" << endl;
+	cout << "  -u the source ports to share between the threads (default: 16384-65535)" << endl;
+	cout << "  -K the server's RSS key, as colon separated hex bytes (default: Microsoft's)" << endl;
+	cout << "  -H report the queries sent and responses received by each source address" << endl;
 
 	exit(result);
 }
@@ -439,27 +1455,58 @@ int main(int argc, char *argv[])
 {
 	bool edns = false;
 	bool do_bit = false;
+	bool correlate = false;
+	bool original = false;
+	bool per_source = false;
 	uint16_t bufsize = 0;
 
 	global_data_t		gd;
 
 	gd.thread_count = std::thread::hardware_concurrency();
 	gd.batch_size = 32;
+	gd.backend = backend_mmsg;
+	gd.rx_version = 3;
+	gd.timestamps = stamps_user;
 	gd.dest_port = 8053;
 	gd.rate = 10000;
 	gd.increment = 10000;
 	gd.runtime = 30;
-	gd.rampmode = false;
+	gd.max_lag = 1000000;
+	gd.speed = 1;
+	gd.pcap_every = 1;
+	gd.pcap_random = false;
+	gd.validate = validate_none;
+	gd.response_detail = false;
+	gd.server_len = 0;
+	gd.zerocopy = false;
+
+	TcpClient::config_t tcp;
+	memset(&tcp, 0, sizeof(tcp));
+	tcp.depth = 10;
+	int sockets = 0;
 
 	const char *datafile = nullptr;
 	const char *rawfile = nullptr;
+	const char *capfile = nullptr;
 	const char *ifname = nullptr;
 	const char *src = nullptr;
 	const char *dest = nullptr;
 	const char *dest_mac = nullptr;
+	const char *backend = nullptr;
+	const char *stamps = nullptr;
+	const char *outfile = nullptr;
+	const char *sample = nullptr;
+	const char *validate = nullptr;
+	const char *ports = nullptr;
+	const char *rss_key = nullptr;
+	int snaplen = 65535;
+	std::string controller;
+	std::string arrivals("uniform");
+	std::string selection("sequential");
+	std::vector<std::string> mix;
 
 	int opt;
-	while ((opt = getopt(argc, argv, "i:a:s:S:m:d:D:p:l:T:b:r:R:MU:X")) != -1) {
+	while ((opt = getopt(argc, argv, "i:a:s:S:m:d:D:p:l:T:b:B:V:r:R:MC:A:Lt:P:U:Xc:x:Ow:n:k:v:N:q:Q:Zu:K:Ho:W:E")) != -1) {
 		switch (opt) {
 			case 'i': ifname = optarg; break;
 			case 'a': src = optarg; break;
@@ -472,31 +1519,192 @@ int main(int argc, char *argv[])
 			case 'l': gd.runtime = atoi(optarg); break;
 			case 'T': gd.thread_count= atoi(optarg); break;
 			case 'b': gd.batch_size = atoi(optarg); break;
+			case 'B': backend = optarg; break;
+			case 'V': gd.rx_version = atoi(optarg); break;
 			case 'r': gd.rate = atoi(optarg); break;
 			case 'R': gd.increment = atoi(optarg); break;
-			case 'M': gd.rampmode = true; break;
+			case 'M': controller = "ramp"; break;
+			case 'C': controller = optarg; break;
+			case 'A': arrivals = optarg; break;
+			case 'L': correlate = true; break;
+			case 't': stamps = optarg; break;
+			case 'P': gd.max_lag = 1000ULL * atoi(optarg); break;
 			case 'U': bufsize = atoi(optarg); edns = true; break;
 			case 'X': do_bit = true; break;
+			case 'c': capfile = optarg; break;
+			case 'x': gd.speed = atof(optarg); break;
+			case 'O': original = true; break;
+			case 'w': outfile = optarg; break;
+			case 'n': sample = optarg; break;
+			case 'k': snaplen = atoi(optarg); break;
+			case 'v': validate = optarg; break;
+			case 'E': gd.response_detail = true; break;
+			case 'N': sockets = atoi(optarg); break;
+			case 'q': tcp.depth = atoi(optarg); break;
+			case 'Q': tcp.reuse = atoi(optarg); break;
+			case 'Z': gd.zerocopy = true; break;
+			case 'u': ports = optarg; break;
+			case 'K': rss_key = optarg; break;
+			case 'H': per_source = true; break;
+			case 'o': selection = optarg; break;
+			case 'W': mix.push_back(optarg); break;
 			case 'h': usage(EXIT_SUCCESS);
 			default: usage();
 		}
 	}
 
-	// check for extra args, or missing mandatory args
-	if ((optind < argc) || !src || !dest || !dest_mac || !ifname) {
+	// select the transmit backend
+	if (backend) {
+		std::string b(backend);
+		if (b == "mmsg") {
+			gd.backend = backend_mmsg;
+		} else if (b == "ring") {
+			gd.backend = backend_ring;
+		} else if (b == "xdp") {
+			gd.backend = backend_xdp;
+		} else if (b == "tcp") {
+			gd.backend = backend_tcp;
+		} else if (b == "udp") {
+			gd.backend = backend_udp;
+		} else {
+			usage();
+		}
+	}
+	bool stream = (gd.backend == backend_tcp);
+	bool kernel = (stream || gd.backend == backend_udp);
+
+	// check for extra args, or missing mandatory args, of which
+	// the kernel's sockets only need the server address
+	if ((optind < argc) || !dest || (!kernel && (!src || !dest_mac || !ifname))) {
 		usage();
 	}
 
 	// check for illegal args
 	if ((gd.thread_count < 1) || (gd.runtime < 1) ||
 	    (gd.batch_size < 1) || (gd.increment < 1) ||
+	    (gd.rx_version != 1 && gd.rx_version != 3) ||
 	    (edns && (bufsize <= 0)))
 	{
 		usage();
 	}
 
-	// either rawfile or datafile must be specified (but not both)
-	if ((!rawfile ^ !datafile) == false) {
+	// exactly one of rawfile, datafile, capfile or a mix must be specified
+	if (!!rawfile + !!datafile + !!capfile + !mix.empty() != 1) {
+		usage();
+	}
+
+	// each workload in a mix has its own EDNS options, and its queries
+	// are chosen at random in proportion to its ratio.  the responses
+	// to each are told apart by their ports, which TCP doesn't have,
+	// and its queries are sent in its own rotation of the flows, from
+	// which a transmit timestamp's flow can't be recovered.
+	if (!mix.empty() && (mix.size() > max_workloads || edns || do_bit || stream || (correlate && stamps))) {
+		usage();
+	}
+	if (!mix.empty() && selection == "sequential") {
+		selection = "uniform";
+	}
+
+	// a capture brings its own timing, rate, order and EDNS, and its own source
+	// ports can't be used to match responses
+	gd.replay = (capfile != nullptr);
+	if (gd.replay && (arrivals != "uniform" || selection != "sequential" || edns || do_bit || gd.speed <= 0 ||
+			  !controller.empty())) {
+		usage();
+	}
+	if ((original && !gd.replay) || (original && correlate)) {
+		usage();
+	}
+
+	// the server's address determines the IP version, and captured
+	// source addresses are only kept for IPv4
+	gd.ipv6 = (strchr(dest, ':') != nullptr);
+	if (original && gd.ipv6) {
+		usage();
+	}
+
+	// responses are sampled every Nth one, or 1 in N at random
+	if (sample) {
+		std::string n(sample);
+		if (n.compare(0, 7, "random:") == 0) {
+			gd.pcap_random = true;
+			n.erase(0, 7);
+		}
+		int every = atoi(n.c_str());
+		if (every < 1) {
+			usage();
+		}
+		gd.pcap_every = every;
+	}
+	if ((!outfile && (sample || snaplen != 65535)) || (snaplen < 1)) {
+		usage();
+	}
+
+	// responses over TCP can't be matched to their queries by port
+	// and ID, and neither kernel socket backend can capture packets,
+	// use packet timestamps or send from other addresses
+	if (kernel && (sockets < 0 || stamps || outfile || original)) {
+		usage();
+	}
+	if (stream && (tcp.depth < 1 || correlate)) {
+		usage();
+	}
+	if ((gd.zerocopy && gd.backend != backend_udp) || sockets > 4096) {
+		usage();
+	}
+
+	// TCP connections take their ports from the kernel, and captured
+	// sources aren't ours to count
+	if (per_source && (stream || original)) {
+		usage();
+	}
+	tcp.connections = sockets ? sockets : 10;
+	size_t udp_sockets = sockets ? sockets : 64;
+
+	// select the timestamp source, which must be a packet socket
+	if (stamps) {
+		std::string t(stamps);
+		if (t == "sw") {
+			gd.timestamps = stamps_software;
+		} else if (t == "hw") {
+			gd.timestamps = stamps_hardware;
+		} else {
+			usage();
+		}
+		if (gd.backend == backend_xdp) {
+			usage();
+		}
+	}
+
+	try {
+		if (controller.empty()) {
+			controller = "midpoint";
+		}
+		gd.controller = RateController::create(gd.replay ? "ramp" : controller, gd.replay ? 0 : gd.increment);
+		gd.arrivals = ArrivalProcess::create(arrivals);
+		gd.selection = QuerySelection::create(selection);
+		if (validate) {
+			gd.validate = validate_level(validate);
+		}
+		if (gd.response_detail && gd.validate == validate_none) {
+			usage();
+		}
+		if (gd.controller->scheduled()) {
+			gd.rate = gd.controller->rate_at(0);
+		}
+		gd.sources.set_addresses(src, gd.ipv6);
+		if (ports) {
+			gd.sources.set_ports(ports);
+		}
+		if (rss_key) {
+			gd.sources.set_key(rss_key);
+		}
+		for (auto& spec: mix) {
+			gd.workloads.push_back(parse_workload(spec));
+		}
+		gd.sources.partition(gd.thread_count, std::max(size_t(1), gd.workloads.size()));
+	} catch (std::runtime_error& e) {
+		std::cerr << "error: " << e.what() << std::endl;
 		usage();
 	}
 
@@ -504,59 +1712,302 @@ int main(int argc, char *argv[])
 	bufsize = std::max(bufsize, (uint16_t)512);
 
 	try {
-		gd.ifindex = if_nametoindex(ifname);
-		if (rawfile) {
-			gd.query.read_raw(rawfile);
+		TscClock::calibrate();
+
+		// the frames are built with the first source address
+		sockaddr_storage first;
+		socklen_t first_len;
+		gd.sources.address(0, first, first_len);
+		if (gd.ipv6) {
+			if (inet_pton(AF_INET6, dest, &gd.dest_ip6) != 1) {
+				throw std::runtime_error("invalid IPv6 address");
+			}
+			gd.src_ip6 = reinterpret_cast<sockaddr_in6&>(first).sin6_addr;
 		} else {
-			gd.query.read_txt(datafile);
+			if (inet_pton(AF_INET, dest, &gd.dest_ip) != 1) {
+				throw std::runtime_error("invalid IPv4 address");
+			}
+			gd.src_ip = reinterpret_cast<sockaddr_in&>(first).sin_addr.s_addr;
 		}
-		gd.query_count = gd.query.size();
-		gd.src_ip = inet_addr(src);
-		gd.dest_ip = inet_addr(dest);
 		gd.start = false;
 		gd.stop = false;
-		gd.rx_count = 0;
-		gd.tx_count = 0;
 
-		if (!ether_aton_r(dest_mac, &gd.dest_mac)) {
-			throw std::runtime_error("invalid destination MAC");
+		// TCP and UDP sockets go through the kernel's own stack, so
+		// the frames built for UDP only supply the queries' payloads
+		if (kernel) {
+			memset(&gd.server, 0, sizeof(gd.server));
+			if (gd.ipv6) {
+				auto& server = reinterpret_cast<sockaddr_in6&>(gd.server);
+				server.sin6_family = AF_INET6;
+				server.sin6_addr = gd.dest_ip6;
+				server.sin6_port = htons(gd.dest_port);
+				gd.server_len = sizeof(server);
+			} else {
+				auto& server = reinterpret_cast<sockaddr_in&>(gd.server);
+				server.sin_family = AF_INET;
+				server.sin_addr.s_addr = gd.dest_ip;
+				server.sin_port = htons(gd.dest_port);
+				gd.server_len = sizeof(server);
+			}
+			tcp.server = gd.server;
+			tcp.server_len = gd.server_len;
+			tcp.source_len = gd.server_len;
+			memset(&gd.src_mac, 0, sizeof(gd.src_mac));
+			memset(&gd.dest_mac, 0, sizeof(gd.dest_mac));
+		} else {
+			gd.ifindex = if_nametoindex(ifname);
+			if (!ether_aton_r(dest_mac, &gd.dest_mac)) {
+				throw std::runtime_error("invalid destination MAC");
+			}
+			if_hwaddr(gd.ifindex, gd.src_mac);
 		}
 
-		// enable EDNS if required
-		if (edns || do_bit) {
-			gd.query.edns(bufsize, do_bit << 15);
+		// load the queries and assemble the headers of their frames,
+		// whose payloads stay in the QueryFile (e.g. a mapped v2 file),
+		// from which TCP also sends the queries directly
+		{
+			std::unique_ptr<QueryFile> queries(new QueryFile);
+			auto& query = *queries;
+			if (rawfile) {
+				query.read_raw(rawfile);
+			} else if (capfile) {
+				query.read_pcap(capfile, gd.dest_port, gd.capture);
+				if (gd.capture.truncated) {
+					std::cerr << "warning: skipped " << gd.capture.truncated
+						  << " UDP datagrams cut short by the capture's snaplen" << std::endl;
+				}
+			} else if (datafile) {
+				query.read_txt(datafile, selection == "weighted");
+			}
+
+			// a mix is read into one file, with each workload's own
+			// EDNS options, noting which workload each query is from
+			std::vector<QuerySelection::group_t> groups;
+			for (size_t w = 0; w < gd.workloads.size(); ++w) {
+				auto& workload = gd.workloads[w];
+				QueryFile part;
+				if (workload.text) {
+					part.read_txt(workload.file, selection == "weighted");
+				} else {
+					part.read_raw(workload.file);
+				}
+				if (part.size() == 0) {
+					throw std::runtime_error("workload " + workload.label + " has no queries");
+				}
+				if (workload.bufsize || workload.do_bit) {
+					part.edns(std::max(workload.bufsize, uint16_t(512)), workload.do_bit << 15);
+				}
+				groups.push_back({ part.size(), workload.ratio });
+				gd.workload_of.resize(gd.workload_of.size() + part.size(), w);
+				query.append(part);
+			}
+
+			// the selection is made from the whole file, and weights
+			// can only come from it
+			if (gd.selection) {
+				if (groups.empty()) {
+					gd.selection->prepare(query.size(), query.weights());
+				} else {
+					gd.selection->prepare(groups, query.weights());
+				}
+			}
+
+			// enable EDNS if required
+			if (edns || do_bit) {
+				query.edns(bufsize, do_bit << 15);
+			}
+
+			// templates are filled in on a copy of each frame, and
+			// TCP sends the queries straight from the file
+			if (stream && !query.spans().empty()) {
+				throw std::runtime_error("name templates can't be sent over TCP");
+			}
+
+			gd.queries = std::move(queries);
+			if (!stream) {
+				ethhdr eth;
+				memcpy(eth.h_dest, &gd.dest_mac, ETH_ALEN);
+				memcpy(eth.h_source, &gd.src_mac, ETH_ALEN);
+				eth.h_proto = htons(gd.ipv6 ? ETH_P_IPV6 : ETH_P_IP);
+
+				if (gd.ipv6) {
+					header6_t hdr;
+					memset(&hdr, 0, sizeof(hdr));
+					hdr.ip6.ip6_vfc = 6 << 4;
+					hdr.ip6.ip6_hlim = 8;
+					hdr.ip6.ip6_nxt = IPPROTO_UDP;
+					hdr.ip6.ip6_src = gd.src_ip6;
+					hdr.ip6.ip6_dst = gd.dest_ip6;
+					hdr.udp.dest = htons(gd.dest_port);
+
+					gd.frames.build(query, eth, hdr);
+				} else {
+					header_t hdr;
+					memset(&hdr, 0, sizeof(hdr));
+					hdr.ip.ihl = 5;		// sizeof(iphdr) / 4
+					hdr.ip.version = 4;
+					hdr.ip.ttl = 8;
+					hdr.ip.protocol = IPPROTO_UDP;
+					hdr.ip.saddr = gd.src_ip;
+					hdr.ip.daddr = gd.dest_ip;
+					hdr.udp.dest = htons(gd.dest_port);
+
+					gd.frames.build(query, eth, hdr, original ? &gd.capture : nullptr);
+				}
+			}
+			gd.query_count = query.size();
 		}
 
-		// start rate adaption thread
-		auto rate = std::thread(rate_adapter, std::ref(gd));
-		thread_setname(rate, "rate");
+		// the target rate shown when replaying is the capture's
+		// mean rate, allowing for the repeat gap
+		if (gd.replay) {
+			if (gd.query_count < 2 || gd.capture.time.back() == 0) {
+				throw std::runtime_error("capture is too short to replay its timing");
+			}
+			double period = gd.capture.time.back() * double(gd.query_count) / (gd.query_count - 1);
+			gd.rate = std::max(1.0, gd.query_count * 1e9 / period * gd.speed);
+		}
+
+		// AF_XDP needs a program to redirect packets
+		// from each queue to its socket
+		if (gd.backend == backend_xdp) {
+			gd.xdp.attach(gd.ifindex, gd.thread_count, gd.dest_port, true);
+		}
 
 		int n = gd.thread_count;
 		std::thread tx_thread[n], rx_thread[n];
 		thread_data_t thread_data[n];
+		gd.thread_data = thread_data;
+
+		if (correlate) {
+			bool track = (gd.validate >= validate_question);
+			size_t size = Correlator::table_size(n, gd.sources.flows(), track);
+			if (size > (size_t(256) << 20)) {
+				std::cerr << "warning: matching responses needs " << (size >> 20)
+					  << "MB, use fewer source addresses or ports to reduce it" << std::endl;
+			}
+			gd.correlator.reset(new Correlator(n, gd.sources.flows(), now_ns(), track));
+		}
+
+		if (outfile) {
+			gd.pcap.reset(new CaptureFile(outfile, snaplen));
+		}
+
+		// start rate adaption thread
+		auto rate = std::thread(rate_adapter, std::ref(gd));
+		thread_setname(rate, "rate");
+
+		// template names must differ from one run to the next
+		uint64_t seed = now_ns();
 
 		for (int i = 0; i < n; ++i) {
 			auto& td = thread_data[i];
 
 			// memset(&td, 0, sizeof td);
 			td.index = i;
-			td.packet.open();
-			td.packet.bind(gd.ifindex);
+			td.rng = Random(seed + i);
+
+			// each thread has its own share of the source ports, used
+			// with every source address, or for UDP sockets just the
+			// first of them in the rotation, and in a mix it has a
+			// share of each workload's ports, each in its own rotation
+			const void* server = gd.ipv6 ? static_cast<void*>(&gd.dest_ip6) : &gd.dest_ip;
+			size_t workloads = std::max(size_t(1), gd.workloads.size());
+			for (size_t w = 0; w < workloads; ++w) {
+				auto flows = gd.sources.rotation(i, w, server, gd.dest_port);
+				if (gd.backend == backend_udp) {
+					flows.resize(std::min(flows.size(), std::max(size_t(1), udp_sockets / workloads)));
+				}
+				size_t first = td.flows.size();
+				td.rotations.push_back({ first, first + flows.size(), first, 0 });
+				td.flows.insert(td.flows.end(), flows.cbegin(), flows.cend());
+			}
+			td.flow = 0;
+			td.workload = 0;
+			td.mix = !gd.workloads.empty();
+			td.queued.reserve(td.mix ? gd.batch_size : 0);
+			td.sources = &gd.sources;
+			if (per_source) {
+				td.source_tx.resize(gd.sources.addresses());
+				td.source_rx.resize(gd.sources.addresses());
+			}
+
+			// UDP sockets are bound to each flow, and TCP connections
+			// to each source address in turn
+			socklen_t len;
+			if (gd.backend == backend_udp) {
+				td.endpoints.resize(td.flows.size());
+				for (size_t f = 0; f < td.flows.size(); ++f) {
+					auto& ep = td.endpoints[f];
+					gd.sources.address(td.flows[f].address, ep, len);
+					uint16_t port = htons(td.flows[f].port);
+					if (gd.ipv6) {
+						reinterpret_cast<sockaddr_in6&>(ep).sin6_port = port;
+					} else {
+						reinterpret_cast<sockaddr_in&>(ep).sin_port = port;
+					}
+				}
+			} else if (stream && src) {
+				size_t count = gd.sources.addresses();
+				td.endpoints.resize(count);
+				for (size_t a = 0; a < count; ++a) {
+					gd.sources.address((i * tcp.connections + a) % count, td.endpoints[a], len);
+				}
+			}
+
+			if (stream) {
+				auto config = tcp;
+				config.sources = td.endpoints.data();
+				config.source_count = td.endpoints.size();
+				td.tcp.reset(new TcpClient(config));
+			} else if (gd.backend == backend_udp) {
+				td.udp.open(reinterpret_cast<sockaddr*>(&gd.server), gd.server_len, td.endpoints);
+				td.udp.tx_enable(std::max(size_t(256), gd.batch_size * 2), gd.zerocopy);
+			} else if (gd.backend == backend_xdp) {
+				td.xdp.open(gd.xdp, gd.ifindex, i, 11, 4096);
+			} else {
+				td.packet.open(gd.ipv6 ? ETH_P_IPV6 : ETH_P_IP);
+				td.packet.bind(gd.ifindex);
+			}
+
+			// transmit timestamps are only needed to correlate,
+			// and only from this socket when using sendmmsg
+			td.kernel_stamps = (gd.timestamps != stamps_user);
+			td.await_stamps = false;
+			td.tx_key = 0;
+			td.original_source = original;
+			if (td.kernel_stamps) {
+				bool tx = correlate && gd.backend == backend_mmsg;
+				bool hw = td.packet.timestamp_enable(gd.ifindex, gd.timestamps == stamps_hardware, tx);
+				if (i == 0 && gd.timestamps == stamps_hardware && !hw) {
+					std::cerr << "warning: hardware timestamps unavailable, using software" << std::endl;
+				}
+
+				// the user space send time isn't comparable with
+				// a hardware receive timestamp
+				td.await_stamps = hw && tx;
+			}
+			td.rx_last = 0;
 
 			td.dest_port = htons(gd.dest_port);
-			td.query_num = i;
-			td.port_count = 4096;
-			td.port_base = 16384 + td.port_count * i;
-			td.tx_count = 0;
-			td.rx_count = 0;
-			for (int r = 0; r < 16; ++r) {
-				td.rx_rcode[r] = 0;
+			td.query_num = i % gd.query_count;
+			td.query_id = 0;
+			td.correlator = gd.correlator.get();
+			td.frames = &gd.frames;
+			td.validate = gd.validate;
+			if (gd.validate != validate_none) {
+				td.responses.reset(new response_stats_t);
 			}
 
 			auto& tx = tx_thread[i] = std::thread(sender, std::ref(gd), std::ref(td));
 			thread_setname(tx, std::string("tx:") + std::to_string(i));
 			thread_setcpu(tx, i);
 
+			// TCP responses are read by the sending thread
+			if (stream) {
+				continue;
+			}
+
 			auto& rx = rx_thread[i] = std::thread(receiver, std::ref(gd), std::ref(td));
 			thread_setname(rx, std::string("rx:") + std::to_string(i));
 			thread_setcpu(rx, i);
@@ -569,22 +2020,80 @@ int main(int argc, char *argv[])
 		// wait for all the worker threads to die
 		for (int i = 0; i < n; ++i) {
 			tx_thread[i].join();
-			rx_thread[i].join();
+			if (rx_thread[i].joinable()) {
+				rx_thread[i].join();
+			}
 		}
 
 		// and wait for the helper threads too
 		timer.join();
 		rate.join();
 
-		// display rcode counters
+		// display the totals and rcode counters
+		auto stats = stats_snapshot(gd);
+		std::cout << "TX " << stats.tx_packets << " packets, " << stats.tx_bytes << " bytes" << std::endl;
+		std::cout << "RX " << stats.rx_packets << " packets, " << stats.rx_bytes << " bytes, "
+			  << stats.rx_drops << " dropped" << std::endl;
+
 		for (int r = 0; r < 16; ++r) {
-			uint64_t c = 0;
+			if (stats.rx_rcode[r]) {
+				std::cout << "RCODE " << r << ": " << stats.rx_rcode[r] << std::endl;
+			}
+		}
+
+		for (size_t w = 0; w < gd.workloads.size(); ++w) {
+			auto stats = workload_snapshot(gd, w);
+			std::cout << "Workload " << gd.workloads[w].label << ": TX " << stats.tx_packets
+				  << " packets, RX " << stats.rx_packets << " packets, ";
+			print_loss(std::cout, stats);
+			std::cout << "% lost, RCODEs";
+			print_rcodes(std::cout, stats);
+			std::cout << std::endl;
+		}
+
+		if (gd.validate != validate_none) {
+			response_snapshot_t responses;
+			for (int i = 0; i < n; ++i) {
+				responses.add(*thread_data[i].responses);
+			}
+			responses.report(std::cout, gd.validate);
+		}
+
+		if (gd.pcap) {
+			uint64_t captured = 0, dropped = 0;
 			for (int i = 0; i < n; ++i) {
-				c += thread_data[i].rx_rcode[r];
+				auto& pcap = thread_data[i].pcap;
+				if (pcap) {
+					captured += pcap->captured.get();
+					dropped += pcap->dropped.get();
+				}
+			}
+			std::cout << "Captured " << captured << " responses (" << dropped << " dropped)" << std::endl;
+		}
+
+		if (per_source) {
+			for (size_t a = 0; a < gd.sources.addresses(); ++a) {
+				uint64_t tx = 0, rx = 0;
+				for (int i = 0; i < n; ++i) {
+					tx += thread_data[i].source_tx[a];
+					rx += thread_data[i].source_rx[a];
+				}
+				std::cout << "Source " << gd.sources.name(a) << ": TX " << tx << " packets, RX "
+					  << rx << " packets" << std::endl;
 			}
-			if (c) {
-				std::cout << "RCODE " << r << ": " << c << std::endl;
+		}
+
+		if (stream) {
+			uint64_t opened = 0, failed = 0, dropped = 0, lost = 0;
+			for (int i = 0; i < n; ++i) {
+				auto& client = *thread_data[i].tcp;
+				opened += client.opened.get();
+				failed += client.failed.get();
+				dropped += client.dropped.get();
+				lost += client.lost.get();
 			}
+			std::cout << "TCP connections: " << opened << " opened, " << failed << " failed, "
+				  << dropped << " closed by server; " << lost << " queries unanswered" << std::endl;
 		}
 
 		// re-throw any per-thread exception recorded
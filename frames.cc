@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <arpa/inet.h>
+
+#include "frames.h"
+
+// standard IP checksum routine
+static uint16_t checksum(const iphdr& hdr)
+{
+	uint32_t sum = 0;
+
+	auto p = reinterpret_cast<const uint16_t *>(&hdr);
+	for (int i = 0, n = hdr.ihl * 2; i < n; ++i) {	//	.ihl = length / 4
+		sum += ntohs(*p++);
+	}
+
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum += (sum >> 16);
+
+	return static_cast<uint16_t>(~sum);
+}
+
+// UDP checksum over IPv6, including the pseudo-header (RFC 8200)
+static uint16_t checksum(const header6_t& hdr, const uint8_t* payload, size_t len)
+{
+	uint32_t sum = 0;
+
+	auto add = [&](const uint8_t* p, size_t n) {
+		for (size_t i = 0; i + 1 < n; i += 2) {
+			sum += (p[i] << 8) | p[i + 1];
+		}
+		if (n & 1) {
+			sum += p[n - 1] << 8;
+		}
+	};
+
+	// the pseudo-header's length and next header fields are the
+	// same as the UDP length and IPv6 next header in network order
+	add(reinterpret_cast<const uint8_t*>(&hdr.ip6.ip6_src), 32);
+	sum += ntohs(hdr.udp.len);
+	sum += IPPROTO_UDP;
+	add(reinterpret_cast<const uint8_t*>(&hdr.udp), sizeof(udphdr));
+	add(payload, len);
+
+	while (sum >> 16) {
+		sum = (sum >> 16) + (sum & 0xffff);
+	}
+
+	uint16_t res = static_cast<uint16_t>(~sum);
+	return res ? res : 0xffff;
+}
+
+//
+// assembles the headers of every query's frame using the given
+// Ethernet header and a copy of the IP/UDP header, which is completed
+// by `fill`, leaving the queries themselves where they are
+//
+template<typename Header, typename Fill>
+void FrameSet::assemble(const QueryFile& query, const ethhdr& eth, Fill fill)
+{
+	size_t n = query.size();
+	std::vector<uint8_t> list(n * (l2_size + sizeof(Header)));
+
+	auto p = list.data();
+	for (size_t i = 0; i < n; ++i) {
+		auto payload = query.record(i);
+
+		Header hdr;
+		fill(hdr, i, payload.data(), payload.size());
+
+		memcpy(p, &eth, l2_size);
+		p += l2_size;
+		memcpy(p, &hdr, sizeof(hdr));
+		p += sizeof(hdr);
+	}
+
+	std::swap(image, list);
+	stride = l2_size + sizeof(Header);
+	queries = &query;
+	count = n;
+
+	span_index = query.span_index();
+	spans = query.spans();
+}
+
+//
+// assembles IPv4 frames, filling in the lengths and IP checksum of
+// each, and optionally the captured source address and port of each
+//
+void FrameSet::build(const QueryFile& query, const ethhdr& eth, const header_t& tmpl,
+		     const QueryFile::Capture* sources)
+{
+	ipv6 = false;
+	assemble<header_t>(query, eth, [&](header_t& hdr, size_t i, const uint8_t*, size_t size) {
+
+		// calculate header and message lengths
+		uint16_t udp_size = size + sizeof(udphdr);
+		uint16_t tot_size = udp_size + sizeof(iphdr);
+
+		hdr = tmpl;
+		if (sources) {
+			hdr.ip.saddr = sources->saddr[i];
+		}
+		hdr.ip.id = 0;
+		hdr.ip.tot_len = htons(tot_size);
+		hdr.ip.check = 0;
+		hdr.ip.check = htons(checksum(hdr.ip));
+		hdr.udp.source = sources ? sources->sport[i] : 0;
+		hdr.udp.len = htons(udp_size);
+		hdr.udp.check = 0;
+	});
+}
+
+//
+// assembles IPv6 frames, filling in the lengths and UDP checksum
+//
+void FrameSet::build(const QueryFile& query, const ethhdr& eth, const header6_t& tmpl)
+{
+	ipv6 = true;
+	assemble<header6_t>(query, eth, [&](header6_t& hdr, size_t, const uint8_t* payload, size_t size) {
+		uint16_t udp_size = size + sizeof(udphdr);
+
+		hdr = tmpl;
+		hdr.ip6.ip6_plen = htons(udp_size);
+		hdr.udp.source = 0;
+		hdr.udp.len = htons(udp_size);
+		hdr.udp.check = 0;
+		hdr.udp.check = htons(checksum(hdr, payload, size));
+	});
+}
+
+//
+// fills in the random bytes of a template, in a copy of its frame's
+// DNS message, and if `summed` returns their ones' complement sum
+// (which only a UDP checksum over IPv6 needs), otherwise 0
+//
+// the bytes are drawn from a 32 character alphabet of the lower case
+// letters and the digits 0-5, eight at a time from each 64-bit random
+// number, by masking each byte down to 5 bits and then offsetting the
+// values below 26 to 'a' and the rest to '0' in parallel
+//
+uint32_t FrameSet::randomise(uint8_t* msg, const Frame& frame, Random& rng, bool summed)
+{
+	const uint64_t ones = 0x0101010101010101ULL;
+	uint32_t sum = 0;
+
+	for (size_t i = 0; i < frame.span_count; ++i) {
+		auto& span = frame.spans[i];
+		auto p = msg + span.offset;
+
+		for (size_t done = 0; done < span.length; done += 8) {
+			uint64_t v = rng.next() & (ones * 0x1f);
+			uint64_t digit = ((v + ones * (0x80 - 26)) & (ones * 0x80)) >> 7;
+			v += ones * 'a' - digit * ('a' - '0' + 26);
+
+			size_t n = std::min(size_t(8), span.length - done);
+			memcpy(p + done, &v, n);
+		}
+
+		if (summed) {
+			for (size_t j = 0; j < span.length; ++j) {
+				sum += ((span.offset + j) & 1) ? p[j] : (p[j] << 8);
+			}
+		}
+	}
+
+	return sum;
+}
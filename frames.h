@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+#include <linux/if_ether.h>
+
+#include "queryfile.h"
+#include "random.h"
+
+// coalesced IP(v4) and UDP header
+typedef struct __attribute__((packed)) {
+	struct iphdr			ip;
+	struct udphdr			udp;
+} header_t;
+
+// coalesced IPv6 and UDP header
+typedef struct __attribute__((packed)) {
+	struct ip6_hdr			ip6;
+	struct udphdr			udp;
+} header6_t;
+
+//
+// incrementally updates a checksum when a 16-bit field changes
+// from `old` to `val` (RFC 1624, eqn. 3).  the ones' complement
+// sum is byte order independent so all values may be passed in
+// network order
+//
+inline uint16_t csum_update(uint16_t check, uint16_t old, uint16_t val)
+{
+	uint32_t sum = static_cast<uint16_t>(~check);
+	sum += static_cast<uint16_t>(~old);
+	sum += val;
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return static_cast<uint16_t>(~sum);
+}
+
+// as above, for a 32-bit field
+inline uint16_t csum_update32(uint16_t check, uint32_t old, uint32_t val)
+{
+	check = csum_update(check, static_cast<uint16_t>(old), static_cast<uint16_t>(val));
+	return csum_update(check, static_cast<uint16_t>(old >> 16), static_cast<uint16_t>(val >> 16));
+}
+
+//
+// as above, but for a UDP checksum over IPv6, which is mandatory and
+// so is sent as all ones rather than zero (RFC 8200, section 8.1)
+//
+inline uint16_t udp6_csum_update(uint16_t check, uint16_t old, uint16_t val)
+{
+	uint16_t res = csum_update(check, old, val);
+	return res ? res : 0xffff;
+}
+
+// as above, adding bytes that were zero, given their sum in host order
+inline uint16_t udp6_csum_add(uint16_t check, uint32_t sum)
+{
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return udp6_csum_update(check, 0, htons(sum));
+}
+
+//
+// the headers of every query in a QueryFile pre-assembled into the
+// start of a complete Ethernet frame, stored back-to-back in one
+// contiguous image, while each frame's DNS message is used in place
+// from the QueryFile (which must outlive the FrameSet), so that the
+// payloads of a mapped v2 file are never copied
+//
+// the IP ID and UDP source port of each frame are zero, and the
+// IP checksum is calculated accordingly, so that the send path only
+// needs to copy the frame and call patch()
+//
+// alternatively each frame may be given the source address and port
+// with which its query was captured, in which case the send path
+// must keep that port when patching the frame.
+//
+// IPv6 frames have no IP ID or header checksum, but do have a UDP
+// checksum, which is calculated over the whole of each frame with
+// a zero source port and then updated as each field is patched.
+//
+// the random bytes of any query templates are likewise zero, and
+// once filled in on a copy of the frame their sum is simply added
+// to its checksum.
+//
+class FrameSet {
+
+public:
+	typedef struct {
+		const uint8_t*		data;		// Ethernet, IP and UDP headers
+		const uint8_t*		payload;	// the DNS message
+		size_t			size;		// of the whole frame
+		size_t			payload_size;
+		const QueryFile::Span*	spans;		// random bytes, if a template
+		size_t			span_count;
+	} Frame;
+
+	static const size_t		l2_size = sizeof(ethhdr);
+
+	// the furthest into a DNS message that a template's spans reach
+	static const size_t		max_prefix = 12 + 255;
+
+private:
+	std::vector<uint8_t>		image;
+	size_t				stride = 0;	// of each frame's headers
+	const QueryFile*		queries = nullptr;
+	size_t				count = 0;
+	std::vector<uint32_t>		span_index;
+	std::vector<QueryFile::Span>	spans;
+	bool				ipv6 = false;
+
+private:
+	template<typename Header, typename Fill>
+	void				assemble(const QueryFile& query, const ethhdr& eth, Fill fill);
+
+public:
+	void				build(const QueryFile& query, const ethhdr& eth, const header_t& hdr,
+					      const QueryFile::Capture* sources = nullptr);
+	void				build(const QueryFile& query, const ethhdr& eth, const header6_t& hdr);
+
+	static void			patch(header_t& hdr, uint16_t ip_id, uint16_t sport) {
+		hdr.ip.id = htons(ip_id);
+		hdr.ip.check = csum_update(hdr.ip.check, 0, hdr.ip.id);
+		hdr.udp.source = htons(sport);
+	};
+
+	// as above, but also replacing the source address (in network order)
+	static void			patch(header_t& hdr, uint16_t ip_id, uint32_t saddr, uint16_t sport) {
+		patch(hdr, ip_id, sport);
+		hdr.ip.check = csum_update32(hdr.ip.check, hdr.ip.saddr, saddr);
+		hdr.ip.saddr = saddr;
+	};
+
+	// replaces the last 32 bits of the source address, and the port
+	static void			patch(header6_t& hdr, uint32_t saddr, uint16_t sport) {
+		uint32_t old_addr;
+		memcpy(&old_addr, &hdr.ip6.ip6_src.s6_addr[12], sizeof(old_addr));
+		memcpy(&hdr.ip6.ip6_src.s6_addr[12], &saddr, sizeof(saddr));
+		uint16_t old = hdr.udp.source;
+		hdr.udp.source = htons(sport);
+		hdr.udp.check = udp6_csum_update(csum_update32(hdr.udp.check, old_addr, saddr), old, hdr.udp.source);
+	};
+
+	static uint32_t			randomise(uint8_t* msg, const Frame& frame, Random& rng, bool summed = false);
+
+	// how much of a template's DNS message must be copied to fill it in
+	static size_t			prefix(const Frame& frame) {
+		auto& last = frame.spans[frame.span_count - 1];
+		return last.offset + last.length;
+	};
+
+public:
+	Frame				operator[](size_t n) const {
+		n %= count;
+		auto query = queries->record(n);
+		Frame res = { &image[n * stride], query.data(), stride + query.size(), query.size(), nullptr, 0 };
+		if (!span_index.empty()) {
+			res.spans = spans.data() + span_index[n];
+			res.span_count = span_index[n + 1] - span_index[n];
+		}
+		return res;
+	};
+
+	size_t				size() const {
+		return count;
+	};
+
+	bool				is_ipv6() const {
+		return ipv6;
+	};
+
+	bool				templated() const {
+		return !spans.empty();
+	};
+
+	// the size of the IP and UDP headers of every frame
+	size_t				header_size() const {
+		return ipv6 ? sizeof(header6_t) : sizeof(header_t);
+	};
+};
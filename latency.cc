@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include "latency.h"
+
+//
+// find the bucket that holds the given value, clamping any
+// value too large for the histogram into the last bucket
+//
+size_t Histogram::index(uint64_t value)
+{
+	const uint64_t linear = 1 << sub_bits;
+	const uint64_t half = linear >> 1;
+
+	if (value < linear) {
+		return value;
+	}
+
+	value = std::min(value, (uint64_t(1) << max_bits) - 1);
+
+	// shift the value down so that it lies in [half, linear)
+	unsigned shift = (63 - __builtin_clzll(value)) - sub_bits + 1;
+	return linear + (shift - 1) * half + ((value >> shift) - half);
+}
+
+// the smallest value that falls into the given bucket
+uint64_t Histogram::lowest(size_t index)
+{
+	const uint64_t linear = 1 << sub_bits;
+	const uint64_t half = linear >> 1;
+
+	if (index < linear) {
+		return index;
+	}
+
+	index -= linear;
+	unsigned shift = index / half + 1;
+	return ((index % half) + half) << shift;
+}
+
+// the largest value that falls into the given bucket
+uint64_t Histogram::highest(size_t index)
+{
+	return (index + 1 < buckets) ? lowest(index + 1) - 1 : lowest(index);
+}
+
+void Histogram::add(size_t index, uint64_t count)
+{
+	if (count) {
+		counts[index] += count;
+		total += count;
+		max_value = std::max(max_value, highest(index));
+	}
+}
+
+void Histogram::add(const Histogram& other)
+{
+	for (size_t i = 0; i < buckets; ++i) {
+		counts[i] += other.counts[i];
+	}
+	total += other.total;
+	max_value = std::max(max_value, other.max_value);
+}
+
+//
+// removes an earlier snapshot of the same counters, leaving just the
+// values recorded since then.  the maximum is then only known to the
+// precision of its bucket.
+//
+void Histogram::subtract(const Histogram& other)
+{
+	uint64_t top = 0;
+
+	for (size_t i = 0; i < buckets; ++i) {
+		counts[i] -= other.counts[i];
+		if (counts[i]) {
+			top = i;
+		}
+	}
+	total -= other.total;
+	max_value = total ? std::min(max_value, highest(top)) : 0;
+}
+
+void Histogram::clear()
+{
+	std::fill(counts.begin(), counts.end(), 0);
+	total = 0;
+	max_value = 0;
+}
+
+//
+// returns the value below which the given percentage of the recorded
+// values fall, reported as the largest value in the bucket concerned
+//
+uint64_t Histogram::percentile(double p) const
+{
+	if (total == 0) {
+		return 0;
+	}
+
+	uint64_t target = std::max(uint64_t(1), uint64_t(std::ceil(total * p / 100.0)));
+	uint64_t sum = 0;
+
+	for (size_t i = 0; i < buckets; ++i) {
+		sum += counts[i];
+		if (sum >= target) {
+			return std::min(highest(i), max_value);
+		}
+	}
+
+	return max_value;
+}
+
+//---------------------------------------------------------------------
+
+HistogramRecorder::HistogramRecorder()
+	: counts(new std::atomic<uint64_t>[Histogram::buckets]), max_value(0)
+{
+	for (size_t i = 0; i < Histogram::buckets; ++i) {
+		counts[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+//
+// adds the current counters into the given histogram
+//
+void HistogramRecorder::snapshot(Histogram& into) const
+{
+	Histogram h;
+
+	for (size_t i = 0; i < Histogram::buckets; ++i) {
+		h.add(i, counts[i].load(std::memory_order_relaxed));
+	}
+
+	// the exact maximum is known, rather than just its bucket
+	h.max_value = max_value.load(std::memory_order_relaxed);
+
+	into.add(h);
+}
+
+//---------------------------------------------------------------------
+
+Correlator::Correlator(size_t threads, size_t flows, uint64_t epoch, bool track_queries)
+	: threads(threads), flows(flows), epoch(epoch)
+{
+	size_t n = (threads << id_bits) * flows;
+	table.reset(new std::atomic<uint64_t>[n]);
+	for (size_t i = 0; i < n; ++i) {
+		table[i].store(0, std::memory_order_relaxed);
+	}
+
+	if (track_queries) {
+		queries.reset(new std::atomic<uint32_t>[n]);
+		for (size_t i = 0; i < n; ++i) {
+			queries[i].store(0, std::memory_order_relaxed);
+		}
+	}
+}
+
+//
+// replaces the send time of a query with a more accurate one (e.g.
+// from the kernel), unless its response has already been matched
+//
+void Correlator::restamp(size_t thread, uint16_t offset, uint16_t id, uint64_t when)
+{
+	auto& entry = slot(thread, offset, id);
+	uint64_t value = entry.load(std::memory_order_relaxed);
+	if (value == 0 || (value & 0xffff) != id) {
+		return;
+	}
+
+	uint64_t stamped = ((when - epoch) << time_shift) | id;
+	entry.compare_exchange_strong(value, stamped, std::memory_order_relaxed);
+}
+
+//
+// looks for the query to which a response was sent, identified by
+// the thread and flow given by the response's destination address
+// and port, and its DNS ID.  on success the slot is cleared and its
+// round trip time returned, along with the query's number if
+// requested (and tracked).  a query whose send time is provisional
+// is claimed but not timed.
+//
+bool Correlator::match(size_t thread, uint16_t offset, uint16_t id, uint64_t when, uint64_t& rtt, uint32_t* query) const
+{
+	if (thread >= threads || offset >= flows) {
+		return false;
+	}
+
+	auto& entry = slot(thread, offset, id);
+	uint64_t value = entry.load(std::memory_order_acquire);
+	if (value == 0 || (value & 0xffff) != id) {
+		return false;
+	}
+
+	if (query && queries) {
+		*query = queries[index(thread, offset, id)].load(std::memory_order_relaxed);
+	}
+
+	if (!entry.compare_exchange_strong(value, 0, std::memory_order_relaxed)) {
+		return false;
+	}
+
+	if (value & provisional) {
+		return false;
+	}
+
+	// the difference modulo 2^47, where a response apparently from
+	// before its query (only possible with mismatched clocks) is 0
+	const uint64_t mask = (1ULL << (64 - time_shift)) - 1;
+	uint64_t elapsed = ((when - epoch) - (value >> time_shift)) & mask;
+	rtt = (elapsed <= (mask >> 1)) ? elapsed : 0;
+
+	return true;
+}
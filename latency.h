@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+//
+// an HDR-style log-linear histogram of nanosecond values
+//
+// values below 2^sub_bits are counted exactly, and each power of two
+// above that is split into 2^(sub_bits - 1) equal buckets, so every
+// value is recorded to within 1 / 2^(sub_bits - 1) (i.e. < 1%)
+//
+class Histogram {
+
+	friend class HistogramRecorder;
+
+public:
+	static const unsigned		sub_bits = 8;
+	static const unsigned		max_bits = 40;		// ~18 minutes
+	static const size_t		buckets = (1 << sub_bits) + (max_bits - sub_bits) * (1 << (sub_bits - 1));
+
+private:
+	std::vector<uint64_t>		counts;
+	uint64_t			total = 0;
+	uint64_t			max_value = 0;
+
+public:
+					Histogram() : counts(buckets) {};
+
+public:
+	static size_t			index(uint64_t value);
+	static uint64_t			lowest(size_t index);
+	static uint64_t			highest(size_t index);
+
+	void				add(size_t index, uint64_t count);
+	void				add(const Histogram& other);
+	void				subtract(const Histogram& other);
+	void				clear();
+
+	uint64_t			percentile(double p) const;
+	uint64_t			max() const { return max_value; };
+	uint64_t			count() const { return total; };
+};
+
+//
+// a Histogram's worth of counters written by a single thread
+// and read concurrently (without any locking) by another
+//
+// the owner only ever does a relaxed load and store of each
+// counter rather than an atomic read-modify-write, so recording
+// costs the same as it would with plain integers
+//
+class HistogramRecorder {
+
+private:
+	std::unique_ptr<std::atomic<uint64_t>[]>	counts;
+	std::atomic<uint64_t>				max_value;
+
+public:
+					HistogramRecorder();
+
+public:
+	void				record(uint64_t value) {
+		auto& c = counts[Histogram::index(value)];
+		c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		if (value > max_value.load(std::memory_order_relaxed)) {
+			max_value.store(value, std::memory_order_relaxed);
+		}
+	};
+
+	void				snapshot(Histogram& into) const;
+};
+
+//
+// matches responses to queries so that their round trip time
+// can be measured
+//
+// each sending thread owns a set of source address and port "flows"
+// (see SourceSpace) which it uses in strict rotation, incrementing
+// the DNS ID it sends each time it wraps around.  the send time of
+// each query is stored in that thread's table at a slot given by its
+// flow number and the low bits of its ID, tagged with the full ID so
+// that a stale entry can't be mistaken for a match.
+//
+// each slot has a single writer and the receive side claims it with
+// a compare and exchange, so duplicate responses are only counted
+// once.  a response that arrives after its slot has been reused
+// (2^id_bits rotations of the flows later) is not matched.
+//
+// optionally the number of the query sent is also stored in a second
+// table, so that the response can be checked against it.
+//
+// a send time may be marked as provisional until it's replaced by a
+// transmit timestamp from a different clock (i.e. the NIC's), and a
+// response to a query whose time is still provisional isn't timed.
+// times are stored modulo 2^47 ns (about 39 hours) relative to the
+// epoch, so they needn't be from the same clock as the epoch either.
+//
+class Correlator {
+
+public:
+	static const unsigned		id_bits = 8;
+
+private:
+	static const uint64_t		provisional = 1 << 16;
+	static const unsigned		time_shift = 17;
+
+private:
+	size_t				threads;
+	size_t				flows;		// per thread
+	uint64_t			epoch;
+	std::unique_ptr<std::atomic<uint64_t>[]>	table;
+	std::unique_ptr<std::atomic<uint32_t>[]>	queries;
+
+private:
+	size_t				index(size_t thread, uint16_t offset, uint16_t id) const {
+		return ((thread << id_bits) + (id & ((1 << id_bits) - 1))) * flows + offset;
+	};
+
+	std::atomic<uint64_t>&		slot(size_t thread, uint16_t offset, uint16_t id) const {
+		return table[index(thread, offset, id)];
+	};
+
+public:
+					Correlator(size_t threads, size_t flows, uint64_t epoch, bool track_queries = false);
+
+public:
+	// the memory (in bytes) that the tables would take
+	static size_t			table_size(size_t threads, size_t flows, bool track_queries) {
+		size_t slot = sizeof(uint64_t) + (track_queries ? sizeof(uint32_t) : 0);
+		return (threads << id_bits) * flows * slot;
+	};
+
+	// records the time (in ns) at which a query was sent
+	void				sent(size_t thread, uint16_t offset, uint16_t id, uint64_t when, uint32_t query = 0,
+					     bool await_stamp = false) {
+		uint64_t entry = ((when - epoch) << time_shift) | id;
+		if (await_stamp) {
+			entry |= provisional;
+		}
+		if (queries) {
+			queries[index(thread, offset, id)].store(query, std::memory_order_relaxed);
+		}
+		slot(thread, offset, id).store(entry, std::memory_order_release);
+	};
+
+	void				restamp(size_t thread, uint16_t offset, uint16_t id, uint64_t when);
+	bool				match(size_t thread, uint16_t offset, uint16_t id, uint64_t when, uint64_t& rtt,
+					      uint32_t* query = nullptr) const;
+};
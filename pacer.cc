@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+#include "pacer.h"
+
+bool TscClock::tsc = false;
+uint64_t TscClock::base_tsc = 0;
+uint64_t TscClock::base_ns = 0;
+double TscClock::ns_per_tick = 0;
+
+uint64_t TscClock::ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+uint64_t TscClock::monotonic()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// hints to the CPU that this is a spin-wait loop
+void TscClock::pause()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	_mm_pause();
+#endif
+}
+
+//
+// measures the TSC frequency against CLOCK_MONOTONIC over 20ms,
+// provided that the CPU says its TSC is invariant (i.e. it runs at
+// a constant rate in every power state)
+//
+void TscClock::calibrate()
+{
+	tsc = false;
+
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8))) {
+		return;
+	}
+
+	// bracket each TSC reading with the clock to minimise the error
+	auto sample = [](uint64_t& t, uint64_t& ns) {
+		uint64_t before = monotonic();
+		t = ticks();
+		ns = (before + monotonic()) / 2;
+	};
+
+	uint64_t t0, ns0, t1, ns1;
+	sample(t0, ns0);
+	timespec pause = { 0, 20000000 };
+	clock_nanosleep(CLOCK_MONOTONIC, 0, &pause, nullptr);
+	sample(t1, ns1);
+
+	if (t1 <= t0) {
+		return;
+	}
+
+	ns_per_tick = double(ns1 - ns0) / (t1 - t0);
+	base_tsc = t1;
+	base_ns = ns1;
+	tsc = true;
+#endif
+}
+
+//---------------------------------------------------------------------
+
+void Pacer::configure(size_t batch, uint64_t quantum_ns, uint64_t max_lag_ns,
+		      ArrivalSchedule* schedule)
+{
+	this->schedule = schedule;
+	this->batch = std::max(size_t(1), batch);
+	quantum = quantum_ns;
+	max_lag = max_lag_ns;
+}
+
+void Pacer::set_rate(double pps)
+{
+	rate = pps / 1e9;
+}
+
+//
+// adds the tokens accrued since the last refill, discarding any
+// that are more than `max_lag` (or one sub-batch) behind
+//
+void Pacer::refill(uint64_t now)
+{
+	if (last == 0 || now < last) {
+		last = now;
+		due = now + (schedule ? schedule->start() : 0);
+		return;
+	}
+
+	double cap = std::max(double(batch), rate * max_lag);
+
+	if (schedule) {
+		if (rate <= 0) {
+			due = now;
+		}
+
+		// skip straight over any whole gaps that are too far behind
+		double oldest = double(now) - max_lag;
+		if (due < oldest) {
+			uint64_t n = (oldest - due) * rate;
+			skipped.add(n);
+			due = oldest;
+		}
+
+		while (due <= now && rate > 0 && tokens < cap) {
+			if (tokens < 1) {
+				first_due = due;
+			}
+			tokens += 1;
+			due += schedule->timed() ? schedule->next() : schedule->next() / rate;
+		}
+	} else {
+		tokens += (now - last) * rate;
+	}
+	last = now;
+
+	if (tokens > cap) {
+		skipped.add(uint64_t(tokens - cap));
+		tokens = cap;
+	}
+}
+
+//
+// sleeps until shortly before the specified time, and then spins
+//
+void Pacer::sleep_until(uint64_t when, const std::atomic<bool>& stop)
+{
+	const uint64_t spin = 50000;		// ns
+	const uint64_t slice = 10000000;	// ns
+
+	for (uint64_t now = TscClock::now(); now < when && !stop; now = TscClock::now()) {
+		uint64_t remaining = when - now;
+		if (remaining > spin) {
+			uint64_t ns = std::min(remaining - spin, slice);
+			timespec ts = { 0, long(ns) };
+			clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, nullptr);
+		} else {
+			TscClock::pause();
+		}
+	}
+}
+
+//
+// waits until the next sub-batch is due, and returns its size
+//
+size_t Pacer::wait(const std::atomic<bool>& stop)
+{
+	refill(TscClock::now());
+
+	// the sub-batch is the number of packets due per quantum,
+	// or just those already due when following a schedule
+	double sub = 1.0;
+	if (!schedule) {
+		sub = std::max(1.0, std::min(double(batch), std::floor(rate * quantum)));
+	}
+
+	if (tokens < sub) {
+		if (rate <= 0) {
+			sleep_until(TscClock::now() + quantum, stop);
+			return 0;
+		}
+		if (schedule) {
+			sleep_until(uint64_t(due), stop);
+		} else {
+			sleep_until(last + uint64_t(std::ceil((sub - tokens) / rate)), stop);
+		}
+		refill(TscClock::now());
+	}
+
+	return std::min(batch, size_t(tokens));
+}
+
+//
+// returns the size of the sub-batch that's already due, if any,
+// without waiting
+//
+size_t Pacer::available()
+{
+	refill(TscClock::now());
+	return tokens < 1 ? 0 : std::min(batch, size_t(tokens));
+}
+
+//
+// removes the tokens for the packets actually sent, and records
+// how far the per-packet gap since the previous sub-batch was from
+// the target, or with a schedule how late the sub-batch was
+//
+void Pacer::sent(size_t n)
+{
+	tokens -= n;
+
+	uint64_t now = TscClock::now();
+	if (schedule) {
+		if (n) {
+			error.record(now > first_due ? uint64_t(now - first_due) : 0);
+		}
+
+		// any packets left over are already late
+		first_due = std::max(first_due, double(last));
+	} else if (last_send && last_count && rate > 0) {
+		double actual = double(now - last_send) / last_count;
+		double target = 1.0 / rate;
+		error.record(uint64_t(std::fabs(actual - target)));
+	}
+
+	last_send = now;
+	last_count = n;
+}
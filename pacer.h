@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "arrivals.h"
+#include "latency.h"
+#include "stats.h"
+
+//
+// a monotonic nanosecond clock read from the CPU's time stamp counter
+// where it runs at a constant rate (and from clock_gettime(2) where
+// it doesn't), calibrated against CLOCK_MONOTONIC
+//
+class TscClock {
+
+private:
+	static bool			tsc;
+	static uint64_t			base_tsc;
+	static uint64_t			base_ns;
+	static double			ns_per_tick;
+
+private:
+	static uint64_t			ticks();
+	static uint64_t			monotonic();
+
+public:
+	static void			calibrate();
+	static bool			is_tsc() { return tsc; };
+
+	static uint64_t			now() {
+		return tsc ? base_ns + uint64_t((ticks() - base_tsc) * ns_per_tick) : monotonic();
+	};
+
+	static void			pause();
+};
+
+//
+// a per-thread token bucket that paces packet transmission
+//
+// tokens accrue continuously at the target rate, and packets are
+// released in sub-batches of however many tokens would accrue in
+// one `quantum`, so that large batches don't become bursts at low
+// rates.  waiting is done by sleeping until shortly before the next
+// sub-batch is due and then spinning on the clock.
+//
+// if the sender falls behind (e.g. because it was descheduled) up to
+// `max_lag` worth of tokens are kept, and sent as fast as possible to
+// catch up, but any more than that are discarded and counted as
+// skipped so that there is never an unbounded burst.
+//
+// the error between each actual inter-packet gap and the target gap
+// is recorded (as the average over each sub-batch) for reporting.
+//
+// alternatively, with an ArrivalSchedule, each token instead becomes
+// due at the end of the next gap taken from the schedule (scaled by
+// the rate, unless the gaps are real times from a capture), and every
+// packet is released as soon as it's due.  the error recorded is then
+// how late each sub-batch was sent relative to its first packet.
+//
+// senders with other work to do between packets can instead poll for
+// whatever is due with available(), which never waits.
+//
+class Pacer {
+
+private:
+	double				rate = 0;	// packets per ns
+	double				tokens = 0;
+	uint64_t			last = 0;	// time of last refill
+	size_t				batch = 1;
+	uint64_t			quantum = 20000;
+	uint64_t			max_lag = 1000000;
+
+	uint64_t			last_send = 0;
+	size_t				last_count = 0;
+
+	ArrivalSchedule*		schedule = nullptr;
+	double				due = 0;	// when the next token is due
+	double				first_due = 0;	// when the oldest token was due
+
+public:
+	HistogramRecorder		error;		// |actual - target| gap in ns
+	Counter				skipped;	// packets not sent to catch up
+
+private:
+	void				refill(uint64_t now);
+	void				sleep_until(uint64_t when, const std::atomic<bool>& stop);
+
+public:
+	void				configure(size_t batch, uint64_t quantum_ns, uint64_t max_lag_ns,
+						  ArrivalSchedule* schedule = nullptr);
+	void				set_rate(double pps);
+
+	size_t				wait(const std::atomic<bool>& stop);
+	size_t				available();
+	void				sent(size_t n);
+};
@@ -12,27 +12,35 @@
 #include <iostream>
 #include <stdexcept>
 #include <algorithm>
+#include <cerrno>
+
+#include <cstring>
 
 #include <unistd.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/mman.h>
 #include <netinet/ip.h>
 #include <netinet/udp.h>
 
+#include <linux/errqueue.h>
 #include <linux/if_ether.h>
 #include <linux/if_packet.h>
 #include <linux/if.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
 
 #include "packet.h"
 #include "util.h"
 
 extern "C" unsigned int if_nametoindex (const char *__ifname);
+extern "C" char *if_indextoname (unsigned int __ifindex, char *__ifname);
 
 PacketSocket::~PacketSocket()
 {
 	// remove the memory mapped buffer
 	if (map) {
-		::munmap(map, req.tp_frame_size * req.tp_frame_nr);
+		::munmap(map, map_size);
 		map = nullptr;
 	}
 
@@ -44,16 +52,28 @@ PacketSocket::~PacketSocket()
 //
 // opens the socket and creates a pfd for use by poll(2)
 //
-void PacketSocket::open()
+// a protocol of zero creates a transmit-only socket that
+// never has any inbound packets queued to it
+//
+void PacketSocket::open(uint16_t proto)
 {
-	fd = ::socket(AF_PACKET, SOCK_DGRAM, htons(ETH_P_IP));
+	fd = ::socket(AF_PACKET, SOCK_DGRAM, htons(proto));
 	if (fd < 0) {
 		throw_errno("socket(AF_PACKET, SOCK_DGRAM)");
 	}
 
+	protocol = proto;
 	pfd = { fd, POLLIN, 0 };
 }
 
+//
+// opens a socket for IPv4 packets
+//
+void PacketSocket::open()
+{
+	open(ETH_P_IP);
+}
+
 //
 // closes the socket
 //
@@ -82,6 +102,21 @@ int PacketSocket::getopt(int name, uint32_t& val)
 	return ::getsockopt(fd, SOL_PACKET, name, &val, &len);
 }
 
+//
+// returns the number of packets that the kernel had to drop (e.g.
+// because the RX ring was full) since this was last called
+//
+uint64_t PacketSocket::drops()
+{
+	tpacket_stats_v3 st = { };
+	socklen_t len = sizeof(st);
+	if (::getsockopt(fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) < 0) {
+		throw_errno("getsockopt PACKET_STATISTICS");
+	}
+
+	return st.tp_drops;
+}
+
 //
 // attaches the socket to the specified interface and also sets
 // per-CPU fanout mode
@@ -92,12 +127,18 @@ void PacketSocket::bind(unsigned int ifindex)
 	sockaddr_ll saddr = { 0, };
 	saddr.sll_family = AF_PACKET;
 	saddr.sll_ifindex = ifindex;
+	saddr.sll_protocol = htons(protocol);
 
 	// bind it
 	if (::bind(fd, reinterpret_cast<sockaddr *>(&saddr), sizeof(saddr)) < 0) {
 		throw_errno("bind AF_PACKET");
 	}
 
+	// transmit-only sockets must not join the fanout group
+	if (protocol == 0) {
+		return;
+	}
+
 	// set the AF_PACKET socket's fanout mode
 	uint32_t fanout = (getpid() & 0xffff) | (PACKET_FANOUT_CPU << 16);
 	if (setopt(PACKET_FANOUT, fanout) < 0) {
@@ -131,23 +172,16 @@ int PacketSocket::poll(int timeout)
 }
 
 //
-// enables and configures PACKET_RX_RING mode on the socket
-// to create a memory-mapped ring buffer
+// requests a ring of the given type (PACKET_RX_RING or PACKET_TX_RING)
+// using the already populated request structure and maps it into
+// user space
 //
-void PacketSocket::rx_ring_enable(size_t frame_bits, size_t frame_nr)
+void PacketSocket::ring_map(int optname, size_t reqlen)
 {
-	size_t page_size = sysconf(_SC_PAGESIZE);
-
-	req.tp_frame_nr = frame_nr;
-	req.tp_frame_size = (1 << frame_bits);
-
-	size_t map_size = req.tp_frame_size * req.tp_frame_nr;
-
-	req.tp_block_size = std::max(page_size, size_t(req.tp_frame_size));
-	req.tp_block_nr = map_size / req.tp_block_size;
+	map_size = req.tp_block_size * req.tp_block_nr;
 
-	if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
-		throw_errno("PacketSocket::rx_ring_enable(PACKET_RX_RING)");
+	if (setsockopt(fd, SOL_PACKET, optname, &req, reqlen) < 0) {
+		throw_errno("PacketSocket::ring_map(setsockopt)");
 	}
 
 	void *p = ::mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, fd, 0);
@@ -156,6 +190,33 @@ void PacketSocket::rx_ring_enable(size_t frame_bits, size_t frame_nr)
 	}
 
 	map = reinterpret_cast<uint8_t*>(p);
+}
+
+//
+// requests a V1 or V2 ring of fixed size frames
+//
+void PacketSocket::ring_map(int optname, size_t frame_bits, size_t frame_nr)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+
+	req.tp_frame_nr = frame_nr;
+	req.tp_frame_size = (1 << frame_bits);
+
+	size_t total = req.tp_frame_size * req.tp_frame_nr;
+
+	req.tp_block_size = std::max(page_size, size_t(req.tp_frame_size));
+	req.tp_block_nr = total / req.tp_block_size;
+
+	ring_map(optname, sizeof(tpacket_req));
+}
+
+//
+// enables and configures PACKET_RX_RING mode on the socket
+// to create a memory-mapped ring buffer
+//
+void PacketSocket::rx_ring_enable(size_t frame_bits, size_t frame_nr)
+{
+	ring_map(PACKET_RX_RING, frame_bits, frame_nr);
 
 	ll_offset = TPACKET_ALIGN(sizeof(struct tpacket_hdr));
 }
@@ -169,13 +230,19 @@ int PacketSocket::rx_ring_next(PacketSocket::rx_callback_t callback, int timeout
 	auto frame = map + rx_current * req.tp_frame_size;
 	auto& hdr = *reinterpret_cast<tpacket_hdr*>(frame);
 
+	// poll(2) may also return early (e.g. for the error queue) so
+	// the frame's status must be checked again afterwards
 	if ((hdr.tp_status & TP_STATUS_USER) == 0) {
 		if (poll(timeout) == 0) return 0;
+		if ((hdr.tp_status & TP_STATUS_USER) == 0) return 0;
 	}
 
 	auto client = reinterpret_cast<sockaddr_ll *>(frame + ll_offset);
 	auto buf = frame + hdr.tp_net;
 
+	// V1 frame headers only have microsecond resolution
+	rx_stamp = hdr.tp_sec * 1000000000ULL + hdr.tp_usec * 1000ULL;
+
 	callback(buf, hdr.tp_len, client, userdata);
 
 	hdr.tp_status = TP_STATUS_KERNEL;
@@ -183,3 +250,251 @@ int PacketSocket::rx_ring_next(PacketSocket::rx_callback_t callback, int timeout
 
 	return 1;
 }
+
+//
+// enables and configures a TPACKET_V3 PACKET_RX_RING, in which
+// variable length frames are packed into blocks that are handed
+// to user space either when full or when the retire timer expires
+//
+void PacketSocket::rx_ring_v3_enable(size_t block_bits, size_t block_nr, unsigned int retire_ms)
+{
+	if (setopt(PACKET_VERSION, TPACKET_V3) < 0) {
+		throw_errno("PacketSocket::rx_ring_v3_enable(PACKET_VERSION)");
+	}
+
+	// frame size is only nominal in V3, but must still be set
+	req.tp_block_size = (1 << block_bits);
+	req.tp_block_nr = block_nr;
+	req.tp_frame_size = TPACKET_ALIGNMENT << 7;
+	req.tp_frame_nr = (req.tp_block_size / req.tp_frame_size) * block_nr;
+	req.tp_retire_blk_tov = retire_ms;
+	req.tp_sizeof_priv = 0;
+	req.tp_feature_req_word = 0;
+
+	ring_map(PACKET_RX_RING, sizeof(req));
+
+	ll_offset = TPACKET_ALIGN(sizeof(struct tpacket3_hdr));
+}
+
+//
+// consumes the next available block from a TPACKET_V3 ring and
+// passes every packet within it to the specified callback function
+// in a single call
+//
+// returns the number of packets in the block
+//
+int PacketSocket::rx_ring_next_block(PacketSocket::rx_batch_callback_t callback, int timeout, void *userdata)
+{
+	auto block = map + rx_current * req.tp_block_size;
+	auto& desc = *reinterpret_cast<volatile tpacket_block_desc*>(block);
+
+	if ((desc.hdr.bh1.block_status & TP_STATUS_USER) == 0) {
+		if (poll(timeout) == 0) return 0;
+		if ((desc.hdr.bh1.block_status & TP_STATUS_USER) == 0) return 0;
+	}
+
+	// don't read the block contents before its status
+	__sync_synchronize();
+
+	uint32_t n = desc.hdr.bh1.num_pkts;
+	if (rx_frames.size() < n) {
+		rx_frames.resize(n);
+	}
+
+	auto p = block + desc.hdr.bh1.offset_to_first_pkt;
+	for (uint32_t i = 0; i < n; ++i) {
+		auto& hdr = *reinterpret_cast<tpacket3_hdr*>(p);
+		auto& frame = rx_frames[i];
+		frame.buf = p + hdr.tp_net;
+		frame.buflen = hdr.tp_snaplen;
+		frame.addr = reinterpret_cast<sockaddr_ll *>(p + ll_offset);
+		frame.timestamp = hdr.tp_sec * 1000000000ULL + hdr.tp_nsec;
+		p += hdr.tp_next_offset;
+	}
+
+	callback(rx_frames.data(), n, userdata);
+
+	desc.hdr.bh1.block_status = TP_STATUS_KERNEL;
+	rx_current = (rx_current + 1) % req.tp_block_nr;
+
+	return n;
+}
+
+//
+// enables and configures PACKET_TX_RING mode on the socket.
+// TPACKET_V2 is used since V3 offers no benefit on transmit
+//
+// a socket may only have one ring, so a TX ring socket should be
+// opened separately from any RX ring socket (and with protocol 0)
+//
+void PacketSocket::tx_ring_enable(size_t frame_bits, size_t frame_nr)
+{
+	if (setopt(PACKET_VERSION, TPACKET_V2) < 0) {
+		throw_errno("PacketSocket::tx_ring_enable(PACKET_VERSION)");
+	}
+
+	ring_map(PACKET_TX_RING, frame_bits, frame_nr);
+
+	// SOCK_DGRAM payload starts immediately after the aligned header
+	tx_offset = TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+
+	// the ring is only ever polled for free space
+	pfd.events = POLLOUT;
+}
+
+//
+// fills up to `n` free frames in the ring via the specified
+// callback function (which returns the length of the packet
+// it wrote) and then asks the kernel to transmit them all with
+// a single call to sendto(2)
+//
+// returns the number of frames queued, which may be less than
+// requested if the ring is full
+//
+size_t PacketSocket::tx_ring_send(PacketSocket::tx_callback_t callback, size_t n, const sockaddr_ll* addr, int timeout, void *userdata)
+{
+	auto frame_size = req.tp_frame_size;
+	auto buflen = frame_size - tx_offset;
+	size_t count = 0;
+
+	while (count < n) {
+		auto frame = map + tx_current * frame_size;
+		auto& hdr = *reinterpret_cast<volatile tpacket2_hdr*>(frame);
+
+		// stop if the kernel still owns this frame
+		if (hdr.tp_status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)) {
+			if (count > 0 || poll(timeout) == 0) break;
+			continue;
+		}
+
+		hdr.tp_len = callback(frame + tx_offset, buflen, userdata);
+
+		// ensure the payload is visible before handing over the frame
+		__sync_synchronize();
+		hdr.tp_status = TP_STATUS_SEND_REQUEST;
+
+		tx_current = (tx_current + 1) % req.tp_frame_nr;
+		++count;
+	}
+
+	if (count > 0) {
+		auto res = ::sendto(fd, nullptr, 0, MSG_DONTWAIT,
+			reinterpret_cast<const sockaddr *>(addr), sizeof(*addr));
+		if (res < 0 && errno != EAGAIN && errno != ENOBUFS) {
+			throw_errno("sendto PACKET_TX_RING");
+		}
+	}
+
+	return count;
+}
+
+//
+// enables kernel timestamps on every received packet (as found in
+// the RX ring's frame headers) and optionally also on transmitted
+// packets (see tx_timestamps() below)
+//
+// if hardware timestamps are requested the NIC is asked to stamp
+// every packet.  if that isn't supported (e.g. on veth) the kernel's
+// software timestamps are used instead, which are taken as packets
+// enter or leave the network stack and use CLOCK_REALTIME.
+//
+// hardware timestamps come from the NIC's own clock, and so may only
+// be compared with other hardware timestamps.
+//
+// returns true if hardware timestamps are in use
+//
+bool PacketSocket::timestamp_enable(unsigned int ifindex, bool hardware, bool tx)
+{
+	hw_stamps = false;
+
+	if (hardware) {
+		hwtstamp_config config = { 0, };
+		config.tx_type = tx ? HWTSTAMP_TX_ON : HWTSTAMP_TX_OFF;
+		config.rx_filter = HWTSTAMP_FILTER_ALL;
+
+		ifreq ifr = { };
+		if (!if_indextoname(ifindex, ifr.ifr_name)) {
+			throw_errno("if_indextoname");
+		}
+		ifr.ifr_data = reinterpret_cast<char *>(&config);
+
+		hw_stamps = (::ioctl(fd, SIOCSHWTSTAMP, &ifr) == 0) &&
+			    (config.rx_filter != HWTSTAMP_FILTER_NONE);
+	}
+
+	// the ring frame headers' source
+	uint32_t source = hw_stamps ? SOF_TIMESTAMPING_RAW_HARDWARE : SOF_TIMESTAMPING_SOFTWARE;
+	if (setopt(PACKET_TIMESTAMP, source) < 0) {
+		throw_errno("setsockopt PACKET_TIMESTAMP");
+	}
+
+	// generating timestamps at all (and on transmit)
+	uint32_t flags = source;
+	flags |= hw_stamps ? SOF_TIMESTAMPING_RX_HARDWARE : SOF_TIMESTAMPING_RX_SOFTWARE;
+	if (tx) {
+		flags |= hw_stamps ? SOF_TIMESTAMPING_TX_HARDWARE : SOF_TIMESTAMPING_TX_SOFTWARE;
+		flags |= SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+	}
+
+	if (::setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+		throw_errno("setsockopt SO_TIMESTAMPING");
+	}
+
+	return hw_stamps;
+}
+
+//
+// reads any pending transmit timestamps from the socket's error
+// queue without blocking, passing each to the specified callback
+// function along with its key, which counts the packets sent on
+// this socket since timestamps were enabled (starting from zero)
+//
+// returns the number of timestamps read
+//
+size_t PacketSocket::tx_timestamps(PacketSocket::tx_stamp_callback_t callback, void *userdata)
+{
+	const size_t batch = 64;
+	mmsghdr msgs[batch];
+	uint8_t control[batch][256];
+	size_t total = 0;
+
+	for (;;) {
+		for (size_t i = 0; i < batch; ++i) {
+			auto& hdr = msgs[i].msg_hdr;
+			memset(&hdr, 0, sizeof(hdr));
+			hdr.msg_control = control[i];
+			hdr.msg_controllen = sizeof(control[i]);
+		}
+
+		auto n = ::recvmmsg(fd, msgs, batch, MSG_ERRQUEUE | MSG_DONTWAIT, nullptr);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR) break;
+			throw_errno("recvmmsg MSG_ERRQUEUE");
+		}
+
+		for (int i = 0; i < n; ++i) {
+			auto& hdr = msgs[i].msg_hdr;
+			const sock_extended_err* err = nullptr;
+			uint64_t stamp = 0;
+
+			for (auto cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+				if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_TIMESTAMPING) {
+					auto ts = reinterpret_cast<const timespec *>(CMSG_DATA(cmsg));
+					auto& t = ts[hw_stamps ? 2 : 0];
+					stamp = t.tv_sec * 1000000000ULL + t.tv_nsec;
+				} else if (cmsg->cmsg_level == SOL_PACKET && cmsg->cmsg_type == PACKET_TX_TIMESTAMP) {
+					err = reinterpret_cast<const sock_extended_err *>(CMSG_DATA(cmsg));
+				}
+			}
+
+			if (err && err->ee_origin == SO_EE_ORIGIN_TIMESTAMPING && stamp) {
+				callback(err->ee_data, stamp, userdata);
+				++total;
+			}
+		}
+
+		if (size_t(n) < batch) break;
+	}
+
+	return total;
+}
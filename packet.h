@@ -13,6 +13,7 @@
 
 #include <cstddef>
 #include <string>
+#include <vector>
 #include <poll.h>
 #include <linux/if_packet.h>
 
@@ -20,14 +21,38 @@ class PacketSocket {
 
 public:
 	typedef ssize_t	(*rx_callback_t)(uint8_t* buf, size_t buflen, const sockaddr_ll* addr, void *userdata);
+	typedef size_t	(*tx_callback_t)(uint8_t* buf, size_t buflen, void *userdata);
+	typedef void	(*tx_stamp_callback_t)(uint32_t key, uint64_t timestamp, void *userdata);
+
+	// a single packet within a TPACKET_V3 block
+	typedef struct {
+		uint8_t*		buf;
+		size_t			buflen;
+		const sockaddr_ll*	addr;
+		uint64_t		timestamp;	// ns, or zero if unknown
+	} rx_frame_t;
+
+	typedef void	(*rx_batch_callback_t)(rx_frame_t* frames, size_t n, void *userdata);
 
 private:
 	pollfd		pfd;
-	tpacket_req	req;
+	tpacket_req3	req;			// V1/V2 only use the tpacket_req prefix
+	uint16_t	protocol = 0;
 
 	uint8_t*	map = nullptr;
+	size_t		map_size = 0;
 	uint32_t	rx_current = 0;
+	uint32_t	tx_current = 0;
 	ptrdiff_t	ll_offset;
+	ptrdiff_t	tx_offset;
+	uint64_t	rx_stamp = 0;
+	bool		hw_stamps = false;
+
+	std::vector<rx_frame_t>	rx_frames;
+
+private:
+	void		ring_map(int optname, size_t reqlen);
+	void		ring_map(int optname, size_t frame_bits, size_t frame_nr);
 
 public:
 	int		fd = -1;
@@ -36,6 +61,7 @@ public:
 			~PacketSocket();
 
 public:
+	void		open(uint16_t protocol);
 	void		open();
 	void		close();
 
@@ -45,7 +71,18 @@ public:
 
 	int		setopt(int optname, const uint32_t val);
 	int		getopt(int optname, uint32_t& val);
+	uint64_t	drops();
 
 	void		rx_ring_enable(size_t frame_bits, size_t frame_nr);
 	int		rx_ring_next(rx_callback_t cb, int timeout = -1, void *userdata = nullptr);
+
+	void		rx_ring_v3_enable(size_t block_bits, size_t block_nr, unsigned int retire_ms);
+	int		rx_ring_next_block(rx_batch_callback_t cb, int timeout = -1, void *userdata = nullptr);
+
+	void		tx_ring_enable(size_t frame_bits, size_t frame_nr);
+	size_t		tx_ring_send(tx_callback_t cb, size_t n, const sockaddr_ll* addr, int timeout = -1, void *userdata = nullptr);
+
+	bool		timestamp_enable(unsigned int ifindex, bool hardware, bool tx);
+	uint64_t	rx_timestamp() const { return rx_stamp; };
+	size_t		tx_timestamps(tx_stamp_callback_t cb, void *userdata = nullptr);
 };
@@ -0,0 +1,401 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <endian.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+
+#include "pcap.h"
+#include "util.h"
+
+// magic numbers, as read in little-endian order
+static const uint32_t pcap_magic_us = 0xa1b2c3d4;
+static const uint32_t pcap_magic_ns = 0xa1b23c4d;
+static const uint32_t pcapng_shb = 0x0a0d0d0a;
+static const uint32_t pcapng_magic = 0x1a2b3c4d;
+
+// pcapng block types
+enum {
+	block_idb = 1,			// interface description
+	block_pb = 2,			// (obsolete) packet
+	block_spb = 3,			// simple packet
+	block_epb = 6			// enhanced packet
+};
+
+// link types
+enum {
+	linktype_null = 0,		// BSD loopback
+	linktype_ethernet = 1,
+	linktype_raw = 101,
+	linktype_raw_bsd = 12,		// on some BSDs
+	linktype_linux_sll = 113,
+	linktype_ipv4 = 228,
+	linktype_linux_sll2 = 276
+};
+
+static uint32_t le32(const uint8_t* p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return le32toh(v);
+}
+
+static uint16_t be16(const uint8_t* p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+PcapReader::PcapReader(const std::string& filename)
+{
+	int fd = ::open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw_errno("opening capture file");
+	}
+
+	struct stat st;
+	if (::fstat(fd, &st) < 0) {
+		::close(fd);
+		throw_errno("stat capture file");
+	}
+
+	map_size = st.st_size;
+	if (map_size < 24) {
+		::close(fd);
+		throw std::runtime_error("capture file is too short");
+	}
+
+	auto p = ::mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (p == MAP_FAILED) {
+		throw_errno("mmap capture file");
+	}
+	map = reinterpret_cast<const uint8_t*>(p);
+	::madvise(p, map_size, MADV_SEQUENTIAL);
+
+	uint32_t magic = le32(map);
+
+	if (magic == pcapng_shb) {
+		ng = true;
+	} else if (magic == pcap_magic_us || magic == pcap_magic_ns) {
+		nanosecond = (magic == pcap_magic_ns);
+	} else if (magic == htobe32(pcap_magic_us) || magic == htobe32(pcap_magic_ns)) {
+		swapped = true;
+		nanosecond = (magic == htobe32(pcap_magic_ns));
+	} else {
+		::munmap(p, map_size);
+		map = nullptr;
+		throw std::runtime_error("not a pcap or pcapng file: " + filename);
+	}
+
+	if (!ng) {
+		linktype = get32(map + 20) & 0xffff;
+		offset = 24;
+	}
+}
+
+PcapReader::~PcapReader()
+{
+	if (map) {
+		::munmap(const_cast<uint8_t*>(map), map_size);
+		map = nullptr;
+	}
+}
+
+uint16_t PcapReader::get16(const uint8_t* p) const
+{
+	uint16_t v;
+	memcpy(&v, p, sizeof(v));
+	return swapped ? be16toh(v) : le16toh(v);
+}
+
+uint32_t PcapReader::get32(const uint8_t* p) const
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return swapped ? be32toh(v) : le32toh(v);
+}
+
+//
+// reads the next record of a classic pcap file, stopping at
+// a truncated record as well as at the end of the file
+//
+bool PcapReader::next_pcap(packet_t& pkt)
+{
+	if (offset + 16 > map_size) {
+		return false;
+	}
+
+	auto rec = map + offset;
+	uint64_t sec = get32(rec);
+	uint64_t frac = get32(rec + 4);
+	size_t caplen = get32(rec + 8);
+
+	if (offset + 16 + caplen > map_size) {
+		return false;
+	}
+
+	pkt.time = sec * 1000000000 + (nanosecond ? frac : frac * 1000);
+	pkt.linktype = linktype;
+	pkt.data = rec + 16;
+	pkt.size = caplen;
+
+	offset += 16 + caplen;
+	return true;
+}
+
+// records the link type and time resolution of a pcapng interface
+void PcapReader::interface(const uint8_t* block, size_t len)
+{
+	interface_t iface = { get16(block + 8), false, 6 };
+
+	// look for the if_tsresol option
+	size_t opt = 16;
+	while (opt + 4 <= len - 4) {
+		uint16_t code = get16(block + opt);
+		uint16_t optlen = get16(block + opt + 2);
+		if (code == 0 || opt + 4 + optlen > len - 4) {
+			break;
+		}
+		if (code == 9 && optlen >= 1) {
+			uint8_t v = block[opt + 4];
+			iface.binary = v & 0x80;
+			iface.resolution = v & 0x7f;
+		}
+		opt += 4 + ((optlen + 3) & ~3);
+	}
+
+	interfaces.push_back(iface);
+}
+
+//
+// reads pcapng blocks until the next one that contains a packet,
+// stopping at a truncated or invalid block
+//
+bool PcapReader::next_pcapng(packet_t& pkt)
+{
+	while (offset + 12 <= map_size) {
+
+		auto block = map + offset;
+		uint32_t type = le32(block);
+
+		// each section header sets the byte order for that section
+		if (type == pcapng_shb) {
+			uint32_t magic = le32(block + 8);
+			if (magic == pcapng_magic) {
+				swapped = false;
+			} else if (magic == htobe32(pcapng_magic)) {
+				swapped = true;
+			} else {
+				return false;
+			}
+		} else {
+			type = get32(block);
+		}
+
+		size_t len = get32(block + 4);
+		if (len < 12 || (len & 3) || offset + len > map_size) {
+			return false;
+		}
+		offset += len;
+
+		const uint8_t* data = nullptr;
+		size_t caplen = 0;
+		uint32_t ifnum = 0;
+		uint64_t ts = 0;
+		bool stamped = true;
+
+		switch (type) {
+			case pcapng_shb:
+				interfaces.clear();
+				continue;
+			case block_idb:
+				if (len >= 20) {
+					interface(block, len);
+				}
+				continue;
+			case block_epb:
+			case block_pb:
+				if (len < 32) {
+					continue;
+				}
+				ifnum = (type == block_epb) ? get32(block + 8) : get16(block + 8);
+				ts = (uint64_t(get32(block + 12)) << 32) | get32(block + 16);
+				caplen = get32(block + 20);
+				data = block + 28;
+				if (caplen > len - 32) {
+					continue;
+				}
+				break;
+			case block_spb:
+				if (len < 16) {
+					continue;
+				}
+				caplen = std::min(size_t(get32(block + 8)), len - 16);
+				data = block + 12;
+				stamped = false;
+				break;
+			default:
+				continue;
+		}
+
+		if (ifnum >= interfaces.size()) {
+			continue;
+		}
+		auto& iface = interfaces[ifnum];
+
+		// convert the timestamp into ns, or for a simple packet
+		// block (which has none) reuse the previous one
+		if (stamped) {
+			if (iface.binary) {
+				last_time = (unsigned __int128)ts * 1000000000 >> iface.resolution;
+			} else if (iface.resolution <= 9) {
+				for (int i = iface.resolution; i < 9; ++i) {
+					ts *= 10;
+				}
+				last_time = ts;
+			} else {
+				for (int i = 9; i < iface.resolution; ++i) {
+					ts /= 10;
+				}
+				last_time = ts;
+			}
+		}
+
+		pkt.time = last_time;
+		pkt.linktype = iface.linktype;
+		pkt.data = data;
+		pkt.size = caplen;
+		return true;
+	}
+
+	return false;
+}
+
+//
+// reads the next packet from the file
+//
+bool PcapReader::next(packet_t& pkt)
+{
+	return ng ? next_pcapng(pkt) : next_pcap(pkt);
+}
+
+//
+// reads packets until the next one that holds an unfragmented IPv4
+// UDP datagram, and decodes it.  a datagram that was only partly
+// captured is skipped (and counted) rather than returned cut short
+//
+bool PcapReader::next(datagram_t& dgram)
+{
+	packet_t pkt;
+
+	while (next(pkt)) {
+
+		auto p = pkt.data;
+		auto end = pkt.data + pkt.size;
+		uint16_t proto = 0x0800;
+
+		// skip the link layer header, finding the protocol
+		switch (pkt.linktype) {
+			case linktype_null:
+				if (end - p < 4 || (le32(p) != 2 && be32toh(le32(p)) != 2)) {
+					continue;
+				}
+				p += 4;
+				break;
+			case linktype_ethernet:
+				if (end - p < 14) {
+					continue;
+				}
+				proto = be16(p + 12);
+				p += 14;
+				while ((proto == 0x8100 || proto == 0x88a8) && end - p >= 4) {
+					proto = be16(p + 2);
+					p += 4;
+				}
+				break;
+			case linktype_raw:
+			case linktype_raw_bsd:
+			case linktype_ipv4:
+				break;
+			case linktype_linux_sll:
+				if (end - p < 16) {
+					continue;
+				}
+				proto = be16(p + 14);
+				p += 16;
+				break;
+			case linktype_linux_sll2:
+				if (end - p < 20) {
+					continue;
+				}
+				proto = be16(p);
+				p += 20;
+				break;
+			default:
+				continue;
+		}
+
+		// check the IP header, ignoring any link layer padding
+		if (proto != 0x0800 || end - p < ptrdiff_t(sizeof(iphdr))) {
+			continue;
+		}
+		iphdr ip;
+		memcpy(&ip, p, sizeof(ip));
+		size_t ihl = ip.ihl * 4;
+		size_t tot_len = ntohs(ip.tot_len);
+		if (ip.version != 4 || ihl < sizeof(iphdr) || tot_len < ihl || ip.protocol != IPPROTO_UDP) {
+			continue;
+		}
+		if (ntohs(ip.frag_off) & (IP_MF | IP_OFFMASK)) {
+			continue;
+		}
+		if (end - p > ptrdiff_t(tot_len)) {
+			end = p + tot_len;
+		}
+		p += ihl;
+
+		// and then the UDP header
+		if (end - p < ptrdiff_t(sizeof(udphdr))) {
+			continue;
+		}
+		udphdr udp;
+		memcpy(&udp, p, sizeof(udp));
+		p += sizeof(udphdr);
+		size_t udp_len = ntohs(udp.len);
+		if (udp_len < sizeof(udphdr)) {
+			continue;
+		}
+		if (size_t(end - p) < udp_len - sizeof(udphdr)) {
+			++truncated_count;
+			continue;
+		}
+
+		dgram.time = pkt.time;
+		dgram.saddr = ip.saddr;
+		dgram.daddr = ip.daddr;
+		dgram.sport = udp.source;
+		dgram.dport = udp.dest;
+		dgram.payload = p;
+		dgram.size = udp_len - sizeof(udphdr);
+		return true;
+	}
+
+	return false;
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+//
+// reads packets from a classic pcap or a pcapng capture file, which
+// is mapped into memory, and decodes the UDP datagrams within them
+//
+// pcap files in either byte order with microsecond or nanosecond
+// timestamps are supported, as are pcapng files with any number of
+// sections and interfaces.  only the link types likely to be seen
+// in a capture of DNS traffic are recognised (Ethernet, with or
+// without VLAN tags, BSD loopback, raw IP and Linux "cooked" v1/v2),
+// and only unfragmented IPv4 datagrams are decoded.
+//
+class PcapReader {
+
+public:
+	// a captured packet, with its time in ns since the epoch
+	typedef struct {
+		uint64_t		time;
+		uint32_t		linktype;
+		const uint8_t*		data;
+		size_t			size;
+	} packet_t;
+
+	// a UDP datagram, with addresses and ports in network order
+	typedef struct {
+		uint64_t		time;
+		uint32_t		saddr;
+		uint32_t		daddr;
+		uint16_t		sport;
+		uint16_t		dport;
+		const uint8_t*		payload;
+		size_t			size;
+	} datagram_t;
+
+private:
+	// the time resolution and link type of a pcapng interface
+	typedef struct {
+		uint32_t		linktype;
+		bool			binary;		// resolution is 2^-n, not 10^-n
+		uint8_t			resolution;
+	} interface_t;
+
+	const uint8_t*			map = nullptr;
+	size_t				map_size = 0;
+	size_t				offset = 0;
+
+	bool				ng = false;
+	bool				swapped = false;	// file is in the other byte order
+
+	// classic pcap
+	uint32_t			linktype = 0;
+	bool				nanosecond = false;
+
+	// pcapng, for the current section
+	std::vector<interface_t>	interfaces;
+	uint64_t			last_time = 0;
+
+	size_t				truncated_count = 0;
+
+private:
+	uint16_t			get16(const uint8_t* p) const;
+	uint32_t			get32(const uint8_t* p) const;
+
+	bool				next_pcap(packet_t& pkt);
+	bool				next_pcapng(packet_t& pkt);
+	void				interface(const uint8_t* block, size_t len);
+
+public:
+					PcapReader(const std::string& filename);
+					PcapReader(const PcapReader&) = delete;
+	PcapReader&			operator=(const PcapReader&) = delete;
+					~PcapReader();
+
+public:
+	bool				next(packet_t& pkt);
+	bool				next(datagram_t& dgram);
+
+	// UDP datagrams skipped for being cut short by the snaplen
+	size_t				truncated() const { return truncated_count; };
+};
@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "profile.h"
+
+LoadProfile::LoadProfile(const std::string& filename)
+{
+	std::ifstream file(filename);
+	if (!file) {
+		throw std::runtime_error("can't open load profile: " + filename);
+	}
+
+	double scale = 1.0;
+	double timescale = 1.0;
+	std::string line;
+	size_t lineno = 0;
+
+	while (std::getline(file, line)) {
+
+		++lineno;
+		auto error = [&](const std::string& what) {
+			return std::runtime_error(filename + ":" + std::to_string(lineno) + ": " + what);
+		};
+
+		// strip comments and skip blank lines
+		auto hash = line.find('#');
+		if (hash != std::string::npos) {
+			line.erase(hash);
+		}
+
+		std::istringstream is(line);
+		std::string word;
+		if (!(is >> word)) {
+			continue;
+		}
+
+		if (word == "mode") {
+			is >> word;
+			if (word != "linear" && word != "step") {
+				throw error("mode must be linear or step");
+			}
+			step = (word == "step");
+		} else if (word == "scale") {
+			if (!(is >> scale) || scale < 0) {
+				throw error("invalid scale");
+			}
+		} else if (word == "timescale") {
+			if (!(is >> timescale) || timescale <= 0) {
+				throw error("invalid timescale");
+			}
+		} else if (word == "repeat") {
+			// read signed, as -1 would otherwise be read as ~0u
+			long count;
+			if (!(is >> count) || count < 1 || count > max_repeat) {
+				throw error("invalid repeat count");
+			}
+			repeat = count;
+		} else {
+			point_t p;
+			std::istringstream ps(line);
+			if (!(ps >> p.time >> p.rate) || p.time < 0 || p.rate < 0) {
+				throw error("invalid profile point");
+			}
+			if (points.empty() ? (p.time != 0) : (p.time <= points.back().time)) {
+				throw error("profile must start at time zero, and times must increase");
+			}
+			ps >> std::ws;
+			std::getline(ps, p.label);
+			points.push_back(p);
+		}
+	}
+
+	if (points.size() < 2) {
+		throw std::runtime_error("load profile needs at least two points: " + filename);
+	}
+
+	// the factors apply wherever they appear in the file
+	for (auto& p: points) {
+		p.time *= timescale;
+		p.rate *= scale;
+	}
+}
+
+size_t LoadProfile::segment(double elapsed) const
+{
+	if (elapsed >= duration()) {
+		return segments() - 1;
+	}
+
+	// find the time within the current repetition
+	double t = std::fmod(std::max(elapsed, 0.0), period());
+	auto it = std::upper_bound(points.cbegin(), points.cend(), t,
+		[](double t, const point_t& p) { return t < p.time; });
+
+	return (it - points.cbegin()) - 1;
+}
+
+double LoadProfile::rate(double elapsed) const
+{
+	if (elapsed >= duration()) {
+		return points.back().rate;
+	}
+
+	auto n = segment(elapsed);
+	auto& a = points[n];
+	auto& b = points[n + 1];
+
+	if (step) {
+		return a.rate;
+	}
+
+	double t = std::fmod(std::max(elapsed, 0.0), period());
+	return a.rate + (b.rate - a.rate) * (t - a.time) / (b.time - a.time);
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+//
+// a schedule of sending rates over time, read from a file
+//
+// each line of the file is either a point "<seconds> <rate> [label]"
+// or one of the directives:
+//
+//   mode linear|step	interpolate between points, or hold each
+//			point's rate until the next (default linear)
+//   scale <factor>	multiply every rate by this factor
+//   timescale <factor>	multiply every time by this factor (e.g. 0.01
+//			to replay a day's curve in under 15 minutes)
+//   repeat <count>	run through the whole profile this many times
+//			(from 1 to max_repeat)
+//
+// the first point must be at time zero and times must increase, and
+// the last point marks the end of the profile, so each point other
+// than the last starts a segment that runs until the next one.
+//
+class LoadProfile {
+
+public:
+	typedef struct {
+		double			time;		// seconds, after timescale
+		double			rate;		// after scale
+		std::string		label;
+	} point_t;
+
+	static const long		max_repeat = 1000000;
+
+private:
+	std::vector<point_t>		points;
+	bool				step = false;
+	unsigned int			repeat = 1;
+
+public:
+					LoadProfile(const std::string& filename);
+
+public:
+	// the length of one pass through the profile, in seconds
+	double				period() const { return points.back().time; };
+
+	// the length of the whole profile, including repeats
+	double				duration() const { return period() * repeat; };
+
+	// the number of segments, which is one fewer than the points
+	size_t				segments() const { return points.size() - 1; };
+	const point_t&			point(size_t n) const { return points[n]; };
+
+	// the segment in effect at the given time, and its rate
+	size_t				segment(double elapsed) const;
+	double				rate(double elapsed) const;
+};
@@ -9,265 +9,933 @@
  * information regarding copyright ownership.
  */
 
+#include <cmath>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <limits>
 #include <iostream>
 #include <sstream>
 #include <fstream>
 #include <stdexcept>
 #include <cerrno>
-#include <map>
 #include <algorithm>
+#include <atomic>
+#include <thread>
 
+#include <unistd.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <strings.h>
 #include <arpa/inet.h>		// for ntohs() etc
-#include <resolv.h>		// for res_mkquery()
 
+#include "pcap.h"
 #include "queryfile.h"
 #include "util.h"
 
 //
-// from https://www.iana.org/assignments/dns-parameters/dns-parameters.xhtml
-//
-static std::map<std::string, uint16_t> type_map = {
-	{ "A",		    1 },
-	{ "NS",		    2 },
-	{ "MD",		    3 },
-	{ "MF",		    4 },
-	{ "CNAME",	    5 },
-	{ "SOA",	    6 },
-	{ "MB",		    7 },
-	{ "MG",		    8 },
-	{ "MR",		    9 },
-	{ "NULL",	   10 },
-	{ "WKS",	   11 },
-	{ "PTR",	   12 },
-	{ "HINFO",	   13 },
-	{ "MINFO",	   14 },
-	{ "MX",		   15 },
-	{ "TXT",	   16 },
-	{ "RP",		   17 },
-	{ "AFSDB",	   18 },
-	{ "X25",	   19 },
-	{ "ISDN",	   20 },
-	{ "RT",		   21 },
-	{ "NSAP",	   22 },
-	{ "NSAP-PTR",	   23 },
-	{ "SIG",	   24 },
-	{ "KEY",	   25 },
-	{ "PX",		   26 },
-	{ "GPOS",	   27 },
-	{ "AAAA",	   28 },
-	{ "LOC",	   29 },
-	{ "NXT",	   30 },
-	{ "EID",	   31 },
-	{ "NIMLOC",	   32 },
-	{ "SRV",	   33 },
-	{ "ATMA",	   34 },
-	{ "NAPTR",	   35 },
-	{ "KX",		   36 },
-	{ "CERT",	   37 },
-	{ "A6",		   38 },
-	{ "DNAME",	   39 },
-	{ "SINK",	   40 },
-	{ "OPT",	   41 },
-	{ "APL",	   42 },
-	{ "DS",		   43 },
-	{ "SSHFP",	   44 },
-	{ "IPSECKEY",	   45 },
-	{ "RRSIG",	   46 },
-	{ "NSEC",	   47 },
-	{ "DNSKEY",	   48 },
-	{ "DHCID",	   49 },
-	{ "NSEC3",	   50 },
-	{ "NSEC3PARAM",	   51 },
-	{ "TLSA",	   52 },
-	{ "SMIMEA",	   53 },
-	{ "HIP",	   55 },
-	{ "NINFO",	   56 },
-	{ "RKEY",	   57 },
-	{ "TALINK",	   58 },
-	{ "CDS",	   59 },
-	{ "CDNSKEY",	   60 },
-	{ "OPENPGPKEY",	   61 },
-	{ "CSYNC",	   62 },
-	{ "SPF",	   99 },
-	{ "UINFO",	  100 },
-	{ "UID",	  101 },
-	{ "GID",	  102 },
-	{ "UNSPEC",	  103 },
-	{ "NID",	  104 },
-	{ "L32",	  105 },
-	{ "L64",	  106 },
-	{ "LP",		  107 },
-	{ "EUI48",	  108 },
-	{ "EUI64",	  109 },
-	{ "TKEY",	  249 },
-	{ "TSIG",	  250 },
-	{ "IXFR",	  251 },
-	{ "AXFR",	  252 },
-	{ "MAILB",	  253 },
-	{ "MAILA",	  254 },
-	{ "ANY",	  255 },
-	{ "URI",	  256 },
-	{ "CAA",	  257 },
-	{ "AVC",	  258 },
-	{ "DOA",	  259 },
-	{ "TA",		32768 },
-	{ "DLV",	32769 }
+// header of the v2 ("indexed") raw file format, which is laid out as:
+//
+//   header (padded to v2_data_align bytes)
+//   payloads in raw format, starting at data_offset (page aligned)
+//   64-bit offset of each record within the payloads, starting at
+//   index_offset (8 byte aligned)
+//
+// all header and index fields are little-endian.  the checksum is
+// FNV-1a (64 bit) over the payloads followed by the index.
+//
+typedef struct __attribute__((packed)) {
+	char				magic[8];
+	uint32_t			version;
+	uint32_t			flags;
+	uint64_t			count;
+	uint64_t			data_offset;
+	uint64_t			data_size;
+	uint64_t			index_offset;
+	uint64_t			checksum;
+	uint16_t			edns_buflen;
+	uint16_t			edns_flags;
+	uint8_t				reserved[12];
+} v2_header_t;
+
+static const char v2_magic[8] = { 'D', 'N', 'S', 'G', 'E', 'N', 'R', 'Q' };
+static const uint32_t v2_version = 2;
+static const size_t v2_data_align = 4096;
+
+static const uint64_t fnv_basis = 0xcbf29ce484222325ULL;
+static const uint64_t fnv_prime = 0x100000001b3ULL;
+
+// 64-bit FNV-1a hash, which may be continued across calls
+static uint64_t fnv1a(const void* buf, size_t n, uint64_t hash = fnv_basis)
+{
+	auto p = reinterpret_cast<const uint8_t*>(buf);
+	while (n--) {
+		hash ^= *p++;
+		hash *= fnv_prime;
+	}
+	return hash;
+}
+
+// closes a file descriptor however the enclosing scope is left
+class FileCloser {
+
+private:
+	int				fd;
+
+public:
+					FileCloser(int fd) : fd(fd) {};
+					FileCloser(const FileCloser&) = delete;
+	FileCloser&			operator=(const FileCloser&) = delete;
+					~FileCloser() { ::close(fd); };
 };
 
 //
-// Converts an RR type string to its numeric equivalent
+// compile-time FNV-1a hash of an (upper-cased) RR type mnemonic
+//
+static constexpr char upper(char c)
+{
+	return (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+}
+
+static constexpr uint32_t type_hash(const char* s, uint32_t hash = 2166136261u)
+{
+	return *s ? type_hash(s + 1, (hash ^ static_cast<uint8_t>(upper(*s))) * 16777619u) : hash;
+}
+
+// the same hash at run-time, for a string that isn't NUL terminated
+static uint32_t type_hash(const char* s, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	while (len--) {
+		hash = (hash ^ static_cast<uint8_t>(upper(*s++))) * 16777619u;
+	}
+	return hash;
+}
+
+// case-insensitive comparison of a candidate against a mnemonic
+static bool type_match(const char* s, size_t len, const char* name)
+{
+	return strlen(name) == len && strncasecmp(s, name, len) == 0;
+}
+
+//
+// Converts an RR type string to its numeric equivalent, or
+// throws an exception if it's not recognised
 //
-// for performance, the match against the uppercase table
-// above is always done first (since the input files are
-// typically in upper case) and only if that lookup fails
-// does the code then create a temporary upper-cased
-// version of the input and recursively calls itself
+// the mnemonics are looked up via a perfect hash - each is a
+// `case` label of the switch below and any collision between
+// their hashes is therefore a compile-time error.  a single
+// string comparison then rejects any non-member that happens
+// to share a hash value.
 //
-static uint16_t type_to_number(const std::string& type, bool case_insensitive = true)
+// the table is from
+// https://www.iana.org/assignments/dns-parameters/dns-parameters.xhtml
+//
+static uint16_t type_to_number(const char* type, size_t len)
 {
-	auto itr = type_map.find(type);
-	if (itr != type_map.end()) {
-		return itr->second;
-	} else if (type.compare(0, 4, "TYPE", 4) == 0) {
-		size_t index;
-		std::string num = type.substr(4, std::string::npos);
-		try {
-			unsigned long val = std::stoul(num, &index, 10);
-			if (num.cbegin() + index != num.cend()) {
-				throw std::runtime_error("numeric QTYPE trailing garbage");
-			} else if (val > std::numeric_limits<uint16_t>::max()) {
+#define QTYPE(name, value) \
+	case type_hash(name): \
+		if (type_match(type, len, name)) return value; \
+		break;
+
+	switch (type_hash(type, len)) {
+	QTYPE("A",		    1)
+	QTYPE("NS",		    2)
+	QTYPE("MD",		    3)
+	QTYPE("MF",		    4)
+	QTYPE("CNAME",		    5)
+	QTYPE("SOA",		    6)
+	QTYPE("MB",		    7)
+	QTYPE("MG",		    8)
+	QTYPE("MR",		    9)
+	QTYPE("NULL",		   10)
+	QTYPE("WKS",		   11)
+	QTYPE("PTR",		   12)
+	QTYPE("HINFO",		   13)
+	QTYPE("MINFO",		   14)
+	QTYPE("MX",		   15)
+	QTYPE("TXT",		   16)
+	QTYPE("RP",		   17)
+	QTYPE("AFSDB",		   18)
+	QTYPE("X25",		   19)
+	QTYPE("ISDN",		   20)
+	QTYPE("RT",		   21)
+	QTYPE("NSAP",		   22)
+	QTYPE("NSAP-PTR",	   23)
+	QTYPE("SIG",		   24)
+	QTYPE("KEY",		   25)
+	QTYPE("PX",		   26)
+	QTYPE("GPOS",		   27)
+	QTYPE("AAAA",		   28)
+	QTYPE("LOC",		   29)
+	QTYPE("NXT",		   30)
+	QTYPE("EID",		   31)
+	QTYPE("NIMLOC",		   32)
+	QTYPE("SRV",		   33)
+	QTYPE("ATMA",		   34)
+	QTYPE("NAPTR",		   35)
+	QTYPE("KX",		   36)
+	QTYPE("CERT",		   37)
+	QTYPE("A6",		   38)
+	QTYPE("DNAME",		   39)
+	QTYPE("SINK",		   40)
+	QTYPE("OPT",		   41)
+	QTYPE("APL",		   42)
+	QTYPE("DS",		   43)
+	QTYPE("SSHFP",		   44)
+	QTYPE("IPSECKEY",	   45)
+	QTYPE("RRSIG",		   46)
+	QTYPE("NSEC",		   47)
+	QTYPE("DNSKEY",		   48)
+	QTYPE("DHCID",		   49)
+	QTYPE("NSEC3",		   50)
+	QTYPE("NSEC3PARAM",	   51)
+	QTYPE("TLSA",		   52)
+	QTYPE("SMIMEA",		   53)
+	QTYPE("HIP",		   55)
+	QTYPE("NINFO",		   56)
+	QTYPE("RKEY",		   57)
+	QTYPE("TALINK",		   58)
+	QTYPE("CDS",		   59)
+	QTYPE("CDNSKEY",	   60)
+	QTYPE("OPENPGPKEY",	   61)
+	QTYPE("CSYNC",		   62)
+	QTYPE("SPF",		   99)
+	QTYPE("UINFO",		  100)
+	QTYPE("UID",		  101)
+	QTYPE("GID",		  102)
+	QTYPE("UNSPEC",		  103)
+	QTYPE("NID",		  104)
+	QTYPE("L32",		  105)
+	QTYPE("L64",		  106)
+	QTYPE("LP",		  107)
+	QTYPE("EUI48",		  108)
+	QTYPE("EUI64",		  109)
+	QTYPE("TKEY",		  249)
+	QTYPE("TSIG",		  250)
+	QTYPE("IXFR",		  251)
+	QTYPE("AXFR",		  252)
+	QTYPE("MAILB",		  253)
+	QTYPE("MAILA",		  254)
+	QTYPE("ANY",		  255)
+	QTYPE("URI",		  256)
+	QTYPE("CAA",		  257)
+	QTYPE("AVC",		  258)
+	QTYPE("DOA",		  259)
+	QTYPE("TA",		32768)
+	QTYPE("DLV",		32769)
+	}
+
+#undef QTYPE
+
+	if (len > 4 && strncasecmp(type, "TYPE", 4) == 0) {
+		unsigned long val = 0;
+		for (size_t i = 4; i < len; ++i) {
+			if (type[i] < '0' || type[i] > '9') {
+				throw std::runtime_error("numeric QTYPE unparseable");
+			}
+			val = val * 10 + (type[i] - '0');
+			if (val > std::numeric_limits<uint16_t>::max()) {
 				throw std::runtime_error("numeric QTYPE out of range");
+			}
+		}
+		return val;
+	}
+
+	throw std::runtime_error("unrecognised QTYPE: " + std::string(type, len));
+}
+
+//
+// Encodes a presentation format domain name (with optional \X and
+// \DDD escapes) into wire format without allocating any memory.
+// `out` must have room for at least 255 bytes.
+//
+// the name may also contain templates of the form {rand:<N>}, which
+// are replaced by N zero bytes to be filled in at random as each
+// query is sent, and whose positions are appended to `spans`
+//
+// returns the length of the encoded name
+//
+static size_t encode_name(const char* p, const char* end, uint8_t* out,
+			  std::vector<QueryFile::Span>& spans)
+{
+	// the root name
+	if (end - p == 1 && *p == '.') {
+		out[0] = 0;
+		return 1;
+	}
+
+	auto label = out;		// current label length byte
+	auto q = out + 1;
+
+	while (p < end) {
+		uint8_t c = *p++;
+
+		if (c == '.') {
+			size_t len = q - label - 1;
+			if (len == 0 || len > 63) {
+				throw std::runtime_error("couldn't parse domain name");
+			}
+			*label = len;
+			label = q++;
+			continue;
+		}
+
+		if (c == '{' && end - p >= 5 && memcmp(p, "rand:", 5) == 0) {
+			size_t n = 0;
+			for (p += 5; p < end && *p >= '0' && *p <= '9' && n <= 63; ++p) {
+				n = n * 10 + (*p - '0');
+			}
+			if (p == end || *p++ != '}' || n < 1 || n > 63) {
+				throw std::runtime_error("invalid name template");
+			}
+			if (q - out + n >= 255) {
+				throw std::runtime_error("couldn't parse domain name");
+			}
+			spans.push_back(QueryFile::Span { uint16_t(12 + (q - out)), uint16_t(n) });
+			memset(q, 0, n);
+			q += n;
+			continue;
+		}
+
+		if (c == '\\') {
+			if (p == end) {
+				throw std::runtime_error("couldn't parse domain name");
+			}
+			if (*p >= '0' && *p <= '9') {
+				if (end - p < 3) {
+					throw std::runtime_error("couldn't parse domain name");
+				}
+				unsigned int val = 0;
+				for (int i = 0; i < 3; ++i) {
+					if (p[i] < '0' || p[i] > '9') {
+						throw std::runtime_error("couldn't parse domain name");
+					}
+					val = val * 10 + (p[i] - '0');
+				}
+				if (val > 255) {
+					throw std::runtime_error("couldn't parse domain name");
+				}
+				c = val;
+				p += 3;
 			} else {
-				return type_map[type] = val;
+				c = *p++;
 			}
-		} catch (std::logic_error& e) {
-			throw std::runtime_error("numeric QTYPE unparseable");
 		}
-	} else {
-		// search again using the upper-cased version of the string
-		if (case_insensitive) {
-			std::string tmp(type);
-			std::transform(tmp.cbegin(), tmp.cend(), tmp.begin(), ::toupper);
-			return type_map[type] = type_to_number(tmp, false);
-		} else {
-			throw std::runtime_error("unrecognised QTYPE: " + type);
+
+		// leave room for the terminating root label
+		if (q - out >= 254) {
+			throw std::runtime_error("couldn't parse domain name");
 		}
+		*q++ = c;
 	}
+
+	// close the final label, unless the name had a trailing dot
+	size_t len = q - label - 1;
+	if (len > 63) {
+		throw std::runtime_error("couldn't parse domain name");
+	}
+	*label = len;
+	if (len > 0) {
+		*q++ = 0;
+	}
+
+	return q - out;
 }
 
 //
-// creates a Record entry from the given qname and qtype
+// appends a query record (with length prefix) for the given qname
+// and qtype to the arena.  the header is the same as res_mkquery()
+// would produce, i.e. RD set and a QDCOUNT of one.
 //
-static QueryFile::Record make_record(const std::string& name, const std::string& type)
+static void make_record(std::vector<uint8_t>& arena, const char* name, const char* name_end,
+			const char* type, size_t type_len, uint16_t id,
+			std::vector<QueryFile::Span>& spans)
 {
-	QueryFile::Record record;
-	record.resize(12 + 255 + 4);	// maximum question section
+	const size_t maxlen = 12 + 255 + 4;	// maximum question section
 
-	uint16_t qtype = type_to_number(type);
+	uint16_t qtype = type_to_number(type, type_len);
 
-	int n = res_mkquery(0, name.c_str(), 1, qtype, nullptr, 0, nullptr,
-			    record.data(), record.size());
-	if (n < 0) {
-		throw std::runtime_error("couldn't parse domain name");
-	} else {
-		record.resize(n);
-		return record;
+	size_t offset = arena.size();
+	arena.resize(offset + 2 + maxlen);
+
+	auto p = arena.data() + offset;
+	size_t n;
+	try {
+		n = encode_name(name, name_end, p + 2 + 12, spans);
+	} catch (...) {
+		arena.resize(offset);
+		throw;
+	}
+
+	auto hdr = p + 2;
+	memset(hdr, 0, 12);
+	hdr[0] = id >> 8;
+	hdr[1] = id & 0xff;
+	hdr[2] = 0x01;			// RD
+	hdr[5] = 1;			// QDCOUNT
+
+	auto q = hdr + 12 + n;
+	*q++ = qtype >> 8;
+	*q++ = qtype & 0xff;
+	*q++ = 0;			// QCLASS = IN
+	*q++ = 1;
+
+	n = q - hdr;
+	p[0] = n >> 8;
+	p[1] = n & 0xff;
+	arena.resize(offset + 2 + n);
+}
+
+//
+// Parses the lines between `p` and `end` (which must end at a line
+// boundary) into the chunk's own arena and index.  blank lines are
+// ignored.  if `weighted`, an optional third field gives the query's
+// relative weight, which otherwise defaults to 1.  any other fields
+// are unused.  names may contain random templates, as described in
+// encode_name().
+//
+// on error the chunk's `error` is set, along with the line number
+// (relative to the start of the chunk), and parsing stops.
+// otherwise `lines` is set to the number of lines parsed.  as in the
+// original single-threaded parser, only lines with a query on them
+// are counted.
+//
+void QueryFile::parse_txt(const char* p, const char* end, QueryFile::Chunk& chunk, uint16_t seed, bool weighted)
+{
+	uint16_t id = seed | 1;
+	size_t line_no = 0;
+
+	auto space = [](char c) { return c == ' ' || c == '\t' || c == '\r'; };
+
+	while (p < end) {
+		auto eol = reinterpret_cast<const char*>(memchr(p, '\n', end - p));
+		if (!eol) eol = end;
+
+		// find the name and type fields
+		while (p < eol && space(*p)) ++p;
+		auto name = p;
+		while (p < eol && !space(*p)) ++p;
+		auto name_end = p;
+		while (p < eol && space(*p)) ++p;
+		auto type = p;
+		while (p < eol && !space(*p)) ++p;
+		auto type_end = p;
+		while (p < eol && space(*p)) ++p;
+		auto weight = p;
+		while (weighted && p < eol && !space(*p)) ++p;
+		auto weight_end = p;
+
+		if (name != name_end) {
+			++line_no;
+			try {
+				if (type == type_end) {
+					throw std::runtime_error("missing QTYPE");
+				}
+
+				float w = 1.0f;
+				if (weight != weight_end) {
+					char *end;
+					w = strtof(std::string(weight, weight_end).c_str(), &end);
+					if (*end || w < 0 || !std::isfinite(w)) {
+						throw std::runtime_error("invalid weight");
+					}
+				}
+
+				// xorshift16 for the message IDs
+				id ^= id << 7;
+				id ^= id >> 9;
+				id ^= id << 8;
+
+				// the query is only indexed once it's complete
+				size_t offset = chunk.arena.size();
+				size_t spans = chunk.spans.size();
+				make_record(chunk.arena, name, name_end, type, type_end - type, id, chunk.spans);
+				chunk.index.push_back(offset);
+
+				// likewise the span index, once there's a template
+				if (!chunk.spans.empty()) {
+					chunk.span_index.resize(chunk.index.size() - 1, 0);
+					chunk.span_index.push_back(spans);
+				}
+
+				// the weights are only kept once one is given
+				if (weight != weight_end) {
+					chunk.weights.resize(chunk.index.size() - 1, 1.0f);
+					chunk.weights.push_back(w);
+				} else if (!chunk.weights.empty()) {
+					chunk.weights.push_back(1.0f);
+				}
+			} catch (std::runtime_error& e) {
+				chunk.error = e.what();
+				chunk.error_line = line_no;
+				return;
+			}
+		}
+
+		p = eol + 1;
+	}
+
+	chunk.lines = line_no;
+}
+
+QueryFile::~QueryFile()
+{
+	unmap();
+}
+
+//
+// releases any read-only mapping of a v2 file
+//
+void QueryFile::unmap()
+{
+	if (map) {
+		::munmap(map, map_size);
+		map = nullptr;
+		map_size = 0;
 	}
 }
 
 //
-// Loads a text file (in dnsperf format)
+// takes ownership of a newly built arena and index
 //
-void QueryFile::read_txt(const std::string& filename)
+void QueryFile::adopt(std::vector<uint8_t>& list, std::vector<uint64_t>& offs)
 {
-	std::ifstream file(filename);
-	if (!file) {
+	unmap();
+
+	std::swap(arena, list);
+	std::swap(index, offs);
+
+	data = arena.data();
+	data_size = arena.size();
+	offsets = index.data();
+	count = index.size();
+}
+
+//
+// Loads a text file (in dnsperf format), with the queries' weights
+// if `weighted`
+//
+// the file is split into line-aligned chunks which are parsed in
+// parallel, after which the results are concatenated in order
+//
+void QueryFile::read_txt(const std::string& filename, bool weighted)
+{
+	int fd = ::open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
 		throw_errno("opening query file");
 	}
 
-	storage_t list;
-	std::string name, type;
-	size_t line_no = 0;
+	struct stat st;
+	if (::fstat(fd, &st) < 0) {
+		::close(fd);
+		throw_errno("stat query file");
+	}
 
-	while (file >> name >> type) {
-		line_no++;
+	size_t size = st.st_size;
+	const char* text = "";
+	void* p = nullptr;
 
-		try {
-			Record record;
-			list.push_back(make_record(name, type));
-		} catch (std::runtime_error &e) {
+	if (size > 0) {
+		p = ::mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+		if (p == MAP_FAILED) {
+			::close(fd);
+			throw_errno("mmap query file");
+		}
+		text = reinterpret_cast<const char*>(p);
+	}
+	::close(fd);
+
+	// split into roughly equal line-aligned chunks of at least 1MB
+	const size_t min_chunk = 1 << 20;
+	size_t workers = std::max(1U, std::thread::hardware_concurrency());
+	size_t nchunks = std::max(size_t(1), std::min(workers * 4, size / min_chunk));
+
+	std::vector<const char*> bounds = { text };
+	for (size_t i = 1; i < nchunks; ++i) {
+		auto start = std::max(bounds.back(), text + i * (size / nchunks));
+		auto eol = reinterpret_cast<const char*>(memchr(start, '\n', text + size - start));
+		if (!eol) break;
+		bounds.push_back(eol + 1);
+	}
+	bounds.push_back(text + size);
+	nchunks = bounds.size() - 1;
+
+	// parse all of the chunks, with each worker taking the next one
+	std::vector<Chunk> chunks(nchunks);
+	std::atomic<size_t> next(0);
+
+	auto worker = [&]() {
+		size_t i;
+		while ((i = next++) < nchunks) {
+			parse_txt(bounds[i], bounds[i + 1], chunks[i], i * 40503, weighted);
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < std::min(workers, nchunks); ++i) {
+		threads.emplace_back(worker);
+	}
+	worker();
+	for (auto& t: threads) {
+		t.join();
+	}
+
+	if (p) {
+		::munmap(p, size);
+	}
+
+	// report the first error found, with its absolute line number
+	size_t line_no = 0;
+	size_t total = 0, count = 0;
+	for (auto& chunk: chunks) {
+		if (!chunk.error.empty()) {
 			std::string error = "reading query file at line "
-					+ std::to_string(line_no)
-					+ ": " + e.what();
-			throw_errno(error);
+					+ std::to_string(line_no + chunk.error_line)
+					+ ": " + chunk.error;
+			throw std::runtime_error(error);
 		}
+		line_no += chunk.lines;
+		total += chunk.arena.size();
+		count += chunk.index.size();
+	}
+
+	// concatenate the chunks in order, with weights and span indexes
+	// for all of the queries if any chunk has them
+	bool has_weights = std::any_of(chunks.cbegin(), chunks.cend(),
+				       [](const Chunk& chunk) { return !chunk.weights.empty(); });
+	bool templated = std::any_of(chunks.cbegin(), chunks.cend(),
+				     [](const Chunk& chunk) { return !chunk.spans.empty(); });
+	std::vector<uint8_t> list;
+	std::vector<uint64_t> offs;
+	std::vector<float> weights;
+	std::vector<uint32_t> span_index;
+	std::vector<Span> spans;
+	list.reserve(total);
+	offs.reserve(count);
+	if (has_weights) {
+		weights.reserve(count);
+	}
+	if (templated) {
+		span_index.reserve(count + 1);
+	}
+
+	for (auto& chunk: chunks) {
+		uint64_t base = list.size();
+		list.insert(list.end(), chunk.arena.cbegin(), chunk.arena.cend());
+		for (auto offset: chunk.index) {
+			offs.push_back(base + offset);
+		}
+		if (has_weights) {
+			chunk.weights.resize(chunk.index.size(), 1.0f);
+			weights.insert(weights.end(), chunk.weights.cbegin(), chunk.weights.cend());
+		}
+		if (templated) {
+			chunk.span_index.resize(chunk.index.size(), 0);
+			for (auto first: chunk.span_index) {
+				span_index.push_back(spans.size() + first);
+			}
+			spans.insert(spans.end(), chunk.spans.cbegin(), chunk.spans.cend());
+		}
+		std::vector<uint8_t>().swap(chunk.arena);
+		std::vector<uint64_t>().swap(chunk.index);
+		std::vector<float>().swap(chunk.weights);
+		std::vector<uint32_t>().swap(chunk.span_index);
+		std::vector<Span>().swap(chunk.spans);
+	}
+	if (templated) {
+		span_index.push_back(spans.size());
+	}
+
+	adopt(list, offs);
+	std::swap(query_weights, weights);
+	std::swap(template_index, span_index);
+	std::swap(template_spans, spans);
+	file_flags = 0;
+}
+
+//
+// Maps a v2 file read-only, using its payloads and (on little-endian
+// hosts) its index in place without copying
+//
+void QueryFile::map_indexed(int fd, size_t size)
+{
+	void *p = ::mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		throw_errno("mmap query file");
+	}
+
+	auto base = reinterpret_cast<const uint8_t*>(p);
+	auto& hdr = *reinterpret_cast<const v2_header_t*>(p);
+
+	uint64_t n = le64toh(hdr.count);
+	uint64_t data_offset = le64toh(hdr.data_offset);
+	uint64_t data_len = le64toh(hdr.data_size);
+	uint64_t index_offset = le64toh(hdr.index_offset);
+
+	if (le32toh(hdr.version) != v2_version ||
+	    data_offset < sizeof(hdr) ||
+	    data_offset + data_len > size ||
+	    (index_offset % sizeof(uint64_t)) != 0 ||
+	    index_offset > size ||
+	    n > (size - index_offset) / sizeof(uint64_t))
+	{
+		::munmap(p, size);
+		throw std::runtime_error("invalid v2 query file header");
+	}
+
+	std::vector<uint8_t> list;
+	std::vector<uint64_t> offs;
+#if __BYTE_ORDER != __LITTLE_ENDIAN
+	auto idx = reinterpret_cast<const uint64_t*>(base + index_offset);
+	offs.resize(n);
+	for (uint64_t i = 0; i < n; ++i) {
+		offs[i] = le64toh(idx[i]);
 	}
+#endif
+	adopt(list, offs);
+	query_weights.clear();
+	template_index.clear();
+	template_spans.clear();
 
-	file.close();
+	map = p;
+	map_size = size;
 
-	std::swap(queries, list);
+	data = base + data_offset;
+	data_size = data_len;
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	offsets = reinterpret_cast<const uint64_t*>(base + index_offset);
+#endif
+	count = n;
+
+	file_flags = le32toh(hdr.flags);
+	edns_buflen = le16toh(hdr.edns_buflen);
+	edns_flags = le16toh(hdr.edns_flags);
+
+	// the records are used in place, so a truncated or corrupt index
+	// mustn't lead anything outside the payloads
+	if (!bounded()) {
+		std::vector<uint8_t> list;
+		std::vector<uint64_t> offs;
+		adopt(list, offs);
+		throw std::runtime_error("invalid v2 query file index");
+	}
 }
 
 //
-// Loads a raw input file (<16 bit network order length><payload...>)
+// Loads a raw input file, in either the legacy format or the
+// v2 indexed format (which is detected by its magic number)
+//
+// the legacy format (<16 bit network order length><payload...>)
+// is the same as the arena layout so the whole file is read in
+// one go and then scanned to build the index.  a truncated final
+// record is discarded.
 //
 void QueryFile::read_raw(const std::string& filename)
 {
-	std::ifstream file(filename, std::ifstream::binary);
-	if (!file) {
+	int fd = ::open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
 		throw_errno("opening query file");
 	}
 
-	storage_t list;
-	uint16_t len;
+	struct stat st;
+	if (::fstat(fd, &st) < 0) {
+		::close(fd);
+		throw_errno("stat query file");
+	}
 
-	while (file) {
-		if (file.read(reinterpret_cast<char*>(&len), sizeof(len))) {
+	size_t size = st.st_size;
 
-			len = ntohs(len);		// swap to host order
+	char magic[sizeof(v2_magic)];
+	if (size >= sizeof(v2_header_t) &&
+	    ::pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+	    memcmp(magic, v2_magic, sizeof(magic)) == 0)
+	{
+		try {
+			map_indexed(fd, size);
+		} catch (...) {
+			::close(fd);
+			throw;
+		}
+		::close(fd);
+		return;
+	}
 
-			Record record;
-			record.resize(len);
+	std::vector<uint8_t> list(size);
+	std::vector<uint64_t> offs;
 
-			if (file.read(reinterpret_cast<char*>(record.data()), len)) {
-				list.push_back(record);
-			}
+	size_t offset = 0;
+	while (offset < size) {
+		auto res = ::read(fd, list.data() + offset, size - offset);
+		if (res <= 0) {
+			::close(fd);
+			throw_errno("reading query file");
+		}
+		offset += res;
+	}
+	::close(fd);
+
+	offset = 0;
+	while (offset + 2 <= list.size()) {
+		Record record(&list[offset]);
+		size_t next = offset + 2 + record.size();
+		if (next > list.size()) {
+			break;
+		}
+		offs.push_back(offset);
+		offset = next;
+	}
+
+	list.resize(offset);
+	offs.shrink_to_fit();
+
+	adopt(list, offs);
+	query_weights.clear();
+	template_index.clear();
+	template_spans.clear();
+	file_flags = 0;
+}
+
+//
+// Loads the DNS queries from a pcap or pcapng capture file
+//
+// every UDP datagram sent to port 53 or the given port that looks
+// like a DNS query (i.e. has a complete header without the QR bit)
+// is kept, along with its source address and port and its time
+// relative to the first query.  captures are not always in strict
+// time order, so a query that appears to precede the one before it
+// is treated as simultaneous with it.  datagrams cut short by the
+// capture's snaplen are skipped, and counted in the Capture.
+//
+void QueryFile::read_pcap(const std::string& filename, uint16_t port, Capture& capture)
+{
+	PcapReader reader(filename);
+	PcapReader::datagram_t dgram;
+
+	std::vector<uint8_t> list;
+	std::vector<uint64_t> offs;
+	Capture cap;
+	uint64_t first = 0, last = 0;
+
+	while (reader.next(dgram)) {
+		if (dgram.dport != htons(53) && dgram.dport != htons(port)) {
+			continue;
 		}
+		if (dgram.size < 12 || (dgram.payload[2] & 0x80)) {
+			continue;
+		}
+
+		if (offs.empty()) {
+			first = last = dgram.time;
+		}
+		last = std::max(last, dgram.time);
+
+		offs.push_back(list.size());
+		list.push_back(dgram.size >> 8);
+		list.push_back(dgram.size & 0xff);
+		list.insert(list.end(), dgram.payload, dgram.payload + dgram.size);
+
+		cap.time.push_back(last - first);
+		cap.saddr.push_back(dgram.saddr);
+		cap.sport.push_back(dgram.sport);
 	}
 
-	file.close();
+	if (offs.empty()) {
+		throw std::runtime_error("no DNS queries found in " + filename);
+	}
+
+	cap.truncated = reader.truncated();
 
-	std::swap(queries, list);
+	adopt(list, offs);
+	query_weights.clear();
+	template_index.clear();
+	template_spans.clear();
+	file_flags = 0;
+	std::swap(capture, cap);
 }
 
 //
-// Saves the query set in raw format
+// Saves the query set in (legacy) raw format
 //
 void QueryFile::write_raw(const std::string& filename) const
 {
-	std::ofstream file(filename, std::ifstream::binary);
-	if (!file) {
+	int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
 		throw_errno("opening query file");
 	}
+	FileCloser closer(fd);
 
-	for (const auto& query: queries) {
-		uint16_t len = htons(query.size());	// big-endian
-		file.write(reinterpret_cast<const char*>(&len), sizeof(len));
-		file.write(reinterpret_cast<const char*>(query.data()), query.size());
+	// the arena is already in raw format
+	QueryWriter writer(fd, false);
+	writer.write(data, data_size, offsets, count);
+	writer.close();
+}
+
+//
+// Saves the query set in v2 indexed format
+//
+void QueryFile::write_indexed(const std::string& filename) const
+{
+	int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		throw_errno("opening query file");
 	}
+	FileCloser closer(fd);
 
-	file.close();
+	QueryWriter writer(fd, true, file_flags, edns_buflen, edns_flags);
+	writer.write(data, data_size, offsets, count);
+	writer.close();
 }
 
 //
-// Adds an EDNS OPT RR to every record in the QueryFile with
-// the specified UDP buffer length and flags
+// Checks that every record lies within the arena
 //
-void QueryFile::edns(const uint16_t buflen, uint16_t flags)
+bool QueryFile::bounded() const
+{
+	for (size_t i = 0; i < count; ++i) {
+		if (offsets[i] > data_size || data_size - offsets[i] < 2 ||
+		    data_size - offsets[i] - 2 < Record(data + offsets[i]).size())
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+//
+// Checks that every record lies within the arena and, for a mapped
+// v2 file, that the checksum is correct
+//
+bool QueryFile::verify() const
+{
+	if (!bounded()) {
+		return false;
+	}
+
+	if (map) {
+		auto& hdr = *reinterpret_cast<const v2_header_t*>(map);
+		auto base = reinterpret_cast<const uint8_t*>(map);
+		uint64_t checksum = fnv1a(data, data_size);
+		checksum = fnv1a(base + le64toh(hdr.index_offset), count * sizeof(uint64_t), checksum);
+		return checksum == le64toh(hdr.checksum);
+	}
+
+	return true;
+}
+
+//
+// Copies every record into a new arena, each followed by an EDNS
+// OPT RR with the specified UDP buffer length and flags
+//
+void QueryFile::add_opt(const uint8_t* data, size_t data_size,
+			const uint64_t* offsets, size_t count,
+			uint16_t buflen, uint16_t flags,
+			std::vector<uint8_t>& list, std::vector<uint64_t>& offs)
 {
-	std::vector<uint8_t> opt = {
+	const uint8_t opt[] = {
 		0,					// name
 		0, 41,					// type = OPT
 		static_cast<uint8_t>(buflen >> 8),	// buflen MSB
@@ -279,13 +947,260 @@ void QueryFile::edns(const uint16_t buflen, uint16_t flags)
 		0, 0					// rdlen = 0
 	};
 
-	for (auto& query: queries) {
+	list.resize(data_size + count * sizeof(opt));
+	offs.resize(count);
+	auto out = list.data();
+
+	for (size_t i = 0; i < count; ++i) {
+		Record query(data + offsets[i]);
+		size_t len = query.size() + sizeof(opt);
+
+		offs[i] = out - list.data();
+		*out++ = len >> 8;
+		*out++ = len & 0xff;
+		memcpy(out, query.data(), query.size());
 
 		// adjust ARCOUNT
-		auto* p = reinterpret_cast<uint16_t*>(query.data());
-		p[5] = htons(ntohs(p[5]) + 1);
+		uint16_t arcount = ((out[10] << 8) | out[11]) + 1;
+		out[10] = arcount >> 8;
+		out[11] = arcount & 0xff;
+
+		out += query.size();
+		memcpy(out, opt, sizeof(opt));
+		out += sizeof(opt);
+	}
+}
+
+//
+// Adds an EDNS OPT RR to every record in the QueryFile with
+// the specified UDP buffer length and flags
+//
+// the arena is rebuilt in a single pass with each record
+// followed by its new OPT RR.  if the file already had the
+// same OPT RRs applied (e.g. by dnscvt) this is a no-op.
+//
+void QueryFile::edns(const uint16_t buflen, uint16_t flags)
+{
+	if (file_flags & flag_edns) {
+		if (buflen == edns_buflen && flags == edns_flags) {
+			return;
+		}
+		throw std::runtime_error("query file already has different EDNS options");
+	}
+
+	std::vector<uint8_t> list;
+	std::vector<uint64_t> offs;
+	add_opt(data, data_size, offsets, count, buflen, flags, list, offs);
+	adopt(list, offs);
+
+	file_flags |= flag_edns;
+	edns_buflen = buflen;
+	edns_flags = flags;
+}
+
+//
+// Appends copies of another file's queries, with their weights and
+// templates (if either file has any).  the EDNS options are only
+// kept if both files have the same ones.
+//
+void QueryFile::append(const QueryFile& other)
+{
+	std::vector<uint8_t> list(data, data + data_size);
+	std::vector<uint64_t> offs(offsets, offsets + count);
+
+	list.insert(list.end(), other.data, other.data + other.data_size);
+	offs.reserve(count + other.count);
+	for (size_t i = 0; i < other.count; ++i) {
+		offs.push_back(data_size + other.offsets[i]);
+	}
+
+	std::vector<float> weights(query_weights);
+	if (!weights.empty() || !other.query_weights.empty()) {
+		weights.resize(count, 1.0f);
+		if (other.query_weights.empty()) {
+			weights.resize(count + other.count, 1.0f);
+		} else {
+			weights.insert(weights.end(), other.query_weights.cbegin(), other.query_weights.cend());
+		}
+	}
+
+	std::vector<uint32_t> span_index(template_index);
+	std::vector<Span> spans(template_spans);
+	if (!spans.empty() || !other.template_spans.empty()) {
+		span_index.resize(count + 1, spans.size());
+		span_index.pop_back();
+		for (size_t i = 0; i < other.count; ++i) {
+			span_index.push_back(spans.size() + (other.template_index.empty() ? 0 : other.template_index[i]));
+		}
+		spans.insert(spans.end(), other.template_spans.cbegin(), other.template_spans.cend());
+		span_index.push_back(spans.size());
+	}
+
+	if (count == 0) {
+		file_flags = other.file_flags;
+		edns_buflen = other.edns_buflen;
+		edns_flags = other.edns_flags;
+	} else if (edns_buflen != other.edns_buflen || edns_flags != other.edns_flags ||
+		   (file_flags & flag_edns) != (other.file_flags & flag_edns))
+	{
+		file_flags &= ~flag_edns;
+		edns_buflen = edns_flags = 0;
+	}
+
+	adopt(list, offs);
+	std::swap(query_weights, weights);
+	std::swap(template_index, span_index);
+	std::swap(template_spans, spans);
+}
+
+//
+// Adds an EDNS OPT RR to every record in a parsed chunk
+//
+void QueryFile::edns(Chunk& chunk, uint16_t buflen, uint16_t flags)
+{
+	std::vector<uint8_t> list;
+	std::vector<uint64_t> offs;
+	add_opt(chunk.arena.data(), chunk.arena.size(), chunk.index.data(), chunk.index.size(),
+		buflen, flags, list, offs);
+	std::swap(chunk.arena, list);
+	std::swap(chunk.index, offs);
+}
+
+//---------------------------------------------------------------------
+
+// writes the whole of a buffer to a file descriptor
+static void write_all(int fd, const void* buf, size_t len)
+{
+	auto p = reinterpret_cast<const uint8_t*>(buf);
+	while (len > 0) {
+		auto res = ::write(fd, p, len);
+		if (res < 0) {
+			if (errno == EINTR) continue;
+			throw_errno("writing query file");
+		}
+		p += res;
+		len -= res;
+	}
+}
+
+//
+// starts the output, which for indexed files means writing a
+// placeholder header padded out to the start of the payloads
+//
+QueryWriter::QueryWriter(int fd, bool indexed, uint32_t flags, uint16_t edns_buflen, uint16_t edns_flags)
+	: fd(fd), indexed(indexed), flags(flags),
+	  edns_buflen(edns_buflen), edns_flags(edns_flags),
+	  checksum(fnv_basis)
+{
+	if (!indexed) {
+		return;
+	}
+
+	if (::lseek(fd, 0, SEEK_CUR) < 0) {
+		throw std::runtime_error("indexed output must be seekable");
+	}
+
+	spill = ::tmpfile();
+	if (!spill) {
+		throw_errno("creating temporary index file");
+	}
+	pending.reserve(65536);
+
+	std::vector<uint8_t> pad(v2_data_align);
+	write_all(fd, pad.data(), pad.size());
+}
+
+QueryWriter::~QueryWriter()
+{
+	if (spill) {
+		::fclose(spill);
+	}
+}
+
+//
+// moves the in-memory portion of the index out to the temporary file
+//
+void QueryWriter::flush_index()
+{
+	if (!pending.empty()) {
+		if (::fwrite(pending.data(), sizeof(uint64_t), pending.size(), spill) != pending.size()) {
+			throw_errno("writing temporary index file");
+		}
+		pending.clear();
+	}
+}
+
+//
+// appends a block of queries in raw format, with their offsets
+// relative to the start of that block
+//
+void QueryWriter::write(const uint8_t* data, size_t size, const uint64_t* offsets, size_t n)
+{
+	write_all(fd, data, size);
+
+	if (indexed) {
+		checksum = fnv1a(data, size, checksum);
+		for (size_t i = 0; i < n; ++i) {
+			pending.push_back(htole64(data_size + offsets[i]));
+			if (pending.size() == pending.capacity()) {
+				flush_index();
+			}
+		}
+	}
+
+	data_size += size;
+	count += n;
+}
+
+void QueryWriter::write(const QueryFile::Chunk& chunk)
+{
+	write(chunk.arena.data(), chunk.arena.size(), chunk.index.data(), chunk.index.size());
+}
+
+//
+// completes the output.  for indexed files the index is copied
+// from the temporary file and then the header is rewritten
+//
+void QueryWriter::close()
+{
+	if (!indexed) {
+		return;
+	}
+
+	flush_index();
+
+	uint64_t data_offset = v2_data_align;
+	uint64_t index_offset = data_offset + data_size;
+	index_offset = (index_offset + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+
+	uint8_t zero[sizeof(uint64_t)] = { 0, };
+	write_all(fd, zero, index_offset - data_offset - data_size);
+
+	::rewind(spill);
+	std::vector<uint8_t> buf(1 << 20);
+	size_t len;
+	while ((len = ::fread(buf.data(), 1, buf.size(), spill)) > 0) {
+		checksum = fnv1a(buf.data(), len, checksum);
+		write_all(fd, buf.data(), len);
+	}
+	if (::ferror(spill)) {
+		throw_errno("reading temporary index file");
+	}
+
+	v2_header_t hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, v2_magic, sizeof(hdr.magic));
+	hdr.version = htole32(v2_version);
+	hdr.flags = htole32(flags);
+	hdr.count = htole64(count);
+	hdr.data_offset = htole64(data_offset);
+	hdr.data_size = htole64(data_size);
+	hdr.index_offset = htole64(index_offset);
+	hdr.checksum = htole64(checksum);
+	hdr.edns_buflen = htole16(edns_buflen);
+	hdr.edns_flags = htole16(edns_flags);
 
-		query.reserve(query.size() + 11);
-		query.insert(query.end(), opt.cbegin(), opt.cend());
+	if (::pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+		throw_errno("writing query file header");
 	}
 }
@@ -11,32 +11,192 @@
 
 #pragma once
 
+#include <cstdint>
+#include <cstdio>
 #include <string>
 #include <vector>
-#include <deque>
 
 class QueryFile {
 
 public:
-	typedef std::vector<uint8_t>	Record;
+	// lightweight view of a single query within the arena
+	class Record {
+
+	private:
+		const uint8_t*		p;		// length prefix
+
+	public:
+		explicit Record(const uint8_t* p) : p(p) {};
+
+		const uint8_t*		data() const {
+			return p + 2;
+		};
+
+		size_t			size() const {
+			return (p[0] << 8) | p[1];
+		};
+	};
+
+	// a run of bytes in a template's name that is filled in at random
+	// as each query is sent, relative to the start of its DNS message
+	typedef struct {
+		uint16_t		offset;
+		uint16_t		length;
+	} Span;
+
+	// the queries parsed from one block of a text file
+	typedef struct {
+		std::vector<uint8_t>	arena;
+		std::vector<uint64_t>	index;
+		std::vector<float>	weights;	// empty if none were given
+		std::vector<uint32_t>	span_index;	// first span of each query,
+		std::vector<Span>	spans;		// if there are any templates
+		size_t			lines = 0;
+		size_t			error_line = 0;
+		std::string		error;
+	} Chunk;
+
+	// the timing and origin of each query read from a packet capture
+	typedef struct {
+		std::vector<uint64_t>	time;		// ns since the first query
+		std::vector<uint32_t>	saddr;		// network order
+		std::vector<uint16_t>	sport;		// network order
+		size_t			truncated = 0;	// datagrams skipped
+	} Capture;
+
+	// v2 file header flags
+	enum {
+		flag_edns = 0x0001		// EDNS OPT RRs already present
+	};
+
+private:
+	// every query packed back-to-back in raw file format,
+	// i.e. <16 bit network order length><payload...>
+	std::vector<uint8_t>		arena;
+
+	// offset of each query's length prefix within the arena
+	std::vector<uint64_t>		index;
+
+	// the arena and index in use, which either point into the
+	// vectors above or into a read-only mapping of a v2 file
+	const uint8_t*			data = nullptr;
+	size_t				data_size = 0;
+	const uint64_t*			offsets = nullptr;
+	size_t				count = 0;
+
+	void*				map = nullptr;
+	size_t				map_size = 0;
+
+	// the relative weight of each query, if the file gave any
+	std::vector<float>		query_weights;
+
+	// the random spans of any templates, with the index of each
+	// query's first span (and a final entry for the total)
+	std::vector<uint32_t>		template_index;
+	std::vector<Span>		template_spans;
+
+	uint32_t			file_flags = 0;
+	uint16_t			edns_buflen = 0;
+	uint16_t			edns_flags = 0;
 
 private:
-	typedef std::deque<Record>	storage_t;
-	storage_t			queries;
+	void				adopt(std::vector<uint8_t>& list, std::vector<uint64_t>& offsets);
+	void				unmap();
+	void				map_indexed(int fd, size_t size);
+	bool				bounded() const;
+
+	static void			add_opt(const uint8_t* data, size_t data_size,
+						const uint64_t* offsets, size_t count,
+						uint16_t buflen, uint16_t flags,
+						std::vector<uint8_t>& list, std::vector<uint64_t>& offs);
 
 public:
-	void				read_txt(const std::string& filename);
+					QueryFile() = default;
+					QueryFile(const QueryFile&) = delete;
+	QueryFile&			operator=(const QueryFile&) = delete;
+					~QueryFile();
+
+public:
+	static void			parse_txt(const char* p, const char* end, Chunk& chunk, uint16_t seed,
+						  bool weighted = false);
+	static void			edns(Chunk& chunk, uint16_t buflen, uint16_t flags);
+
+	void				read_txt(const std::string& filename, bool weighted = false);
 	void				read_raw(const std::string& filename);
+	void				read_pcap(const std::string& filename, uint16_t port, Capture& capture);
 	void				write_raw(const std::string& filename) const;
+	void				write_indexed(const std::string& filename) const;
 	void				edns(const uint16_t buflen, uint16_t flags);
+	void				append(const QueryFile& other);
+	bool				verify() const;
 
 public:
 
-	const Record&			operator[](size_t n) const {
-		return queries[n % size()];
+	Record				operator[](size_t n) const {
+		return Record(data + offsets[n % size()]);
+	};
+
+	// as above, for n < size()
+	Record				record(size_t n) const {
+		return Record(data + offsets[n]);
 	};
 
 	size_t				size() const {
-		return queries.size();
+		return count;
+	};
+
+	bool				is_mapped() const {
+		return map != nullptr;
+	};
+
+	const std::vector<float>&	weights() const {
+		return query_weights;
 	};
+
+	// both empty unless some of the queries are templates
+	const std::vector<uint32_t>&	span_index() const {
+		return template_index;
+	};
+
+	const std::vector<Span>&	spans() const {
+		return template_spans;
+	};
+};
+
+//
+// writes a stream of queries to a file descriptor in either the
+// legacy raw format or the v2 indexed format
+//
+// indexed output must be seekable, since its header can only be
+// completed once every query has been written.  until then the
+// index is held in a temporary file so that memory use is constant.
+//
+class QueryWriter {
+
+private:
+	int				fd;
+	bool				indexed;
+	uint32_t			flags;
+	uint16_t			edns_buflen;
+	uint16_t			edns_flags;
+
+	uint64_t			data_size = 0;
+	uint64_t			count = 0;
+	uint64_t			checksum;
+
+	FILE*				spill = nullptr;
+	std::vector<uint64_t>		pending;
+
+private:
+	void				flush_index();
+
+public:
+					QueryWriter(int fd, bool indexed, uint32_t flags = 0,
+						    uint16_t edns_buflen = 0, uint16_t edns_flags = 0);
+					~QueryWriter();
+
+public:
+	void				write(const uint8_t* data, size_t size, const uint64_t* offsets, size_t n);
+	void				write(const QueryFile::Chunk& chunk);
+	void				close();
 };
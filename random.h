@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+//
+// a small and fast (but not cryptographic) pseudo-random number
+// generator, xoshiro256**, seeded via splitmix64 so that any seed
+// (including consecutive thread numbers) gives independent streams
+//
+class Random {
+
+private:
+	uint64_t			s[4];
+
+private:
+	static uint64_t			rotl(uint64_t x, int k) {
+		return (x << k) | (x >> (64 - k));
+	};
+
+public:
+					Random(uint64_t seed = 0) {
+		for (auto& v: s) {
+			uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+			v = z ^ (z >> 31);
+		}
+	};
+
+public:
+	uint64_t			next() {
+		uint64_t res = rotl(s[1] * 5, 7) * 9;
+		uint64_t t = s[1] << 17;
+		s[2] ^= s[0];
+		s[3] ^= s[1];
+		s[1] ^= s[2];
+		s[0] ^= s[3];
+		s[2] ^= t;
+		s[3] = rotl(s[3], 45);
+		return res;
+	};
+
+	// uniformly distributed in [0, 1)
+	double				uniform() {
+		return (next() >> 11) * (1.0 / (1ULL << 53));
+	};
+
+	// uniformly distributed in [0, n)
+	uint64_t			below(uint64_t n) {
+		return (unsigned __int128)next() * n >> 64;
+	};
+};
@@ -0,0 +1,260 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include "ratectl.h"
+
+// the loss ratio within a sample, treating late responses as no loss
+static double loss_ratio(uint64_t tx, uint64_t rx)
+{
+	if (tx == 0 || rx >= tx) {
+		return 0;
+	}
+	return double(tx - rx) / tx;
+}
+
+//---------------------------------------------------------------------
+
+uint32_t MidpointController::next(const rate_sample_t& sample)
+{
+	return 0.5 * (sample.rx_rate + sample.rx_max) + increment;
+}
+
+uint32_t RampController::next(const rate_sample_t& sample)
+{
+	return sample.rate + increment;
+}
+
+//---------------------------------------------------------------------
+
+uint32_t PidController::next(const rate_sample_t& sample)
+{
+	double weight = first ? 1.0 : 1.0 - std::exp(-sample.interval / smoothing);
+	tx += weight * (sample.tx - tx);
+	rx += weight * (sample.rx - rx);
+
+	double loss = (tx > 0 && rx < tx) ? (tx - rx) / tx : 0;
+	double error = std::max(-1.0, std::min(1.0, (target - loss) / target));
+
+	// limit the integral term's contribution to the same range
+	// as the others to prevent wind-up
+	if (ki > 0) {
+		integral = std::max(-1.0 / ki, std::min(1.0 / ki, integral + error * sample.interval));
+	}
+	double derivative = first ? 0 : (error - last_error) / sample.interval;
+	last_error = error;
+	first = false;
+
+	// but never change the rate by more than half in one go
+	double output = kp * error + ki * integral + kd * derivative;
+	output = std::max(-0.5, std::min(0.5, output));
+
+	return std::max(1.0, sample.rate * (1.0 + output));
+}
+
+//---------------------------------------------------------------------
+
+uint32_t SearchController::next(const rate_sample_t& sample)
+{
+	if (finished) {
+		return lo ? lo : sample.rate;
+	}
+
+	// start a new step, skipping its first interval
+	if (rate != sample.rate) {
+		rate = sample.rate;
+		step_start = sample.elapsed;
+		tx = rx = 0;
+		return rate;
+	}
+
+	tx += sample.tx;
+	rx += sample.rx;
+
+	if (sample.elapsed - step_start < dwell) {
+		return rate;
+	}
+
+	// judge this step
+	++steps;
+	double seconds = sample.elapsed - step_start;
+	bool achieved = (seconds <= 0) || (tx >= 0.9 * rate * seconds);
+	bool pass = achieved && (loss_ratio(tx, rx) <= threshold);
+
+	if (pass) {
+		lo = rate;
+	} else {
+		hi = rate;
+		sender_limited = sender_limited || !achieved;
+	}
+
+	uint32_t next;
+	if (hi == 0) {
+		next = rate * 2;
+	} else {
+		next = (uint64_t(lo) + hi) / 2;
+		if (hi - lo <= precision * hi || next == lo) {
+			finished = true;
+			next = lo;
+		}
+	}
+
+	return std::max(uint32_t(1), next);
+}
+
+void SearchController::report(std::ostream& os) const
+{
+	os << "Capacity = " << lo;
+	if (finished) {
+		os << " (converged after " << steps << " steps";
+	} else {
+		os << " (not converged after " << steps << " steps";
+	}
+	if (sender_limited) {
+		os << ", limited by the sender";
+	}
+	os << ")" << std::endl;
+}
+
+//---------------------------------------------------------------------
+
+uint32_t ProfileController::rate_at(double elapsed) const
+{
+	return std::lround(profile.rate(elapsed));
+}
+
+uint32_t ProfileController::next(const rate_sample_t& sample)
+{
+	double middle = sample.elapsed - sample.interval / 2;
+	if (middle < profile.duration()) {
+		auto& s = stats[profile.segment(middle)];
+		s.time += sample.interval;
+		s.target += profile.rate(middle) * sample.interval;
+		s.tx += sample.tx;
+		s.rx += sample.rx;
+	}
+
+	finished = (sample.elapsed >= profile.duration());
+
+	return rate_at(sample.elapsed);
+}
+
+void ProfileController::report(std::ostream& os) const
+{
+	using namespace std;
+	ios init(nullptr);
+	init.copyfmt(os);
+
+	os << "Segment Start End Target TX_rate RX_rate Loss% Label" << endl;
+	for (size_t n = 0; n < stats.size(); ++n) {
+		auto& s = stats[n];
+		auto& a = profile.point(n);
+		auto& b = profile.point(n + 1);
+		double loss = 100 * loss_ratio(s.tx, s.rx);
+
+		os << n << fixed << setprecision(3) << ' ' << a.time << ' ' << b.time;
+		os << setprecision(0);
+		if (s.time > 0) {
+			os << ' ' << s.target / s.time << ' ' << s.tx / s.time << ' ' << s.rx / s.time;
+		} else {
+			os << " - - -";
+		}
+		os << setprecision(2) << ' ' << loss;
+		if (!a.label.empty()) {
+			os << ' ' << a.label;
+		}
+		os << endl;
+	}
+
+	os.copyfmt(init);
+}
+
+//---------------------------------------------------------------------
+
+// splits "name:a,b,c" into the name and list of numeric parameters
+static std::string parse_spec(const std::string& spec, std::vector<double>& params)
+{
+	auto colon = spec.find(':');
+	auto name = spec.substr(0, colon);
+
+	if (colon != std::string::npos) {
+		std::istringstream is(spec.substr(colon + 1));
+		std::string item;
+		while (std::getline(is, item, ',')) {
+			char *end;
+			double v = strtod(item.c_str(), &end);
+			if (item.empty() || *end) {
+				throw std::runtime_error("invalid rate controller parameter: " + item);
+			}
+			params.push_back(v);
+		}
+	}
+
+	return name;
+}
+
+//
+// creates a rate controller from its command line specification
+//
+//   midpoint
+//   ramp
+//   pid:<loss>[,<kp>[,<ki>[,<kd>]]]
+//   search:<loss>[,<dwell>[,<precision>]]
+//   profile:<filename>
+//
+std::unique_ptr<RateController> RateController::create(const std::string& spec, uint32_t increment)
+{
+	// the only controller whose parameter isn't a list of numbers
+	if (spec.compare(0, 8, "profile:") == 0 && spec.size() > 8) {
+		return std::unique_ptr<RateController>(new ProfileController(spec.substr(8)));
+	}
+
+	std::vector<double> p;
+	auto name = parse_spec(spec, p);
+
+	auto param = [&](size_t n, double def) {
+		return (n < p.size()) ? p[n] : def;
+	};
+
+	std::unique_ptr<RateController> res;
+
+	if (name == "midpoint" && p.empty()) {
+		res.reset(new MidpointController(increment));
+	} else if (name == "ramp" && p.empty()) {
+		res.reset(new RampController(increment));
+	} else if (name == "pid" && p.size() >= 1 && p.size() <= 4) {
+		if (p[0] <= 0 || p[0] >= 1) {
+			throw std::runtime_error("PID target loss must be between 0 and 1");
+		}
+		res.reset(new PidController(p[0], param(1, 0.1), param(2, 0.05), param(3, 0)));
+	} else if (name == "search" && p.size() >= 1 && p.size() <= 3) {
+		if (p[0] < 0 || p[0] >= 1) {
+			throw std::runtime_error("search loss threshold must be between 0 and 1");
+		}
+		double dwell = param(1, 2.0);
+		double precision = param(2, 0.01);
+		if (dwell <= 0 || precision <= 0 || precision >= 1) {
+			throw std::runtime_error("invalid search dwell time or precision");
+		}
+		res.reset(new SearchController(p[0], dwell, precision));
+	} else {
+		throw std::runtime_error("invalid rate controller: " + spec);
+	}
+
+	return res;
+}
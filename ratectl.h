@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "profile.h"
+
+// the measurements taken by the rate adapter in each interval
+typedef struct {
+	double				elapsed;	// seconds since start
+	double				interval;	// seconds since last sample
+	uint32_t			rate;		// target rate during interval
+	uint64_t			tx;		// queries sent during interval
+	uint64_t			rx;		// responses received during interval
+	uint32_t			rx_rate;	// rolling average responses per second
+	uint32_t			rx_max;		// highest rx_rate so far
+} rate_sample_t;
+
+//
+// decides the target sending rate for the next interval, based on
+// the measurements from the one just finished
+//
+class RateController {
+
+public:
+	virtual				~RateController() = default;
+
+public:
+	virtual uint32_t		next(const rate_sample_t& sample) = 0;
+
+	// whether the controller has reached its answer, so that the
+	// run may finish early
+	virtual bool			done() const { return false; };
+
+	// shows any results at the end of the run
+	virtual void			report(std::ostream& os) const { };
+
+	// whether the rate follows a fixed schedule, in which case
+	// the rate adapter also sets it every millisecond in between
+	// samples to the value given by rate_at()
+	virtual bool			scheduled() const { return false; };
+	virtual uint32_t		rate_at(double elapsed) const { return 0; };
+
+public:
+	static std::unique_ptr<RateController> create(const std::string& spec, uint32_t increment);
+};
+
+//
+// the original heuristic, which sets the target rate to the mid-point
+// of the current and maximum received rates plus a fixed increment, so
+// that it seeks the rate at which the loss equals that increment
+//
+class MidpointController : public RateController {
+
+private:
+	uint32_t			increment;
+
+public:
+					MidpointController(uint32_t increment) : increment(increment) {};
+
+public:
+	uint32_t			next(const rate_sample_t& sample) override;
+};
+
+//
+// increases the target rate by a fixed increment every interval
+// without regard to the received rate
+//
+class RampController : public RateController {
+
+private:
+	uint32_t			increment;
+
+public:
+					RampController(uint32_t increment) : increment(increment) {};
+
+public:
+	uint32_t			next(const rate_sample_t& sample) override;
+};
+
+//
+// holds the loss ratio at a fixed target with a PID controller
+//
+// the error is the difference between the target loss and the loss
+// measured recently, scaled by the target so that the gains don't
+// depend on it and clamped to +/-1, and the output is applied as a
+// proportional change to the current rate.  the loss measured
+// therefore doesn't depend on the absolute rate either.
+//
+// the responses to queries sent near the end of one interval arrive
+// in the next, so rather than comparing each interval's counts the
+// loss is taken from exponentially weighted averages of them.
+//
+class PidController : public RateController {
+
+private:
+	static constexpr double		smoothing = 0.5;	// time constant, in seconds
+
+	double				target;
+	double				kp, ki, kd;
+	double				tx = 0, rx = 0;	// averaged counts
+	double				integral = 0;
+	double				last_error = 0;
+	bool				first = true;
+
+public:
+					PidController(double target, double kp, double ki, double kd)
+						: target(target), kp(kp), ki(ki), kd(kd) {};
+
+public:
+	uint32_t			next(const rate_sample_t& sample) override;
+};
+
+//
+// finds the highest rate at which the loss stays below a threshold
+//
+// each rate is held for the dwell time, ignoring the first interval
+// while the server settles, and then passes if the loss over the rest
+// of that time was below the threshold.  the rate doubles after every
+// pass until the first failure, and then the range between the best
+// pass and the lowest failure is bisected until it is narrower than
+// the requested precision, so the number of steps (and hence the time
+// taken) is bounded by the logarithms of the capacity and precision.
+//
+// a rate that the sender couldn't achieve is treated as a failure,
+// and noted in the results.
+//
+class SearchController : public RateController {
+
+private:
+	double				threshold;
+	double				dwell;
+	double				precision;
+
+	uint32_t			rate = 0;
+	uint32_t			lo = 0;		// highest passing rate
+	uint32_t			hi = 0;		// lowest failing rate, or 0
+	double				step_start = 0;
+	uint64_t			tx = 0;
+	uint64_t			rx = 0;
+	unsigned int			steps = 0;
+	bool				sender_limited = false;
+	bool				finished = false;
+
+public:
+					SearchController(double threshold, double dwell, double precision)
+						: threshold(threshold), dwell(dwell), precision(precision) {};
+
+public:
+	uint32_t			next(const rate_sample_t& sample) override;
+	bool				done() const override { return finished; };
+	void				report(std::ostream& os) const override;
+};
+
+//
+// follows a load profile, and accumulates the statistics for each of
+// its segments (over every repetition) by the segment in effect at
+// the middle of each sample
+//
+class ProfileController : public RateController {
+
+private:
+	typedef struct {
+		double			time = 0;	// seconds sampled
+		double			target = 0;	// sum of rate * time
+		uint64_t		tx = 0;
+		uint64_t		rx = 0;
+	} segment_stats_t;
+
+	LoadProfile			profile;
+	std::vector<segment_stats_t>	stats;
+	bool				finished = false;
+
+public:
+					ProfileController(const std::string& filename)
+						: profile(filename), stats(profile.segments()) {};
+
+public:
+	uint32_t			next(const rate_sample_t& sample) override;
+	bool				done() const override { return finished; };
+	void				report(std::ostream& os) const override;
+	bool				scheduled() const override { return true; };
+	uint32_t			rate_at(double elapsed) const override;
+};
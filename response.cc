@@ -0,0 +1,374 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#include <iomanip>
+#include <stdexcept>
+
+#include "response.h"
+
+static const uint16_t type_opt = 41;
+
+// the upper bounds of the response size buckets
+static const size_t size_limits[response_stats_t::size_buckets - 1] = {
+	64, 128, 256, 512, 1024, 1232, 1500, 4096
+};
+
+validate_t validate_level(const std::string& name)
+{
+	if (name == "none") {
+		return validate_none;
+	} else if (name == "header") {
+		return validate_header;
+	} else if (name == "question") {
+		return validate_question;
+	} else if (name == "full") {
+		return validate_full;
+	}
+
+	throw std::runtime_error("unknown validation level: " + name);
+}
+
+//---------------------------------------------------------------------
+
+static inline uint16_t get16(const uint8_t* p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+// steps over a domain name, returning false if it overruns the message
+static bool skip_name(const uint8_t* msg, size_t len, size_t& pos)
+{
+	size_t total = 0;
+
+	while (pos < len) {
+		uint8_t c = msg[pos];
+		if (c == 0) {
+			pos += 1;
+			return true;
+		} else if ((c & 0xc0) == 0xc0) {
+			pos += 2;
+			return pos <= len;
+		} else if (c & 0xc0) {
+			return false;		// obsolete label types
+		}
+
+		total += c + 1;
+		if (total > 255) {
+			return false;
+		}
+		pos += c + 1;
+	}
+
+	return false;
+}
+
+// steps over a resource record, noting its type
+static bool skip_rr(const uint8_t* msg, size_t len, size_t& pos, uint16_t& type)
+{
+	if (!skip_name(msg, len, pos) || len - pos < 10) {
+		return false;
+	}
+
+	type = get16(msg + pos);
+	size_t rdlen = get16(msg + pos + 8);
+	pos += 10;
+	if (len - pos < rdlen) {
+		return false;
+	}
+	pos += rdlen;
+
+	return true;
+}
+
+bool parse_response(const uint8_t* msg, size_t len, validate_t depth, dns_response_t& res)
+{
+	res.qtype = 0;
+	res.qclass = 0;
+	res.question_size = 0;
+	res.edns = false;
+
+	if (len < 12) {
+		return false;
+	}
+
+	res.id = get16(msg);
+	res.flags = get16(msg + 2);
+	res.qdcount = get16(msg + 4);
+	res.ancount = get16(msg + 6);
+	res.nscount = get16(msg + 8);
+	res.arcount = get16(msg + 10);
+
+	if (depth < validate_question) {
+		return true;
+	}
+
+	// the question (responses normally only have one)
+	size_t pos = 12;
+	for (unsigned i = 0; i < res.qdcount; ++i) {
+		size_t start = pos;
+		if (!skip_name(msg, len, pos) || len - pos < 4) {
+			return false;
+		}
+		if (i == 0) {
+			res.qtype = get16(msg + pos);
+			res.qclass = get16(msg + pos + 2);
+			res.question_size = pos + 4 - start;
+		}
+		pos += 4;
+	}
+
+	if (depth < validate_full) {
+		return true;
+	}
+
+	// every other RR, looking for the OPT RR in the additional section
+	unsigned other = res.ancount + res.nscount;
+	unsigned total = other + res.arcount;
+	for (unsigned i = 0; i < total; ++i) {
+		uint16_t type;
+		if (!skip_rr(msg, len, pos, type)) {
+			return false;
+		}
+		if (i >= other && type == type_opt) {
+			res.edns = true;
+		}
+	}
+
+	return true;
+}
+
+//---------------------------------------------------------------------
+
+void response_stats_t::record(bool valid, const dns_response_t& r, size_t len, validate_t depth)
+{
+	examined.add();
+
+	size_t bucket = 0;
+	while (bucket < size_buckets - 1 && len > size_limits[bucket]) {
+		++bucket;
+	}
+	size[bucket].add();
+
+	if (!valid) {
+		malformed.add();
+		return;
+	}
+
+	if (!(r.flags & dns_flag_qr)) not_response.add();
+	if (r.flags & dns_flag_aa) authoritative.add();
+	if (r.flags & dns_flag_tc) truncated.add();
+	if (r.edns) edns.add();
+
+	unsigned rcode = r.flags & 0x0f;
+	if (rcode == 0 && r.ancount == 0) {
+		nodata.add();
+	}
+
+	if (depth >= validate_question && r.qdcount > 0) {
+		qtype[r.qtype < qtypes ? r.qtype : 0][rcode].add();
+	}
+}
+
+//---------------------------------------------------------------------
+
+void response_snapshot_t::add(const response_stats_t& s)
+{
+	examined += s.examined.get();
+	malformed += s.malformed.get();
+	mismatched += s.mismatched.get();
+	not_response += s.not_response.get();
+	authoritative += s.authoritative.get();
+	truncated += s.truncated.get();
+	edns += s.edns.get();
+	nodata += s.nodata.get();
+
+	for (size_t i = 0; i < response_stats_t::size_buckets; ++i) {
+		size[i] += s.size[i].get();
+	}
+	for (size_t t = 0; t < response_stats_t::qtypes; ++t) {
+		for (size_t r = 0; r < 16; ++r) {
+			qtype[t][r] += s.qtype[t][r].get();
+		}
+	}
+}
+
+response_snapshot_t response_snapshot_t::operator-(const response_snapshot_t& prev) const
+{
+	response_snapshot_t res(*this);
+	res.examined -= prev.examined;
+	res.malformed -= prev.malformed;
+	res.mismatched -= prev.mismatched;
+	res.not_response -= prev.not_response;
+	res.authoritative -= prev.authoritative;
+	res.truncated -= prev.truncated;
+	res.edns -= prev.edns;
+	res.nodata -= prev.nodata;
+
+	for (size_t i = 0; i < response_stats_t::size_buckets; ++i) {
+		res.size[i] -= prev.size[i];
+	}
+	for (size_t t = 0; t < response_stats_t::qtypes; ++t) {
+		for (size_t r = 0; r < 16; ++r) {
+			res.qtype[t][r] -= prev.qtype[t][r];
+		}
+	}
+
+	return res;
+}
+
+// the mnemonics of the more common QTYPEs and RCODEs
+static std::string type_name(size_t type)
+{
+	static const struct {
+		uint16_t		type;
+		const char*		name;
+	} names[] = {
+		{ 1, "A" }, { 2, "NS" }, { 5, "CNAME" }, { 6, "SOA" },
+		{ 12, "PTR" }, { 13, "HINFO" }, { 15, "MX" }, { 16, "TXT" },
+		{ 28, "AAAA" }, { 33, "SRV" }, { 35, "NAPTR" }, { 43, "DS" },
+		{ 46, "RRSIG" }, { 47, "NSEC" }, { 48, "DNSKEY" }, { 50, "NSEC3" },
+		{ 52, "TLSA" }, { 64, "SVCB" }, { 65, "HTTPS" }, { 255, "ANY" },
+		{ 257, "CAA" }
+	};
+
+	if (type == 0) {
+		return "other";
+	}
+	for (auto& n: names) {
+		if (n.type == type) {
+			return n.name;
+		}
+	}
+	return "TYPE" + std::to_string(type);
+}
+
+static std::string rcode_name(size_t rcode)
+{
+	static const char* names[] = {
+		"NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED"
+	};
+
+	if (rcode < sizeof(names) / sizeof(names[0])) {
+		return names[rcode];
+	}
+	return "RCODE" + std::to_string(rcode);
+}
+
+void response_snapshot_t::report(std::ostream& os, validate_t depth) const
+{
+	using namespace std;
+	ios init(nullptr);
+	init.copyfmt(os);
+
+	auto percent = [&](uint64_t n) {
+		os << n << " (" << fixed << setprecision(2) << (examined ? 100.0 * n / examined : 0.0) << "%)";
+	};
+
+	os << "Responses examined: " << examined << ", malformed ";
+	percent(malformed);
+	if (depth >= validate_question) {
+		os << ", mismatched ";
+		percent(mismatched);
+	}
+	os << ", not responses ";
+	percent(not_response);
+	os << endl;
+
+	os << "Flags: AA ";
+	percent(authoritative);
+	os << ", TC ";
+	percent(truncated);
+	if (depth >= validate_full) {
+		os << ", EDNS ";
+		percent(edns);
+	}
+	os << ", NOERROR without answers ";
+	percent(nodata);
+	os << endl;
+
+	os << "Size (bytes):";
+	for (size_t i = 0; i < response_stats_t::size_buckets; ++i) {
+		if (i < response_stats_t::size_buckets - 1) {
+			os << " <=" << size_limits[i];
+		} else {
+			os << " >" << size_limits[i - 1];
+		}
+		os << ' ' << size[i];
+	}
+	os << endl;
+
+	// a table of QTYPE by RCODE, omitting any empty rows or columns
+	if (depth >= validate_question) {
+		bool used[16] = { false, };
+		for (size_t t = 0; t < response_stats_t::qtypes; ++t) {
+			for (size_t r = 0; r < 16; ++r) {
+				used[r] |= (qtype[t][r] > 0);
+			}
+		}
+
+		os << "QTYPE";
+		for (size_t r = 0; r < 16; ++r) {
+			if (used[r]) os << ' ' << rcode_name(r);
+		}
+		os << endl;
+
+		for (size_t t = 1; t <= response_stats_t::qtypes; ++t) {
+			size_t type = t % response_stats_t::qtypes;	// "other" last
+			uint64_t total = 0;
+			for (size_t r = 0; r < 16; ++r) {
+				total += qtype[type][r];
+			}
+			if (total == 0) {
+				continue;
+			}
+
+			os << type_name(type);
+			for (size_t r = 0; r < 16; ++r) {
+				if (used[r]) os << ' ' << qtype[type][r];
+			}
+			os << endl;
+		}
+	}
+
+	os.copyfmt(init);
+}
+
+//
+// shows the counts on a single line, for the interval output: the
+// number examined, the percentage truncated, the count in each size
+// bucket and (if known) each QTYPE and RCODE seen as <qtype>/<rcode>=<count>
+//
+void response_snapshot_t::summary(std::ostream& os, validate_t depth) const
+{
+	using namespace std;
+	ios init(nullptr);
+	init.copyfmt(os);
+
+	os << examined << " TC " << fixed << setprecision(2) << (examined ? 100.0 * truncated / examined : 0.0);
+	os.copyfmt(init);
+
+	os << " sizes";
+	for (size_t i = 0; i < response_stats_t::size_buckets; ++i) {
+		os << ' ' << size[i];
+	}
+
+	if (depth >= validate_question) {
+		os << " types";
+		for (size_t t = 1; t <= response_stats_t::qtypes; ++t) {
+			size_t type = t % response_stats_t::qtypes;	// "other" last
+			for (size_t r = 0; r < 16; ++r) {
+				if (qtype[type][r]) {
+					os << ' ' << type_name(type) << '/' << rcode_name(r) << '=' << qtype[type][r];
+				}
+			}
+		}
+	}
+}
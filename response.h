@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+#include "stats.h"
+
+// how much of each response is examined
+typedef enum {
+	validate_none,			// just the RCODE
+	validate_header,		// flags, section counts and size
+	validate_question,		// and the question
+	validate_full			// and every RR, looking for EDNS
+} validate_t;
+
+validate_t validate_level(const std::string& name);
+
+// the fields of a response found by parse_response()
+typedef struct {
+	uint16_t			id;
+	uint16_t			flags;
+	uint16_t			qdcount;
+	uint16_t			ancount;
+	uint16_t			nscount;
+	uint16_t			arcount;
+	uint16_t			qtype;
+	uint16_t			qclass;
+	size_t				question_size;	// of the first question
+	bool				edns;
+} dns_response_t;
+
+static const uint16_t dns_flag_qr = 0x8000;
+static const uint16_t dns_flag_aa = 0x0400;
+static const uint16_t dns_flag_tc = 0x0200;
+
+//
+// examines a DNS message to the given depth, never reading beyond
+// its end, and returns false if it's malformed.  compression pointers
+// are skipped rather than followed, so the cost is linear in the size
+// of the message.
+//
+bool parse_response(const uint8_t* msg, size_t len, validate_t depth, dns_response_t& res);
+
+//
+// per-thread counts of the responses examined, each thread's being
+// allocated separately (they're too large to keep with its other data)
+//
+// the QTYPE x RCODE counters cover types 1 - 511 (which includes all
+// the commonly used ones), with any others counted as type 0
+//
+typedef struct response_stats {
+	static const size_t		size_buckets = 9;
+	static const size_t		qtypes = 512;
+
+	Counter				examined;
+	Counter				malformed;
+	Counter				mismatched;	// question differs from the query
+	Counter				not_response;	// QR bit clear
+	Counter				authoritative;
+	Counter				truncated;
+	Counter				edns;
+	Counter				nodata;		// NOERROR with no answers
+	Counter				size[size_buckets];
+	Counter				qtype[qtypes][16];
+
+	void				record(bool valid, const dns_response_t& r, size_t len, validate_t depth);
+} response_stats_t;
+
+//
+// the (sum of some threads') response statistics at some point
+//
+typedef struct response_snapshot {
+	uint64_t			examined = 0;
+	uint64_t			malformed = 0;
+	uint64_t			mismatched = 0;
+	uint64_t			not_response = 0;
+	uint64_t			authoritative = 0;
+	uint64_t			truncated = 0;
+	uint64_t			edns = 0;
+	uint64_t			nodata = 0;
+	uint64_t			size[response_stats_t::size_buckets] = { 0, };
+	uint64_t			qtype[response_stats_t::qtypes][16] = { { 0, }, };
+
+	void				add(const response_stats_t& s);
+	void				report(std::ostream& os, validate_t depth) const;
+	void				summary(std::ostream& os, validate_t depth) const;
+
+	response_snapshot		operator-(const response_snapshot& prev) const;
+} response_snapshot_t;
@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <stdexcept>
+
+#include "selection.h"
+
+//
+// builds the alias table for the queries, either from their weights in
+// the query file or, for Zipf, from their ranks, and then scaled so
+// that each group has its share of the total
+//
+void QuerySelection::prepare(const std::vector<group_t>& groups, const std::vector<float>& weights)
+{
+	size_t count = 0;
+	for (auto& group: groups) {
+		count += group.count;
+	}
+
+	if (count == 0) {
+		throw std::runtime_error("no queries to select from");
+	}
+	if (count > std::numeric_limits<uint32_t>::max()) {
+		throw std::runtime_error("too many queries to select from");
+	}
+	this->count = count;
+
+	if (method == select_shuffle) {
+		if (groups.size() > 1) {
+			throw std::runtime_error("a mix of queries can't be shuffled");
+		}
+		return;
+	}
+	if (method == select_weighted && weights.size() != count) {
+		throw std::runtime_error("query file has no weights");
+	}
+
+	std::vector<double> p(count);
+	double total = 0;
+
+	for (size_t g = 0, first = 0; g < groups.size(); first += groups[g++].count) {
+		double sum = 0;
+		for (size_t i = 0; i < groups[g].count; ++i) {
+			auto& v = p[first + i];
+			switch (method) {
+				case select_zipf: v = std::pow(i + 1.0, -exponent); break;
+				case select_weighted: v = weights[first + i]; break;
+				default: v = 1.0; break;
+			}
+			sum += v;
+		}
+		if (!(sum > 0) || !std::isfinite(sum) || !(groups[g].ratio > 0)) {
+			throw std::runtime_error("query weights must have a positive total");
+		}
+		for (size_t i = 0; i < groups[g].count; ++i) {
+			p[first + i] *= groups[g].ratio / sum;
+		}
+		total += groups[g].ratio;
+	}
+
+	// scale to a mean of 1, and then pair each column that's short
+	// of 1 with one that has a surplus to make up the difference
+	std::vector<uint32_t> small, large;
+	for (size_t i = 0; i < count; ++i) {
+		p[i] *= count / total;
+		(p[i] < 1.0 ? small : large).push_back(i);
+	}
+
+	prob.assign(count, 1.0f);
+	alias.resize(count);
+	for (size_t i = 0; i < count; ++i) {
+		alias[i] = i;
+	}
+
+	while (!small.empty() && !large.empty()) {
+		auto s = small.back();
+		auto l = large.back();
+		small.pop_back();
+
+		prob[s] = p[s];
+		alias[s] = l;
+
+		p[l] -= 1.0 - p[s];
+		if (p[l] < 1.0) {
+			large.pop_back();
+			small.push_back(l);
+		}
+	}
+
+	// anything left over is (to within rounding error) exactly 1
+}
+
+uint32_t QuerySelection::sample(Random& rng) const
+{
+	uint32_t i = rng.below(count);
+	return (rng.uniform() < prob[i]) ? i : alias[i];
+}
+
+//---------------------------------------------------------------------
+
+//
+// a shuffled table holds every `threads`'th query from `thread`,
+// while a thread with no share of its own (because there are fewer
+// queries than threads) just repeats one of them
+//
+QuerySchedule::QuerySchedule(const QuerySelection& selection, size_t thread, size_t threads)
+	: selection(selection), rng(selection.base_seed() + thread), shuffle(selection.shuffled())
+{
+	size_t count = selection.size();
+
+	if (shuffle) {
+		for (size_t i = thread; i < count; i += threads) {
+			table.push_back(i);
+		}
+		if (table.empty()) {
+			table.push_back(thread % count);
+		}
+	} else {
+		table.resize(default_size);
+	}
+
+	restart();
+}
+
+//
+// starts the next pass through the table, reshuffling or refilling
+// it, which happens once per cycle and so is kept off the inlined
+// send path
+//
+void QuerySchedule::restart()
+{
+	if (shuffle) {
+		for (size_t i = table.size() - 1; i > 0; --i) {
+			std::swap(table[i], table[rng.below(i + 1)]);
+		}
+	} else {
+		for (auto& v: table) {
+			v = selection.sample(rng);
+		}
+	}
+	pos = 0;
+}
+
+//---------------------------------------------------------------------
+
+//
+// parses a query selection from its command line specification,
+// or returns null to send the queries in order
+//
+//   sequential
+//   uniform
+//   zipf:<exponent>
+//   weighted
+//   shuffle[:<seed>]
+//
+std::unique_ptr<QuerySelection> QuerySelection::create(const std::string& spec)
+{
+	auto colon = spec.find(':');
+	auto name = spec.substr(0, colon);
+	auto args = (colon == std::string::npos) ? std::string() : spec.substr(colon + 1);
+
+	std::unique_ptr<QuerySelection> res;
+	char *end;
+
+	if (name == "sequential" && args.empty()) {
+		// nothing to do
+	} else if (name == "uniform" && args.empty()) {
+		res.reset(new QuerySelection(select_uniform, 0, 0));
+	} else if (name == "zipf" && !args.empty()) {
+		double s = strtod(args.c_str(), &end);
+		if (*end || !(s > 0) || !std::isfinite(s)) {
+			throw std::runtime_error("Zipf exponent must be more than 0");
+		}
+		res.reset(new QuerySelection(select_zipf, s, 0));
+	} else if (name == "weighted" && args.empty()) {
+		res.reset(new QuerySelection(select_weighted, 0, 0));
+	} else if (name == "shuffle" && colon == std::string::npos) {
+		res.reset(new QuerySelection(select_shuffle, 0, 0));
+	} else if (name == "shuffle" && !args.empty()) {
+		uint64_t seed = strtoull(args.c_str(), &end, 10);
+		if (*end) {
+			throw std::runtime_error("invalid shuffle seed: " + args);
+		}
+		res.reset(new QuerySelection(select_shuffle, 0, seed));
+	} else {
+		throw std::runtime_error("invalid query selection: " + spec);
+	}
+
+	return res;
+}
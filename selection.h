@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "random.h"
+
+//
+// a way of choosing which query to send next, other than taking
+// each thread's share of the query file in order
+//
+// queries are chosen either at random from a discrete distribution,
+// using Vose's alias method, or by shuffling each thread's share of
+// the queries anew for each pass through them
+//
+// the queries may also be divided into consecutive groups, such as
+// the workloads of a mix, each of which is chosen in a fixed ratio
+// and then has its queries chosen as above
+//
+class QuerySelection {
+
+public:
+	typedef enum {
+		select_uniform,			// all equally likely
+		select_zipf,			// by rank in the file
+		select_weighted,		// by weight in the file
+		select_shuffle			// each query once per pass
+	} method_t;
+
+	typedef struct {
+		size_t			count;		// of consecutive queries
+		double			ratio;
+	} group_t;
+
+private:
+	method_t			method;
+	double				exponent;
+	uint64_t			seed;
+	size_t				count = 0;
+
+	// the alias table, whose column i is chosen with probability
+	// prob[i], and otherwise gives alias[i]
+	std::vector<float>		prob;
+	std::vector<uint32_t>		alias;
+
+public:
+					QuerySelection(method_t method, double exponent, uint64_t seed)
+						: method(method), exponent(exponent), seed(seed) {};
+
+public:
+	void				prepare(const std::vector<group_t>& groups, const std::vector<float>& weights);
+	void				prepare(size_t count, const std::vector<float>& weights) {
+		prepare({ group_t { count, 1.0 } }, weights);
+	};
+	uint32_t			sample(Random& rng) const;
+
+	bool				shuffled() const { return method == select_shuffle; };
+	size_t				size() const { return count; };
+	uint64_t			base_seed() const { return seed; };
+
+public:
+	static std::unique_ptr<QuerySelection> create(const std::string& spec);
+};
+
+//
+// a per-thread table of query numbers precomputed from a selection,
+// so that choosing them costs nothing on the send path
+//
+// a table of random choices is refilled with fresh ones each time
+// round, so that the sequence never repeats, whereas a shuffled table
+// holds the thread's share of the queries and is shuffled again at
+// the end of each pass.  either way only restart() does any work.
+//
+class QuerySchedule {
+
+private:
+	static const size_t		default_size = 1 << 16;
+
+	const QuerySelection&		selection;
+	std::vector<uint32_t>		table;
+	Random				rng;
+	size_t				pos = 0;
+	bool				shuffle;
+
+private:
+	void				restart();
+
+public:
+					QuerySchedule(const QuerySelection& selection,
+						      size_t thread, size_t threads);
+
+public:
+	size_t				next() {
+		if (pos == table.size()) {
+			restart();
+		}
+		return table[pos++];
+	};
+};
@@ -0,0 +1,308 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+
+#include "sources.h"
+
+// the RSS key from Microsoft's specification, used by many NICs
+static const uint8_t default_key[] = {
+	0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+	0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+	0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+	0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+	0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa
+};
+
+//
+// the Toeplitz hash of `len` bytes of input, which needs a key of
+// at least len + 4 bytes
+//
+static uint32_t toeplitz(const uint8_t* key, const uint8_t* data, size_t len)
+{
+	uint32_t hash = 0;
+	uint32_t window = (key[0] << 24) | (key[1] << 16) | (key[2] << 8) | key[3];
+
+	for (size_t i = 0; i < len; ++i) {
+		for (int bit = 7; bit >= 0; --bit) {
+			if (data[i] & (1 << bit)) {
+				hash ^= window;
+			}
+			window = (window << 1) | ((key[i + 4] >> bit) & 1);
+		}
+	}
+
+	return hash;
+}
+
+SourceSpace::SourceSpace()
+	: key(default_key, default_key + sizeof(default_key))
+{
+	memset(&base, 0, sizeof(base));
+}
+
+// the last 32 bits of the given address, in network order
+uint32_t SourceSpace::low(size_t index) const
+{
+	uint32_t addr;
+	memcpy(&addr, &base.s6_addr[12], sizeof(addr));
+	return htonl(ntohl(addr) + index);
+}
+
+//
+// sets the source addresses, from a single address, a CIDR prefix
+// (excluding the network and broadcast addresses of an IPv4 prefix
+// shorter than /31) or an inclusive first-last range, or if null,
+// the unspecified address so that the kernel picks one
+//
+void SourceSpace::set_addresses(const char* spec, bool ipv6)
+{
+	this->ipv6 = ipv6;
+	memset(&base, 0, sizeof(base));
+	count = 1;
+
+	if (!spec) {
+		return;
+	}
+
+	const int family = ipv6 ? AF_INET6 : AF_INET;
+	const size_t bits = ipv6 ? 128 : 32;
+	auto parse = [&](const std::string& s, in6_addr& addr) {
+		memset(&addr, 0, sizeof(addr));
+		void *dst = ipv6 ? &addr.s6_addr[0] : &addr.s6_addr[12];
+		if (inet_pton(family, s.c_str(), dst) != 1) {
+			throw std::runtime_error("invalid source address: " + s);
+		}
+	};
+	auto low32 = [](const in6_addr& addr) {
+		uint32_t v;
+		memcpy(&v, &addr.s6_addr[12], sizeof(v));
+		return ntohl(v);
+	};
+
+	std::string s(spec);
+	auto slash = s.find('/');
+	auto dash = s.find('-');
+
+	if (slash != std::string::npos) {
+		parse(s.substr(0, slash), base);
+		char *end;
+		auto len = strtoul(s.c_str() + slash + 1, &end, 10);
+		if (*end || len > bits || bits - len > 16) {
+			throw std::runtime_error("source prefix must be at most 65536 addresses");
+		}
+
+		uint32_t mask = (len == bits) ? 0xffffffff : ~((1U << (bits - len)) - 1);
+		uint32_t first = low32(base) & mask;
+		count = size_t(1) << (bits - len);
+		if (!ipv6 && len < 31) {
+			first += 1;
+			count -= 2;
+		}
+		first = htonl(first);
+		memcpy(&base.s6_addr[12], &first, sizeof(first));
+	} else if (dash != std::string::npos) {
+		in6_addr last;
+		parse(s.substr(0, dash), base);
+		parse(s.substr(dash + 1), last);
+		if (memcmp(&base, &last, 12) != 0 || low32(last) < low32(base) ||
+		    low32(last) - low32(base) >= max_addresses)
+		{
+			throw std::runtime_error("source range must be at most 65536 addresses");
+		}
+		count = low32(last) - low32(base) + 1;
+	} else {
+		parse(s, base);
+	}
+}
+
+// sets the range of source ports, as <first>-<last>
+void SourceSpace::set_ports(const std::string& spec)
+{
+	char *end;
+	auto first = strtoul(spec.c_str(), &end, 10);
+	auto last = (*end == '-') ? strtoul(end + 1, &end, 10) : first;
+
+	if (*end || first < 1 || last > 65535 || last < first) {
+		throw std::runtime_error("invalid source port range: " + spec);
+	}
+
+	first_port = first;
+	last_port = last;
+}
+
+// sets the server's RSS key, as colon separated hex bytes
+void SourceSpace::set_key(const std::string& spec)
+{
+	std::vector<uint8_t> bytes;
+	const char *p = spec.c_str();
+
+	while (*p) {
+		char *end;
+		auto byte = strtoul(p, &end, 16);
+		if (end == p || end - p > 2 || (*end && *end != ':')) {
+			throw std::runtime_error("invalid RSS key");
+		}
+		bytes.push_back(byte);
+		p = *end ? end + 1 : end;
+	}
+
+	// enough for an IPv6 4-tuple
+	if (bytes.size() < 40) {
+		throw std::runtime_error("RSS key must be at least 40 bytes");
+	}
+
+	key = bytes;
+}
+
+//
+// divides the ports between the workloads and then the threads, giving
+// each thread an equal share of each workload's range that keeps it
+// within the limits on ports and flows
+//
+void SourceSpace::partition(size_t threads, size_t workloads)
+{
+	this->threads = threads;
+	this->workloads = workloads;
+
+	size_t range = last_port - first_port + 1;
+	ports = std::min(range / (threads * workloads),
+			 std::min(max_ports / workloads, max_flows / (count * workloads)));
+	if (ports == 0) {
+		throw std::runtime_error("too few source ports for the number of threads");
+	}
+}
+
+// gets one of the source addresses, with a zero port
+void SourceSpace::address(size_t index, sockaddr_storage& addr, socklen_t& len) const
+{
+	memset(&addr, 0, sizeof(addr));
+
+	uint32_t last = low(index);
+	if (ipv6) {
+		auto& sin6 = reinterpret_cast<sockaddr_in6&>(addr);
+		sin6.sin6_family = AF_INET6;
+		sin6.sin6_addr = base;
+		memcpy(&sin6.sin6_addr.s6_addr[12], &last, sizeof(last));
+		len = sizeof(sin6);
+	} else {
+		auto& sin = reinterpret_cast<sockaddr_in&>(addr);
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = last;
+		len = sizeof(sin);
+	}
+}
+
+// gets one of the source addresses as text
+std::string SourceSpace::name(size_t index) const
+{
+	sockaddr_storage addr;
+	socklen_t len;
+	address(index, addr, len);
+
+	char buf[INET6_ADDRSTRLEN];
+	if (ipv6) {
+		inet_ntop(AF_INET6, &reinterpret_cast<sockaddr_in6&>(addr).sin6_addr, buf, sizeof(buf));
+	} else {
+		inet_ntop(AF_INET, &reinterpret_cast<sockaddr_in&>(addr).sin_addr, buf, sizeof(buf));
+	}
+
+	return buf;
+}
+
+//
+// gets the order in which a thread uses its flows for a workload,
+// which takes one from each RSS bucket in turn, given the server's
+// address (4 or 16 bytes in network order) and port
+//
+std::vector<SourceSpace::flow_t> SourceSpace::rotation(size_t thread, size_t workload,
+						       const void* server, uint16_t server_port) const
+{
+	// the hash input is the source and destination addresses followed
+	// by the source and destination ports
+	const size_t alen = ipv6 ? 16 : 4;
+	uint8_t input[2 * 16 + 4];
+	memcpy(input, ipv6 ? &base.s6_addr[0] : &base.s6_addr[12], alen);
+	memcpy(input + alen, server, alen);
+	uint16_t dport = htons(server_port);
+	memcpy(input + 2 * alen + 2, &dport, sizeof(dport));
+
+	std::vector<std::vector<flow_t>> buckets(rss_buckets);
+	uint16_t port_base = first_port + (workload * threads + thread) * ports;
+	size_t offset_base = workload * count * ports;
+
+	// each bucket takes every address in turn
+	for (size_t p = 0; p < ports; ++p) {
+		uint16_t sport = htons(port_base + p);
+		memcpy(input + 2 * alen, &sport, sizeof(sport));
+		for (size_t a = 0; a < count; ++a) {
+			uint32_t addr = low(a);
+			memcpy(input + alen - 4, &addr, sizeof(addr));
+			auto hash = toeplitz(key.data(), input, 2 * alen + 4);
+			flow_t flow = { addr, uint16_t(port_base + p), uint16_t(a),
+					uint16_t(offset_base + a * ports + p), uint16_t(workload) };
+			buckets[hash % rss_buckets].push_back(flow);
+		}
+	}
+
+	std::vector<flow_t> res;
+	res.reserve(count * ports);
+	for (size_t i = 0; res.size() < count * ports; ++i) {
+		for (auto& bucket: buckets) {
+			if (i < bucket.size()) {
+				res.push_back(bucket[i]);
+			}
+		}
+	}
+
+	return res;
+}
+
+//
+// finds the thread and flow that a response was sent to, given its
+// destination address (4 or 16 bytes in network order) and port
+//
+bool SourceSpace::find(const void* addr, uint16_t port, size_t& thread, uint16_t& offset) const
+{
+	if (port < first_port) {
+		return false;
+	}
+	size_t share = (port - first_port) / ports;
+	size_t workload = share / threads;
+	if (workload >= workloads) {
+		return false;
+	}
+	thread = share % threads;
+
+	auto bytes = reinterpret_cast<const uint8_t*>(addr);
+	if (ipv6) {
+		if (memcmp(bytes, &base, 12) != 0) {
+			return false;
+		}
+		bytes += 12;
+	}
+
+	uint32_t last;
+	memcpy(&last, bytes, sizeof(last));
+	size_t index = ntohl(last) - ntohl(low(0));
+	if (index >= count) {
+		return false;
+	}
+
+	offset = (workload * count + index) * ports + (port - first_port) % ports;
+
+	return true;
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+//
+// the source addresses and ports from which queries are sent, and
+// how they're shared out between the sending threads
+//
+// the addresses are a contiguous range (given as a single address, a
+// CIDR prefix or a first-last pair) of at most 65536, which for IPv6
+// may only differ in their last 32 bits.  the port range is divided
+// into an equal share for each thread of at most 4096 ports, and each
+// thread sends from every address with each of its ports, so that a
+// response's destination port alone identifies the thread that sent
+// its query.  each of a thread's (address, port) pairs is a "flow",
+// numbered address * ports + port offset, and each thread has at most
+// 65536 of them.
+//
+// with a mix of several workloads the port range is first divided
+// into a contiguous range for each workload, and each of those is
+// then shared out between the threads as above, so that the port
+// alone also identifies the workload.  a thread's flows are then
+// numbered by workload first, and each workload has its own rotation.
+//
+// each thread uses its flows in a strict rotation, ordered so that
+// consecutive queries spread across the server's receive queues.  the
+// server's NIC picks the queue from the low 7 bits of the Toeplitz
+// hash of each packet's addresses and ports, via an indirection table
+// of 128 entries which by default assigns them to the queues in turn,
+// so the rotation takes one flow from each of those 128 buckets in
+// turn.  that needs the server's RSS key (as shown by `ethtool -x`),
+// which defaults to the well-known one from Microsoft's specification.
+//
+class SourceSpace {
+
+public:
+	static const size_t		max_addresses = 65536;
+	static const size_t		max_ports = 4096;	// per thread
+	static const size_t		max_flows = 65536;	// per thread
+	static const size_t		rss_buckets = 128;
+
+	typedef struct {
+		uint32_t		addr;		// last 32 bits of the address, network order
+		uint16_t		port;		// host order
+		uint16_t		address;	// index of the address
+		uint16_t		offset;		// number of the flow within its thread
+		uint16_t		workload;
+	} flow_t;
+
+private:
+	bool				ipv6 = false;
+	in6_addr			base;		// IPv4 in the last 4 bytes
+	size_t				count = 1;
+	uint16_t			first_port = 16384;
+	uint16_t			last_port = 65535;
+	size_t				threads = 1;
+	size_t				workloads = 1;
+	size_t				ports = 0;	// per thread and workload
+	std::vector<uint8_t>		key;
+
+private:
+	uint32_t			low(size_t index) const;
+
+public:
+					SourceSpace();
+
+public:
+	void				set_addresses(const char* spec, bool ipv6);
+	void				set_ports(const std::string& spec);
+	void				set_key(const std::string& spec);
+	void				partition(size_t threads, size_t workloads = 1);
+
+	size_t				addresses() const { return count; };
+	size_t				flows() const { return workloads * count * ports; };
+	void				address(size_t index, sockaddr_storage& addr, socklen_t& len) const;
+	std::string			name(size_t index) const;
+
+	std::vector<flow_t>		rotation(size_t thread, size_t workload,
+						 const void* server, uint16_t server_port) const;
+	bool				find(const void* addr, uint16_t port, size_t& thread, uint16_t& offset) const;
+	size_t				address_of(uint16_t offset) const { return (offset / ports) % count; };
+	size_t				workload_of(uint16_t offset) const { return offset / (count * ports); };
+};
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+//
+// a 64-bit counter that is only ever written by the thread that owns
+// it, but which other threads may read at any time
+//
+// since there's only one writer an increment is a relaxed load and
+// store rather than a locked read-modify-write, so it costs no more
+// than a plain integer would, and counters are never reset so that
+// readers can't lose any counts.  readers instead subtract an earlier
+// snapshot to find the change over an interval.
+//
+class Counter {
+
+private:
+	std::atomic<uint64_t>		value;
+
+public:
+					Counter() : value(0) {};
+
+public:
+	void				add(uint64_t n = 1) {
+		value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	};
+
+	uint64_t			get() const {
+		return value.load(std::memory_order_relaxed);
+	};
+};
+
+// statistics written by a sending thread, on their own cache line
+typedef struct alignas(64) {
+	Counter				packets;
+	Counter				bytes;
+} tx_stats_t;
+
+// statistics written by a receiving thread, on their own cache lines
+typedef struct alignas(64) {
+	Counter				packets;
+	Counter				bytes;
+	Counter				drops;		// by the kernel or NIC
+	Counter				rcode[16];
+} rx_stats_t;
+
+//
+// a point in time copy of (the sum of) some threads' statistics
+//
+typedef struct stats_snapshot {
+	uint64_t			tx_packets = 0;
+	uint64_t			tx_bytes = 0;
+	uint64_t			rx_packets = 0;
+	uint64_t			rx_bytes = 0;
+	uint64_t			rx_drops = 0;
+	uint64_t			rx_rcode[16] = { 0, };
+
+	void				add(const tx_stats_t& tx) {
+		tx_packets += tx.packets.get();
+		tx_bytes += tx.bytes.get();
+	};
+
+	void				add(const rx_stats_t& rx) {
+		rx_packets += rx.packets.get();
+		rx_bytes += rx.bytes.get();
+		rx_drops += rx.drops.get();
+		for (int r = 0; r < 16; ++r) {
+			rx_rcode[r] += rx.rcode[r].get();
+		}
+	};
+
+	stats_snapshot			operator-(const stats_snapshot& prev) const {
+		stats_snapshot res(*this);
+		res.tx_packets -= prev.tx_packets;
+		res.tx_bytes -= prev.tx_bytes;
+		res.rx_packets -= prev.rx_packets;
+		res.rx_bytes -= prev.rx_bytes;
+		res.rx_drops -= prev.rx_drops;
+		for (int r = 0; r < 16; ++r) {
+			res.rx_rcode[r] -= prev.rx_rcode[r];
+		}
+		return res;
+	};
+} stats_snapshot_t;
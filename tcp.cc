@@ -0,0 +1,364 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#include <algorithm>
+#include <climits>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+
+#include "tcp.h"
+#include "util.h"
+
+// how long a connection may wait for a response before it's replaced
+static const uint64_t response_timeout = 1000000000;	// ns
+
+static uint64_t coarse_ns()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+TcpClient::TcpClient(const config_t& config)
+	: config(config), conns(config.connections), buffer(1 << 17)
+{
+	epfd = epoll_create1(0);
+	if (epfd < 0) {
+		throw_errno("epoll_create1");
+	}
+
+	for (auto& conn: conns) {
+		open(conn);
+	}
+}
+
+TcpClient::~TcpClient()
+{
+	close_all();
+	if (epfd >= 0) {
+		::close(epfd);
+	}
+}
+
+//
+// starts a non-blocking connection to the server
+//
+void TcpClient::open(conn_t& conn)
+{
+	int family = config.server.ss_family;
+	conn.fd = ::socket(family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (conn.fd < 0) {
+		throw_errno("socket(SOCK_STREAM)");
+	}
+
+	// queries are already batched, so send each batch immediately,
+	// and don't allocate a port until connect() when binding
+	int one = 1;
+	::setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	::setsockopt(conn.fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+
+	// each new connection comes from the next source address
+	if (config.source_count) {
+		auto& source = config.sources[next_source++ % config.source_count];
+		if (::bind(conn.fd, reinterpret_cast<const sockaddr*>(&source), config.source_len) < 0) {
+			throw_errno("bind(SOCK_STREAM)");
+		}
+	}
+
+	conn.connected = false;
+	conn.sent = 0;
+	conn.received = 0;
+	conn.active = coarse_ns();
+	conn.pending.clear();
+	conn.partial.clear();
+
+	epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT;
+	ev.data.ptr = &conn;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn.fd, &ev) < 0) {
+		throw_errno("epoll_ctl");
+	}
+
+	if (::connect(conn.fd, reinterpret_cast<sockaddr*>(&config.server), config.server_len) < 0 && errno != EINPROGRESS) {
+		failed.add();
+		close(conn, false);
+	}
+}
+
+//
+// closes a connection with a reset, optionally counting any
+// queries that haven't been answered as lost
+//
+void TcpClient::close(conn_t& conn, bool count)
+{
+	if (conn.fd < 0) {
+		return;
+	}
+
+	if (count && conn.sent > conn.received) {
+		lost.add(conn.sent - conn.received);
+	}
+
+	linger lg = { 1, 0 };
+	::setsockopt(conn.fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+	::close(conn.fd);		// also removes it from the epoll set
+	conn.fd = -1;
+	conn.connected = false;
+}
+
+void TcpClient::close_all()
+{
+	for (auto& conn: conns) {
+		close(conn, false);
+	}
+}
+
+// asks to be told when the connection is writable, or stops asking
+void TcpClient::watch(conn_t& conn, bool writing)
+{
+	epoll_event ev;
+	ev.events = EPOLLIN | (writing ? EPOLLOUT : 0);
+	ev.data.ptr = &conn;
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, conn.fd, &ev) < 0) {
+		throw_errno("epoll_ctl");
+	}
+}
+
+//
+// writes as many of the connection's pending queries as possible,
+// returning false if the connection failed
+//
+bool TcpClient::flush(conn_t& conn)
+{
+	auto& iov = conn.pending;
+	size_t done = 0;
+
+	while (done < iov.size()) {
+		int count = std::min(iov.size() - done, size_t(IOV_MAX));
+		ssize_t res = ::writev(conn.fd, &iov[done], count);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				break;
+			}
+			return false;
+		}
+
+		// skip over the iovecs written, and adjust any partly written
+		while (res > 0 && done < iov.size()) {
+			if (size_t(res) >= iov[done].iov_len) {
+				res -= iov[done].iov_len;
+				++done;
+			} else {
+				iov[done].iov_base = static_cast<uint8_t*>(iov[done].iov_base) + res;
+				iov[done].iov_len -= res;
+				res = 0;
+			}
+		}
+	}
+
+	bool was_waiting = !iov.empty();
+	iov.erase(iov.begin(), iov.begin() + done);
+	if (iov.empty() == was_waiting) {
+		watch(conn, !iov.empty());
+	}
+
+	return true;
+}
+
+//
+// sends up to `n` queries, taken from the callback, across the
+// connections that have room for them, and returns how many were sent
+//
+size_t TcpClient::send(size_t n, query_callback_t cb, void *userdata)
+{
+	size_t total = 0;
+
+	for (size_t i = 0; i < conns.size() && total < n; ++i) {
+		auto& conn = conns[cursor];
+		cursor = (cursor + 1) % conns.size();
+
+		if (!conn.connected || !conn.pending.empty()) {
+			continue;
+		}
+
+		// the number of queries this connection can take
+		size_t room = config.depth - std::min(config.depth, conn.sent - conn.received);
+		if (config.reuse) {
+			room = std::min(room, config.reuse - conn.sent);
+		}
+		room = std::min(room, n - total);
+		if (room == 0) {
+			continue;
+		}
+
+		for (size_t j = 0; j < room; ++j) {
+			auto query = cb(userdata);
+			conn.pending.push_back(iovec {
+				const_cast<uint8_t*>(query.data() - 2), query.size() + 2
+			});
+		}
+		if (conn.sent == conn.received) {
+			conn.active = coarse_ns();
+		}
+		conn.sent += room;
+		total += room;
+
+		if (!flush(conn)) {
+			dropped.add();
+			close(conn, true);
+			open(conn);
+		}
+	}
+
+	return total;
+}
+
+//
+// reads all the available data from a connection, passing every
+// complete response to the callback
+//
+void TcpClient::readable(conn_t& conn, response_callback_t cb, void *userdata)
+{
+	while (true) {
+
+		// anything left over from last time goes first
+		size_t have = conn.partial.size();
+		if (have) {
+			memcpy(buffer.data(), conn.partial.data(), have);
+			conn.partial.clear();
+		}
+
+		ssize_t res = ::read(conn.fd, buffer.data() + have, buffer.size() - have);
+		if (res < 0 && errno == EINTR) {
+			conn.partial.assign(buffer.data(), buffer.data() + have);
+			continue;
+		}
+		if (res < 0 && errno == EAGAIN) {
+			conn.partial.assign(buffer.data(), buffer.data() + have);
+			return;
+		}
+		if (res <= 0) {
+			dropped.add();
+			close(conn, true);
+			open(conn);
+			return;
+		}
+
+		// split the stream into length-prefixed messages
+		auto p = buffer.data();
+		auto end = p + have + res;
+		while (end - p >= 2) {
+			size_t len = (p[0] << 8) | p[1];
+			if (end - p < ptrdiff_t(len + 2)) {
+				break;
+			}
+			cb(p + 2, len, userdata);
+			conn.received += 1;
+			p += len + 2;
+		}
+		conn.partial.assign(p, end);
+		conn.active = coarse_ns();
+
+		// replace the connection once it's been used up
+		if (config.reuse && conn.received >= config.reuse) {
+			close(conn, false);
+			open(conn);
+			return;
+		}
+
+		if (size_t(res) < buffer.size() - have) {
+			return;
+		}
+	}
+}
+
+// replaces any connections that are waiting too long for a response
+void TcpClient::check_timeouts(uint64_t now)
+{
+	for (auto& conn: conns) {
+		if (conn.fd < 0) {
+			open(conn);
+		} else if ((conn.sent > conn.received || !conn.connected) && now - conn.active > response_timeout) {
+			if (!conn.connected) {
+				failed.add();
+			}
+			close(conn, true);
+			open(conn);
+		}
+	}
+}
+
+//
+// waits up to `timeout` ms for any connections to complete or to
+// become readable or writable, and handles them
+//
+void TcpClient::poll(int timeout, response_callback_t cb, void *userdata)
+{
+	epoll_event events[64];
+
+	int n = epoll_wait(epfd, events, 64, timeout);
+	if (n < 0) {
+		if (errno == EINTR) {
+			return;
+		}
+		throw_errno("epoll_wait");
+	}
+
+	for (int i = 0; i < n; ++i) {
+		auto& conn = *reinterpret_cast<conn_t*>(events[i].data.ptr);
+		auto ev = events[i].events;
+		if (conn.fd < 0) {
+			continue;
+		}
+
+		// a new connection is writable once it has completed
+		if (!conn.connected && (ev & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+			int err = 0;
+			socklen_t len = sizeof(err);
+			::getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+			if (err) {
+				failed.add();
+				close(conn, false);
+				continue;
+			}
+			conn.connected = true;
+			conn.active = coarse_ns();
+			opened.add();
+			watch(conn, false);
+			continue;
+		}
+
+		if (ev & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+			readable(conn, cb, userdata);
+		}
+		if (conn.fd >= 0 && conn.connected && (ev & EPOLLOUT) && !flush(conn)) {
+			dropped.add();
+			close(conn, true);
+			open(conn);
+		}
+	}
+
+	// reconnect and check for timeouts every 0.1s or so
+	uint64_t now = coarse_ns();
+	if (now - last_check > 100000000) {
+		last_check = now;
+		check_timeouts(now);
+	}
+}
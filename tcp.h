@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "queryfile.h"
+#include "stats.h"
+
+//
+// one thread's set of pipelined DNS over TCP connections to a server,
+// driven by an epoll event loop
+//
+// queries are written straight from the QueryFile arena, whose raw
+// format already has the two byte length prefix of TCP, with a single
+// writev(2) per connection for all the queries sent to it at once.
+// each connection has at most `depth` queries outstanding, and once
+// it's sent `reuse` queries (if not zero) and had all their responses
+// it's closed and another opened in its place.  connections that are
+// closed by the server, or which go a second without a response, are
+// also replaced, and their outstanding queries counted as lost.
+//
+// connections are closed with a reset so that the client's ports
+// aren't held in TIME_WAIT, which would otherwise limit the rate at
+// which new connections can be made.
+//
+class TcpClient {
+
+public:
+	typedef QueryFile::Record (*query_callback_t)(void *userdata);
+	typedef void	(*response_callback_t)(const uint8_t* msg, size_t len, void *userdata);
+
+	typedef struct {
+		sockaddr_storage	server;
+		socklen_t		server_len;
+		const sockaddr_storage*	sources;	// port zero, used in turn
+		size_t			source_count;	// 0 if unbound
+		socklen_t		source_len;
+		size_t			connections;
+		size_t			depth;
+		size_t			reuse;		// queries per connection, or 0
+	} config_t;
+
+private:
+	typedef struct {
+		int			fd = -1;
+		bool			connected = false;
+		size_t			sent = 0;
+		size_t			received = 0;
+		uint64_t		active = 0;	// time of last progress
+		std::vector<iovec>	pending;	// queries not yet written
+		std::vector<uint8_t>	partial;	// an incomplete response
+	} conn_t;
+
+	config_t			config;
+	int				epfd = -1;
+	std::vector<conn_t>		conns;
+	size_t				cursor = 0;	// next connection to send on
+	size_t				next_source = 0;
+	std::vector<uint8_t>		buffer;		// for reading responses
+	uint64_t			last_check = 0;
+
+private:
+	void				open(conn_t& conn);
+	void				close(conn_t& conn, bool lost);
+	void				watch(conn_t& conn, bool writing);
+	bool				flush(conn_t& conn);
+	void				readable(conn_t& conn, response_callback_t cb, void *userdata);
+	void				check_timeouts(uint64_t now);
+
+public:
+	Counter				opened;		// connections established
+	Counter				failed;		// connection attempts that failed
+	Counter				dropped;	// connections closed by the server
+	Counter				lost;		// queries never answered
+
+public:
+					TcpClient(const config_t& config);
+					TcpClient(const TcpClient&) = delete;
+	TcpClient&			operator=(const TcpClient&) = delete;
+					~TcpClient();
+
+public:
+	size_t				send(size_t n, query_callback_t cb, void *userdata);
+	void				poll(int timeout, response_callback_t cb, void *userdata);
+	void				close_all();
+};
@@ -69,6 +69,14 @@ inline timespec operator+(const timespec& a, const timespec& b)
 	return res;
 }
 
+//
+// convert a timespec to a count of ns
+//
+inline uint64_t to_ns(const timespec& ts)
+{
+	return ts.tv_sec * ns_per_s + ts.tv_nsec;
+}
+
 //
 // add ns to a timespec via the preceeding function
 //
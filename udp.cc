@@ -0,0 +1,384 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/mman.h>
+#include <linux/sock_diag.h>
+
+#include "udp.h"
+#include "util.h"
+
+UdpSockets::~UdpSockets()
+{
+	// the rings go first, so that nothing is still using the buffers
+	tx_ring.close();
+	rx_ring.close();
+
+	for (auto fd: fds) {
+		::close(fd);
+	}
+
+	if (bufs) {
+		::munmap(bufs, bufs_size);
+	}
+	if (buf_ring) {
+		::munmap(buf_ring, buf_ring_size);
+	}
+}
+
+//
+// opens a socket bound to each of the given source addresses (with
+// their ports), connected to the server so that they only receive
+// its responses
+//
+void UdpSockets::open(const sockaddr* server, socklen_t server_len,
+		      const std::vector<sockaddr_storage>& sources)
+{
+	for (auto& source: sources) {
+		int fd = ::socket(server->sa_family, SOCK_DGRAM, 0);
+		if (fd < 0) {
+			throw_errno("socket(SOCK_DGRAM)");
+		}
+		fds.push_back(fd);
+
+		// the kernel limits this to net.core.rmem_max
+		int size = 1 << 22;
+		::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+		if (::bind(fd, reinterpret_cast<const sockaddr*>(&source), server_len) < 0) {
+			throw_errno("bind(SOCK_DGRAM)");
+		}
+		if (::connect(fd, server, server_len) < 0) {
+			throw_errno("connect(SOCK_DGRAM)");
+		}
+	}
+}
+
+//
+// returns the number of datagrams the sockets have dropped since
+// this was last called
+//
+uint64_t UdpSockets::drops()
+{
+	uint64_t total = 0;
+
+	for (auto fd: fds) {
+		uint32_t mem[SK_MEMINFO_VARS];
+		socklen_t len = sizeof(mem);
+		if (::getsockopt(fd, SOL_SOCKET, SO_MEMINFO, mem, &len) < 0) {
+			throw_errno("getsockopt SO_MEMINFO");
+		}
+		total += mem[SK_MEMINFO_DROPS];
+	}
+
+	uint64_t res = total - dropped;
+	dropped = total;
+
+	return res;
+}
+
+//---------------------------------------------------------------------
+
+//
+// sets up the transmit side, with up to `slots` datagrams in flight
+//
+void UdpSockets::tx_enable(size_t slots, bool zerocopy)
+{
+	tx_ring.open(slots);
+	tx_slots.resize(slots);
+	for (size_t i = 0; i < slots; ++i) {
+		tx_free.push_back(slots - 1 - i);
+	}
+	this->zerocopy = zerocopy;
+}
+
+//
+// releases the slots of completed sends, each of which (when sent
+// with zero-copy) has a second completion once its data is no longer
+// needed by the kernel, and notes the queries of any that failed
+//
+void UdpSockets::tx_reap()
+{
+	io_uring_cqe* cqe;
+
+	while ((cqe = tx_ring.peek()) != nullptr) {
+		auto index = cqe->user_data;
+		int res = cqe->res;
+		unsigned flags = cqe->flags;
+		tx_ring.seen();
+
+		if (!(flags & IORING_CQE_F_NOTIF) && res < 0) {
+			auto& dgram = tx_slots[index].dgram;
+			if (res == -EIO && dgram.segment) {
+				gso = false;		// the route doesn't support GSO
+			} else if (res != -EAGAIN && res != -ENOBUFS && res != -ECONNREFUSED) {
+				errno = -res;
+				throw_errno("sendmsg");
+			}
+			tx_failed += dgram.segment ? dgram.iovlen : 1;
+		}
+
+		if (!(flags & IORING_CQE_F_MORE)) {
+			tx_free.push_back(index);
+		}
+	}
+}
+
+//
+// queues `n` queries as datagrams filled in by the callback, and
+// submits them all at once, only waiting if every slot is in use
+//
+// returns the number of queries sent, less those whose sends have
+// since been seen to fail (which may be from an earlier call)
+//
+size_t UdpSockets::tx_send(tx_callback_t cb, size_t n, void *userdata)
+{
+	size_t sent = 0;
+
+	while (sent < n) {
+		if (tx_free.empty()) {
+			if (tx_ring.submit(1) < 0 && errno != EINTR) {
+				throw_errno("io_uring_enter");
+			}
+			tx_reap();
+			continue;
+		}
+
+		auto sqe = tx_ring.get_sqe();
+		if (!sqe) {
+			throw std::runtime_error("io_uring submission queue full");
+		}
+
+		auto index = tx_free.back();
+		tx_free.pop_back();
+
+		auto& slot = tx_slots[index];
+		auto& dgram = slot.dgram;
+		dgram.iovlen = 0;
+		dgram.segment = 0;
+		sent += cb(dgram, std::min(n - sent, gso ? max_segments : 1), userdata);
+
+		auto& msg = slot.msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = dgram.iov;
+		msg.msg_iovlen = dgram.iovlen;
+
+		if (dgram.segment) {
+			msg.msg_control = slot.control.buf;
+			msg.msg_controllen = sizeof(slot.control.buf);
+			auto cm = CMSG_FIRSTHDR(&msg);
+			cm->cmsg_level = SOL_UDP;
+			cm->cmsg_type = UDP_SEGMENT;
+			cm->cmsg_len = CMSG_LEN(sizeof(dgram.segment));
+			memcpy(CMSG_DATA(cm), &dgram.segment, sizeof(dgram.segment));
+		}
+
+		sqe->opcode = zerocopy ? IORING_OP_SENDMSG_ZC : IORING_OP_SENDMSG;
+		sqe->fd = fds[dgram.socket];
+		sqe->addr = reinterpret_cast<uint64_t>(&msg);
+		sqe->len = 1;
+		sqe->user_data = index;
+	}
+
+	if (tx_ring.submit() < 0) {
+		throw_errno("io_uring_enter");
+	}
+	tx_reap();
+
+	auto failed = std::min(tx_failed, sent);
+	tx_failed -= failed;
+
+	return sent - failed;
+}
+
+//---------------------------------------------------------------------
+
+//
+// sets up the receive side, with `buf_count` (a power of two, up to
+// 32768) buffers of 2^buf_bits bytes each in a ring registered with
+// the kernel, and starts a multishot receive on every socket
+//
+void UdpSockets::rx_enable(size_t buf_bits, uint16_t buf_count)
+{
+	if (buf_count == 0 || (buf_count & (buf_count - 1)) || buf_count > 32768) {
+		throw std::runtime_error("receive buffer count must be a power of two");
+	}
+	buf_size = 1U << buf_bits;
+
+	// every buffer filled has a completion, plus one for each socket
+	// whose receive stops (e.g. because the buffers ran out)
+	unsigned entries = std::max(size_t(64), fds.size());
+	rx_ring.open(entries, 0, buf_count + entries);
+
+	bufs_size = size_t(buf_count) * buf_size;
+	auto p = ::mmap(nullptr, bufs_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (p == MAP_FAILED) {
+		throw_errno("mmap");
+	}
+	bufs = reinterpret_cast<uint8_t*>(p);
+
+	// the ring of free buffers is shared with the kernel, and must be
+	// page aligned
+	buf_ring_size = size_t(buf_count) * sizeof(io_uring_buf);
+	p = ::mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (p == MAP_FAILED) {
+		throw_errno("mmap");
+	}
+	buf_ring = reinterpret_cast<io_uring_buf*>(p);
+	buf_mask = buf_count - 1;
+
+	io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring);
+	reg.ring_entries = buf_count;
+	reg.bgid = 0;
+	if (rx_ring.register_op(IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		throw_errno("io_uring register buffer ring");
+	}
+
+	for (size_t bid = 0; bid < buf_count; ++bid) {
+		rx_provide(bid);
+	}
+	rx_publish();
+
+	for (size_t i = 0; i < fds.size(); ++i) {
+		rx_arm(i);
+	}
+	if (rx_ring.submit() < 0) {
+		throw_errno("io_uring_enter");
+	}
+
+	rx_dgrams.resize(64);
+	rx_bids.reserve(64);
+	rx_stopped.reserve(fds.size());
+}
+
+// returns a free SQE on the receive ring, making room if necessary
+io_uring_sqe* UdpSockets::rx_sqe()
+{
+	auto sqe = rx_ring.get_sqe();
+	if (!sqe) {
+		rx_ring.submit();
+		sqe = rx_ring.get_sqe();
+		if (!sqe) {
+			throw std::runtime_error("io_uring submission queue full");
+		}
+	}
+
+	return sqe;
+}
+
+// starts (or restarts) a multishot receive on a socket
+void UdpSockets::rx_arm(size_t socket)
+{
+	auto sqe = rx_sqe();
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fds[socket];
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = socket;
+}
+
+//
+// adds a buffer to the ring of free buffers, which the kernel only
+// sees once rx_publish() is next called
+//
+void UdpSockets::rx_provide(uint16_t bid)
+{
+	auto& buf = buf_ring[buf_tail & buf_mask];
+	buf.addr = reinterpret_cast<uint64_t>(bufs + size_t(bid) * buf_size);
+	buf.len = buf_size;
+	buf.bid = bid;
+	++buf_tail;
+}
+
+//
+// stores the free buffer ring's tail, which is the reserved field of
+// its first entry, with release semantics so that the kernel sees the
+// entries added before it.  (io_uring_buf_ring isn't used because its
+// flexible array member is misplaced when compiled as C++.)
+//
+void UdpSockets::rx_publish()
+{
+	__atomic_store_n(&buf_ring[0].resv, buf_tail, __ATOMIC_RELEASE);
+}
+
+//
+// waits up to `timeout` ms for responses and passes a batch of them
+// to the callback, returning the number received
+//
+int UdpSockets::rx_next_batch(rx_batch_callback_t cb, int timeout, void *userdata)
+{
+	if (!rx_ring.peek()) {
+		if (rx_ring.submit(1, timeout) < 0 && errno != ETIME && errno != EINTR) {
+			throw_errno("io_uring_enter");
+		}
+	}
+
+	size_t n = 0;
+	io_uring_cqe* cqe;
+
+	rx_bids.clear();
+	rx_stopped.clear();
+
+	while (n < rx_dgrams.size() && (cqe = rx_ring.peek()) != nullptr) {
+		auto socket = cqe->user_data;
+		int res = cqe->res;
+		unsigned flags = cqe->flags;
+		rx_ring.seen();
+
+		if (flags & IORING_CQE_F_BUFFER) {
+			uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+			if (res > 0) {
+				rx_dgrams[n++] = { bufs + size_t(bid) * buf_size, size_t(res), socket };
+			}
+			rx_bids.push_back(bid);
+		} else if (res < 0 && res != -ENOBUFS && res != -ECONNREFUSED) {
+			errno = -res;
+			throw_errno("recv");
+		}
+
+		// a receive stops when the buffers run out, or on an error
+		if (!(flags & IORING_CQE_F_MORE)) {
+			rx_stopped.push_back(socket);
+		}
+	}
+
+	if (n) {
+		cb(rx_dgrams.data(), n, userdata);
+	}
+
+	// return the buffers, before restarting any receives that stopped
+	// for want of them
+	if (!rx_bids.empty()) {
+		for (auto bid: rx_bids) {
+			rx_provide(bid);
+		}
+		rx_publish();
+	}
+	for (auto socket: rx_stopped) {
+		rx_arm(socket);
+	}
+
+	if (rx_ring.submit() < 0) {
+		throw_errno("io_uring_enter");
+	}
+
+	return n;
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "uring.h"
+
+//
+// a set of ordinary UDP sockets, each bound to its own source address
+// and port and connected to the server, which are driven by io_uring and so
+// need no special privileges
+//
+// the transmit side queues one SENDMSG (or SENDMSG_ZC, for zero-copy)
+// per datagram and submits each batch with a single system call.
+// queries of equal size may be sent as one datagram split by UDP GSO
+// into segments of that size.  the receive side has one multishot
+// RECV per socket, which takes buffers from a ring registered with the
+// kernel, so responses are read (and their buffers returned to the
+// ring) without any system calls other than the one that waits.
+//
+// the receive side and the transmit side (which each have their own
+// io_uring) may each be driven by a different thread
+//
+class UdpSockets {
+
+public:
+	static const size_t		max_segments = 64;
+
+	// a datagram to be sent, filled in by a tx_callback_t
+	typedef struct {
+		size_t			socket;		// index of the sending socket
+		iovec			iov[max_segments];
+		size_t			iovlen;
+		uint16_t		segment;	// GSO segment size, or 0
+		uint8_t			header[12 + 255];	// a rewritten start of the message
+	} datagram_t;
+
+	// a datagram received
+	typedef struct {
+		const uint8_t*		buf;
+		size_t			len;
+		size_t			socket;		// index of the receiving socket
+	} rx_datagram_t;
+
+	// fills in the next datagram to send, which may contain up to
+	// `max` queries, and returns the number of queries it contains
+	typedef size_t	(*tx_callback_t)(datagram_t& dgram, size_t max, void *userdata);
+	typedef void	(*rx_batch_callback_t)(rx_datagram_t* dgrams, size_t n, void *userdata);
+
+private:
+	typedef struct {
+		datagram_t		dgram;
+		msghdr			msg;
+		union {
+			cmsghdr		hdr;
+			uint8_t		buf[CMSG_SPACE(sizeof(uint16_t))];
+		} control;
+	} tx_slot_t;
+
+	std::vector<int>		fds;
+	uint64_t			dropped = 0;
+
+	IoUring				tx_ring;
+	std::vector<tx_slot_t>		tx_slots;
+	std::vector<uint32_t>		tx_free;
+	bool				zerocopy = false;
+	bool				gso = true;
+	size_t				tx_failed = 0;	// queries not yet deducted
+
+	IoUring				rx_ring;
+	uint8_t*			bufs = nullptr;
+	size_t				bufs_size = 0;
+	size_t				buf_size = 0;
+	io_uring_buf*			buf_ring = nullptr;	// of free buffers
+	size_t				buf_ring_size = 0;
+	uint16_t			buf_mask = 0;
+	uint16_t			buf_tail = 0;
+	std::vector<rx_datagram_t>	rx_dgrams;
+	std::vector<uint16_t>		rx_bids;
+	std::vector<size_t>		rx_stopped;
+
+private:
+	void				tx_reap();
+	io_uring_sqe*			rx_sqe();
+	void				rx_arm(size_t socket);
+	void				rx_provide(uint16_t bid);
+	void				rx_publish();
+
+public:
+					UdpSockets() = default;
+					UdpSockets(const UdpSockets&) = delete;
+	UdpSockets&			operator=(const UdpSockets&) = delete;
+					~UdpSockets();
+
+public:
+	void				open(const sockaddr* server, socklen_t server_len,
+					     const std::vector<sockaddr_storage>& sources);
+	size_t				size() const { return fds.size(); };
+	uint64_t			drops();
+
+	void				tx_enable(size_t slots, bool zerocopy);
+	size_t				tx_send(tx_callback_t cb, size_t n, void *userdata = nullptr);
+
+	void				rx_enable(size_t buf_bits, uint16_t buf_count);
+	int				rx_next_batch(rx_batch_callback_t cb, int timeout = -1, void *userdata = nullptr);
+};
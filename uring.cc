@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+#include "util.h"
+
+IoUring::~IoUring()
+{
+	close();
+}
+
+//
+// creates the instance and maps its rings, optionally with a larger
+// completion ring than the default of twice the submission ring
+//
+void IoUring::open(unsigned entries, unsigned flags, unsigned cq_entries)
+{
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = flags;
+	if (cq_entries) {
+		params.flags |= IORING_SETUP_CQSIZE;
+		params.cq_entries = cq_entries;
+	}
+
+	fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (fd < 0) {
+		throw_errno("io_uring_setup");
+	}
+	features = params.features;
+
+	auto map = [&](size_t size, off_t offset) {
+		auto p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+		if (p == MAP_FAILED) {
+			close();
+			throw_errno("mmap io_uring");
+		}
+		return p;
+	};
+
+	sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+	// with a single mapping both rings share the larger size
+	if (features & IORING_FEAT_SINGLE_MMAP) {
+		sq_map_size = cq_map_size = std::max(sq_map_size, cq_map_size);
+	}
+
+	sq_map = map(sq_map_size, IORING_OFF_SQ_RING);
+	if (features & IORING_FEAT_SINGLE_MMAP) {
+		cq_map = sq_map;
+	} else {
+		cq_map = map(cq_map_size, IORING_OFF_CQ_RING);
+	}
+
+	sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+	sqes = reinterpret_cast<io_uring_sqe*>(map(sqes_size, IORING_OFF_SQES));
+
+	auto sq = reinterpret_cast<uint8_t*>(sq_map);
+	sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+	sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+	sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+	sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+	sq_entries = params.sq_entries;
+	sq_local = *sq_tail;
+
+	auto cq = reinterpret_cast<uint8_t*>(cq_map);
+	cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+	cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+	cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+	cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+}
+
+void IoUring::close()
+{
+	if (sqes) {
+		::munmap(sqes, sqes_size);
+		sqes = nullptr;
+	}
+
+	if (cq_map && cq_map != sq_map) {
+		::munmap(cq_map, cq_map_size);
+	}
+	cq_map = nullptr;
+
+	if (sq_map) {
+		::munmap(sq_map, sq_map_size);
+		sq_map = nullptr;
+	}
+
+	if (fd >= 0) {
+		::close(fd);
+		fd = -1;
+	}
+}
+
+//
+// returns the next free SQE (cleared), or null if the ring is full
+//
+io_uring_sqe* IoUring::get_sqe()
+{
+	unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	if (sq_local - head >= sq_entries) {
+		return nullptr;
+	}
+
+	unsigned index = sq_local & sq_mask;
+	sq_array[index] = index;
+	++sq_local;
+
+	auto sqe = &sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+//
+// passes any SQEs that the kernel hasn't yet consumed to it, optionally
+// waiting for at least the given number of completions (for up to
+// `timeout` ms, if not negative), and returns the number submitted
+// (or -1 with errno set, which is ETIME if the wait timed out)
+//
+int IoUring::submit(unsigned wait, int timeout)
+{
+	unsigned pending = sq_local - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	__atomic_store_n(sq_tail, sq_local, __ATOMIC_RELEASE);
+
+	if (pending == 0 && wait == 0) {
+		return 0;
+	}
+
+	unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+	if (!wait || timeout < 0) {
+		return syscall(__NR_io_uring_enter, fd, pending, wait, flags, nullptr, 0);
+	}
+
+	__kernel_timespec ts = { timeout / 1000, (timeout % 1000) * 1000000LL };
+	io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = reinterpret_cast<uint64_t>(&ts);
+
+	flags |= IORING_ENTER_EXT_ARG;
+	return syscall(__NR_io_uring_enter, fd, pending, wait, flags, &arg, sizeof(arg));
+}
+
+//
+// withdraws any SQEs that the kernel hasn't consumed, e.g. after
+// submit() failed, and returns how many there were
+//
+unsigned IoUring::retract()
+{
+	unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	unsigned n = sq_local - head;
+	sq_local = head;
+	__atomic_store_n(sq_tail, sq_local, __ATOMIC_RELEASE);
+	return n;
+}
+
+//
+// makes an io_uring_register() call on the instance, returning its
+// result (or -1 with errno set)
+//
+int IoUring::register_op(unsigned opcode, void* arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+//
+// returns the oldest unseen completion, or null if there are none
+//
+io_uring_cqe* IoUring::peek()
+{
+	unsigned head = *cq_head;
+	if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+		return nullptr;
+	}
+	return &cqes[head & cq_mask];
+}
+
+//
+// releases the completion last returned by peek()
+//
+void IoUring::seen()
+{
+	__atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <linux/io_uring.h>
+
+//
+// a minimal io_uring instance, driven directly by system calls so
+// that liburing isn't required
+//
+// it's only for use by one thread at a time.  SQEs are obtained with
+// get_sqe(), filled in, and then passed to the kernel by submit(),
+// after which completions are read with peek() and released with
+// seen() without any further system calls.  any SQEs that a failed
+// submit() didn't pass are passed by the next, unless withdrawn with
+// retract().
+//
+class IoUring {
+
+private:
+	void*				sq_map = nullptr;
+	size_t				sq_map_size = 0;
+	void*				cq_map = nullptr;
+	size_t				cq_map_size = 0;
+	io_uring_sqe*			sqes = nullptr;
+	size_t				sqes_size = 0;
+
+	unsigned*			sq_head;
+	unsigned*			sq_tail;
+	unsigned*			sq_array;
+	unsigned			sq_mask;
+	unsigned			sq_entries;
+	unsigned			sq_local;	// tail including unsubmitted SQEs
+
+	unsigned*			cq_head;
+	unsigned*			cq_tail;
+	io_uring_cqe*			cqes;
+	unsigned			cq_mask;
+
+	unsigned			features = 0;
+
+public:
+	int				fd = -1;
+
+public:
+					IoUring() = default;
+					IoUring(const IoUring&) = delete;
+	IoUring&			operator=(const IoUring&) = delete;
+					~IoUring();
+
+public:
+	void				open(unsigned entries, unsigned flags = 0, unsigned cq_entries = 0);
+	void				close();
+
+	bool				has_feature(unsigned feature) const { return features & feature; };
+
+	io_uring_sqe*			get_sqe();
+	int				submit(unsigned wait = 0, int timeout = -1);
+	unsigned			retract();
+
+	int				register_op(unsigned opcode, void* arg, unsigned nr_args);
+
+	io_uring_cqe*			peek();
+	void				seen();
+};
@@ -11,6 +11,12 @@
 
 #include <system_error>
 #include <cerrno>
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
 
 #include "util.h"
 
@@ -21,3 +27,28 @@ void throw_errno(const std::string& what)
 {
 	throw std::system_error(errno, std::system_category(), what);
 }
+
+//
+// retrieves the MAC address of the specified interface
+//
+void if_hwaddr(unsigned int ifindex, ether_addr& addr)
+{
+	ifreq ifr;
+	memset(&ifr, 0, sizeof(ifr));
+	if (!if_indextoname(ifindex, ifr.ifr_name)) {
+		throw_errno("if_indextoname");
+	}
+
+	int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		throw_errno("socket(AF_INET, SOCK_DGRAM)");
+	}
+
+	int res = ::ioctl(fd, SIOCGIFHWADDR, &ifr);
+	::close(fd);
+	if (res < 0) {
+		throw_errno("ioctl SIOCGIFHWADDR");
+	}
+
+	memcpy(&addr, ifr.ifr_hwaddr.sa_data, sizeof(addr));
+}
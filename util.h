@@ -12,5 +12,7 @@
 #pragma once
 
 #include <string>
+#include <netinet/ether.h>
 
 extern void throw_errno(const std::string& what);
+extern void if_hwaddr(unsigned int ifindex, ether_addr& addr);
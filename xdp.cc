@@ -0,0 +1,497 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#include <stdexcept>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+
+#include "xdp.h"
+#include "util.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+static int bpf(int cmd, bpf_attr& attr)
+{
+	return ::syscall(__NR_bpf, cmd, &attr, sizeof(attr));
+}
+
+static bpf_insn insn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm)
+{
+	bpf_insn i;
+	i.code = code;
+	i.dst_reg = dst;
+	i.src_reg = src;
+	i.off = off;
+	i.imm = imm;
+	return i;
+}
+
+XdpProgram::~XdpProgram()
+{
+	// closing the link detaches the program from the interface
+	if (link_fd >= 0) ::close(link_fd);
+	if (prog_fd >= 0) ::close(prog_fd);
+	if (map_fd >= 0) ::close(map_fd);
+}
+
+//
+// loads the (hand-assembled) redirect program, which is equivalent to
+// the following, where `port` is the UDP source port if `source` is
+// set, and otherwise the destination port:
+//
+//	if (data + 34 > data_end) return XDP_PASS;
+//	if (eth->h_proto == htons(ETH_P_IPV6)) {
+//		if (ip6->nexthdr != IPPROTO_UDP) return XDP_PASS;
+//		udp = data + 54;
+//	} else {
+//		if (eth->h_proto != htons(ETH_P_IP)) return XDP_PASS;
+//		if (ip->protocol != IPPROTO_UDP) return XDP_PASS;
+//		udp = data + 14 + ip->ihl * 4;
+//	}
+//	if (udp + 8 > data_end) return XDP_PASS;
+//	if (udp->port != htons(port)) return XDP_PASS;
+//	return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS);
+//
+void XdpProgram::load(uint16_t port, bool source)
+{
+	const uint8_t ldxw = BPF_LDX | BPF_MEM | BPF_W;
+	const uint8_t ldxh = BPF_LDX | BPF_MEM | BPF_H;
+	const uint8_t ldxb = BPF_LDX | BPF_MEM | BPF_B;
+
+	bpf_insn prog[] = {
+		insn(ldxw, 2, 1, 0, 0),					// r2 = ctx->data
+		insn(ldxw, 3, 1, 4, 0),					// r3 = ctx->data_end
+		insn(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0),		// r4 = r2
+		insn(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, 34),		// r4 += ETH_HLEN + sizeof(iphdr)
+		insn(BPF_JMP | BPF_JGT | BPF_X, 4, 3, 22, 0),		// if r4 > r3 goto pass
+		insn(ldxh, 5, 2, 12, 0),				// r5 = eth->h_proto
+		insn(BPF_JMP | BPF_JEQ | BPF_K, 5, 0, 22, htons(ETH_P_IPV6)),
+		insn(BPF_JMP | BPF_JNE | BPF_K, 5, 0, 19, htons(ETH_P_IP)),
+		insn(ldxb, 5, 2, 23, 0),				// r5 = ip->protocol
+		insn(BPF_JMP | BPF_JNE | BPF_K, 5, 0, 17, IPPROTO_UDP),
+		insn(ldxb, 5, 2, 14, 0),				// r5 = ip->ihl * 4
+		insn(BPF_ALU64 | BPF_AND | BPF_K, 5, 0, 0, 0x0f),
+		insn(BPF_ALU64 | BPF_LSH | BPF_K, 5, 0, 0, 2),
+		insn(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0),		// r4 = r2 + ETH_HLEN + r5
+		insn(BPF_ALU64 | BPF_ADD | BPF_X, 4, 5, 0, 0),
+		insn(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, 14),
+		insn(BPF_ALU64 | BPF_MOV | BPF_X, 5, 4, 0, 0),		// udp: r5 = r4 + sizeof(udphdr)
+		insn(BPF_ALU64 | BPF_ADD | BPF_K, 5, 0, 0, 8),
+		insn(BPF_JMP | BPF_JGT | BPF_X, 5, 3, 8, 0),		// if r5 > r3 goto pass
+		insn(ldxh, 5, 4, source ? 0 : 2, 0),			// r5 = udp->source or udp->dest
+		insn(BPF_JMP | BPF_JNE | BPF_K, 5, 0, 6, htons(port)),
+		insn(ldxw, 2, 1, 16, 0),				// redirect: r2 = ctx->rx_queue_index
+		insn(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, map_fd),
+		insn(0, 0, 0, 0, 0),					// (second half of ld_imm64)
+		insn(BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS),	// r3 = fallback action
+		insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+		insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+		insn(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS),	// pass: r0 = XDP_PASS
+		insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+		insn(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, 20),		// ipv6: r4 += sizeof(ipv6hdr) - sizeof(iphdr)
+		insn(ldxb, 5, 2, 20, 0),				// r5 = ip6->nexthdr
+		insn(BPF_JMP | BPF_JNE | BPF_K, 5, 0, -5, IPPROTO_UDP),
+		insn(BPF_JMP | BPF_JA, 0, 0, -17, 0),			// goto udp
+	};
+
+	static const char license[] = "GPL";
+	static char log[4096];
+
+	bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+	attr.insns = reinterpret_cast<uint64_t>(prog);
+	attr.license = reinterpret_cast<uint64_t>(license);
+	attr.log_buf = reinterpret_cast<uint64_t>(log);
+	attr.log_size = sizeof(log);
+	attr.log_level = 1;
+	attr.expected_attach_type = BPF_XDP;
+
+	prog_fd = bpf(BPF_PROG_LOAD, attr);
+	if (prog_fd < 0) {
+		throw_errno(std::string("bpf(BPF_PROG_LOAD): ") + log);
+	}
+}
+
+//
+// creates the XSKMAP, loads the program and attaches it to the
+// interface, preferring native (driver) mode and falling back to
+// generic (SKB) mode where the driver doesn't support XDP
+//
+// only UDP packets from `port` (if `source` is set) or to it are
+// redirected, so that the rest of the host's UDP traffic on the
+// interface still reaches the kernel
+//
+void XdpProgram::attach(unsigned int ifindex, unsigned int queues, uint16_t port, bool source)
+{
+	bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(uint32_t);
+	attr.max_entries = queues;
+
+	map_fd = bpf(BPF_MAP_CREATE, attr);
+	if (map_fd < 0) {
+		throw_errno("bpf(BPF_MAP_CREATE)");
+	}
+
+	load(port, source);
+
+	for (auto flags : { XDP_FLAGS_DRV_MODE, XDP_FLAGS_SKB_MODE }) {
+		memset(&attr, 0, sizeof(attr));
+		attr.link_create.prog_fd = prog_fd;
+		attr.link_create.target_ifindex = ifindex;
+		attr.link_create.attach_type = BPF_XDP;
+		attr.link_create.flags = flags;
+
+		link_fd = bpf(BPF_LINK_CREATE, attr);
+		if (link_fd >= 0) {
+			native = (flags == XDP_FLAGS_DRV_MODE);
+			return;
+		}
+	}
+
+	throw_errno("bpf(BPF_LINK_CREATE)");
+}
+
+//
+// registers an AF_XDP socket as the target for the given queue
+//
+void XdpProgram::add(uint32_t queue, int xsk_fd) const
+{
+	uint32_t value = xsk_fd;
+
+	bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map_fd;
+	attr.key = reinterpret_cast<uint64_t>(&queue);
+	attr.value = reinterpret_cast<uint64_t>(&value);
+	attr.flags = BPF_ANY;
+
+	if (bpf(BPF_MAP_UPDATE_ELEM, attr) < 0) {
+		throw_errno("bpf(BPF_MAP_UPDATE_ELEM)");
+	}
+}
+
+//---------------------------------------------------------------------
+
+XdpSocket::~XdpSocket()
+{
+	for (auto* ring : { &fill, &comp, &rx, &tx }) {
+		if (ring->map) {
+			::munmap(ring->map, ring->map_size);
+		}
+	}
+
+	if (fd >= 0) {
+		::close(fd);
+	}
+
+	if (umem) {
+		::munmap(umem, umem_size);
+	}
+}
+
+//
+// maps one of the four AF_XDP rings into user space
+//
+void XdpSocket::ring_map(ring_t& ring, const xdp_ring_offset& off, size_t entry_size, uint64_t pgoff, uint32_t n)
+{
+	ring.map_size = off.desc + n * entry_size;
+
+	void *p = ::mmap(NULL, ring.map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+	if (p == MAP_FAILED) {
+		throw_errno("mmap AF_XDP ring");
+	}
+
+	auto base = reinterpret_cast<uint8_t*>(p);
+	ring.map = p;
+	ring.producer = reinterpret_cast<uint32_t*>(base + off.producer);
+	ring.consumer = reinterpret_cast<uint32_t*>(base + off.consumer);
+	ring.flags = reinterpret_cast<uint32_t*>(base + off.flags);
+	ring.desc = base + off.desc;
+	ring.mask = n - 1;
+}
+
+//
+// creates the socket, its UMEM and rings, and binds it to the given
+// interface queue, trying zero-copy mode first when the program is
+// running in native mode
+//
+// frame_nr must be a power of two
+//
+void XdpSocket::open(const XdpProgram& prog, unsigned int ifindex, uint32_t queue, size_t frame_bits, size_t nr)
+{
+	frame_size = (1 << frame_bits);
+	frame_nr = nr;
+
+	uint32_t half = frame_nr / 2;
+	if (half == 0 || (frame_nr & (frame_nr - 1))) {
+		throw std::runtime_error("AF_XDP frame count must be a power of two");
+	}
+
+	fd = ::socket(AF_XDP, SOCK_RAW, 0);
+	if (fd < 0) {
+		throw_errno("socket(AF_XDP)");
+	}
+
+	// allocate and register the UMEM
+	umem_size = frame_size * frame_nr;
+	void *p = ::mmap(NULL, umem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (p == MAP_FAILED) {
+		throw_errno("mmap UMEM");
+	}
+	umem = reinterpret_cast<uint8_t*>(p);
+
+	xdp_umem_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.addr = reinterpret_cast<uint64_t>(umem);
+	reg.len = umem_size;
+	reg.chunk_size = frame_size;
+	reg.headroom = 0;
+
+	if (::setsockopt(fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0) {
+		throw_errno("setsockopt XDP_UMEM_REG");
+	}
+
+	// every ring holds one half of the UMEM
+	if (::setsockopt(fd, SOL_XDP, XDP_UMEM_FILL_RING, &half, sizeof(half)) < 0 ||
+	    ::setsockopt(fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &half, sizeof(half)) < 0 ||
+	    ::setsockopt(fd, SOL_XDP, XDP_RX_RING, &half, sizeof(half)) < 0 ||
+	    ::setsockopt(fd, SOL_XDP, XDP_TX_RING, &half, sizeof(half)) < 0)
+	{
+		throw_errno("setsockopt AF_XDP ring size");
+	}
+
+	xdp_mmap_offsets off;
+	socklen_t optlen = sizeof(off);
+	if (::getsockopt(fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0) {
+		throw_errno("getsockopt XDP_MMAP_OFFSETS");
+	}
+
+	ring_map(fill, off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING, half);
+	ring_map(comp, off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING, half);
+	ring_map(rx, off.rx, sizeof(xdp_desc), XDP_PGOFF_RX_RING, half);
+	ring_map(tx, off.tx, sizeof(xdp_desc), XDP_PGOFF_TX_RING, half);
+
+	// bind, preferring zero-copy if the driver supports it
+	sockaddr_xdp saddr;
+	memset(&saddr, 0, sizeof(saddr));
+	saddr.sxdp_family = AF_XDP;
+	saddr.sxdp_ifindex = ifindex;
+	saddr.sxdp_queue_id = queue;
+
+	int res = -1;
+	if (prog.is_native()) {
+		saddr.sxdp_flags = XDP_ZEROCOPY | XDP_USE_NEED_WAKEUP;
+		res = ::bind(fd, reinterpret_cast<sockaddr *>(&saddr), sizeof(saddr));
+		zerocopy = (res == 0);
+	}
+
+	if (res < 0) {
+		saddr.sxdp_flags = XDP_COPY | XDP_USE_NEED_WAKEUP;
+		if (::bind(fd, reinterpret_cast<sockaddr *>(&saddr), sizeof(saddr)) < 0) {
+			throw_errno("bind AF_XDP");
+		}
+	}
+
+	// give the lower half of the UMEM to the kernel for receiving
+	auto fq = reinterpret_cast<uint64_t*>(fill.desc);
+	for (uint32_t i = 0; i < half; ++i) {
+		fq[i] = i * frame_size;
+	}
+	__atomic_store_n(fill.producer, half, __ATOMIC_RELEASE);
+
+	// and keep the upper half for transmitting
+	tx_free.reserve(half);
+	for (uint32_t i = half; i < frame_nr; ++i) {
+		tx_free.push_back(i * frame_size);
+	}
+
+	prog.add(queue, fd);
+}
+
+int XdpSocket::poll(short events, int timeout)
+{
+	pollfd pfd = { fd, events, 0 };
+	int res = ::poll(&pfd, 1, timeout);
+	if (res < 0 && errno != EINTR) {
+		throw_errno("poll AF_XDP");
+	}
+
+	return std::max(res, 0);
+}
+
+//
+// asks the kernel to start processing the TX ring
+//
+void XdpSocket::kick()
+{
+	if (::sendto(fd, nullptr, 0, MSG_DONTWAIT, nullptr, 0) < 0) {
+		switch (errno) {
+			case EAGAIN: case EBUSY: case ENOBUFS: case ENETDOWN:
+				break;
+			default:
+				throw_errno("sendto AF_XDP");
+		}
+	}
+}
+
+//
+// returns transmitted frames from the completion ring to the free list
+//
+void XdpSocket::tx_reclaim()
+{
+	uint32_t cons = *comp.consumer;
+	uint32_t prod = __atomic_load_n(comp.producer, __ATOMIC_ACQUIRE);
+	auto cq = reinterpret_cast<uint64_t*>(comp.desc);
+
+	for (uint32_t i = cons; i != prod; ++i) {
+		tx_free.push_back(cq[i & comp.mask]);
+	}
+
+	__atomic_store_n(comp.consumer, prod, __ATOMIC_RELEASE);
+}
+
+//
+// returns the number of received packets that were dropped (e.g.
+// because the RX ring was full) since this was last called
+//
+uint64_t XdpSocket::drops()
+{
+	xdp_statistics st = { };
+	socklen_t len = sizeof(st);
+	if (::getsockopt(fd, SOL_XDP, XDP_STATISTICS, &st, &len) < 0) {
+		throw_errno("getsockopt XDP_STATISTICS");
+	}
+
+	// unlike PACKET_STATISTICS these are cumulative
+	uint64_t total = st.rx_dropped + st.rx_ring_full;
+	uint64_t res = total - dropped;
+	dropped = total;
+
+	return res;
+}
+
+//
+// consumes every packet currently on the RX ring and passes them
+// to the specified callback function in a single call, after which
+// their frames are returned to the fill ring
+//
+// each frame's buffer starts at the network header, with the
+// Ethernet header immediately preceding it, and has no address
+//
+int XdpSocket::rx_next_batch(PacketSocket::rx_batch_callback_t callback, int timeout, void *userdata)
+{
+	uint32_t cons = *rx.consumer;
+	uint32_t prod = __atomic_load_n(rx.producer, __ATOMIC_ACQUIRE);
+
+	if (prod == cons) {
+		if (poll(POLLIN, timeout) == 0) return 0;
+		prod = __atomic_load_n(rx.producer, __ATOMIC_ACQUIRE);
+		if (prod == cons) return 0;
+	}
+
+	uint32_t n = prod - cons;
+	if (rx_frames.size() < n) {
+		rx_frames.resize(n);
+		rx_addrs.resize(n);
+	}
+
+	auto rq = reinterpret_cast<xdp_desc*>(rx.desc);
+	for (uint32_t i = 0; i < n; ++i) {
+		auto& desc = rq[(cons + i) & rx.mask];
+		auto& frame = rx_frames[i];
+		frame.buf = umem + desc.addr + ETH_HLEN;
+		frame.buflen = desc.len > ETH_HLEN ? desc.len - ETH_HLEN : 0;
+		frame.addr = nullptr;
+		frame.timestamp = 0;
+		rx_addrs[i] = desc.addr & ~uint64_t(frame_size - 1);
+	}
+	__atomic_store_n(rx.consumer, prod, __ATOMIC_RELEASE);
+
+	callback(rx_frames.data(), n, userdata);
+
+	// there's always room, since the fill ring holds every RX frame
+	uint32_t fprod = *fill.producer;
+	auto fq = reinterpret_cast<uint64_t*>(fill.desc);
+	for (uint32_t i = 0; i < n; ++i) {
+		fq[(fprod + i) & fill.mask] = rx_addrs[i];
+	}
+	__atomic_store_n(fill.producer, fprod + n, __ATOMIC_RELEASE);
+
+	if (__atomic_load_n(fill.flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP) {
+		::recvfrom(fd, nullptr, 0, MSG_DONTWAIT, nullptr, nullptr);
+	}
+
+	return n;
+}
+
+//
+// fills up to `n` free UMEM frames via the specified callback
+// function (which must write a complete Ethernet frame and return
+// its length), places them on the TX ring and kicks the kernel
+//
+// returns the number of frames queued, which may be less than
+// requested if no free frames become available within the timeout
+//
+size_t XdpSocket::tx_send(PacketSocket::tx_callback_t callback, size_t n, int timeout, void *userdata)
+{
+	tx_reclaim();
+
+	if (tx_free.empty()) {
+		kick();
+		if (poll(POLLOUT, timeout) == 0) return 0;
+		tx_reclaim();
+	}
+
+	n = std::min(n, tx_free.size());
+
+	uint32_t prod = *tx.producer;
+	auto tq = reinterpret_cast<xdp_desc*>(tx.desc);
+	for (size_t i = 0; i < n; ++i) {
+		auto addr = tx_free.back();
+		tx_free.pop_back();
+
+		auto& desc = tq[(prod + i) & tx.mask];
+		desc.addr = addr;
+		desc.len = callback(umem + addr, frame_size, userdata);
+		desc.options = 0;
+	}
+	__atomic_store_n(tx.producer, prod + n, __ATOMIC_RELEASE);
+
+	if (n > 0 && (__atomic_load_n(tx.flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP)) {
+		kick();
+	}
+
+	return n;
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * See the COPYRIGHT file distributed with this work for additional
+ * information regarding copyright ownership.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <linux/if_xdp.h>
+
+#include "packet.h"
+
+//
+// the XDP program and XSKMAP shared by every AF_XDP socket on an
+// interface.  IPv4 and IPv6 UDP packets from (or to) the DNS port are
+// redirected to the socket bound to the receiving queue, and everything
+// else (e.g. ARP, or other UDP services) is passed up to the kernel as
+// normal.
+//
+class XdpProgram {
+
+private:
+	int		map_fd = -1;
+	int		prog_fd = -1;
+	int		link_fd = -1;
+	bool		native = false;
+
+private:
+	void		load(uint16_t port, bool source);
+
+public:
+			~XdpProgram();
+
+public:
+	void		attach(unsigned int ifindex, unsigned int queues, uint16_t port, bool source);
+	void		add(uint32_t queue, int xsk_fd) const;
+	bool		is_native() const { return native; };
+};
+
+//
+// an AF_XDP socket bound to a single interface queue, with one UMEM
+// whose frames are split evenly between receive (via the fill ring)
+// and transmit (via the completion ring)
+//
+// the receive side (rx and fill rings) and the transmit side (tx
+// and completion rings) may each be driven by a different thread
+//
+class XdpSocket {
+
+private:
+	typedef struct {
+		uint32_t*	producer;
+		uint32_t*	consumer;
+		uint32_t*	flags;
+		void*		desc;
+		uint32_t	mask;
+		void*		map;
+		size_t		map_size;
+	} ring_t;
+
+private:
+	uint8_t*	umem = nullptr;
+	size_t		umem_size = 0;
+	size_t		frame_size;
+	size_t		frame_nr;
+	bool		zerocopy = false;
+	uint64_t	dropped = 0;
+
+	ring_t		fill = {};
+	ring_t		comp = {};
+	ring_t		rx = {};
+	ring_t		tx = {};
+
+	std::vector<uint64_t>			tx_free;
+	std::vector<PacketSocket::rx_frame_t>	rx_frames;
+	std::vector<uint64_t>			rx_addrs;
+
+private:
+	void		ring_map(ring_t& ring, const xdp_ring_offset& off, size_t entry_size, uint64_t pgoff, uint32_t n);
+	int		poll(short events, int timeout);
+	void		kick();
+	void		tx_reclaim();
+
+public:
+	int		fd = -1;
+
+public:
+			~XdpSocket();
+
+public:
+	void		open(const XdpProgram& prog, unsigned int ifindex, uint32_t queue, size_t frame_bits, size_t frame_nr);
+	bool		is_zerocopy() const { return zerocopy; };
+	uint64_t	drops();
+
+	int		rx_next_batch(PacketSocket::rx_batch_callback_t cb, int timeout = -1, void *userdata = nullptr);
+	size_t		tx_send(PacketSocket::tx_callback_t cb, size_t n, int timeout = -1, void *userdata = nullptr);
+};